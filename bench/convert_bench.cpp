@@ -0,0 +1,246 @@
+// Pixel conversion benchmark: checks every kernel against the scalar reference, then times them and
+// the row-split conversion for the formats the feed path accepts, and the simulcast downscale.
+//
+//   ./build/Release/convert_bench [size=1280x720,1920x1080] [threads=1,2,4] [iterations=50]
+//
+// Odd widths of the test pattern make sure the SIMD tails are covered by the correctness check.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../cpp/pixel_convert.hpp"
+#include "../cpp/pixel_scale.hpp"
+
+struct kernel_t
+{
+    const char *name;
+    row_pair_converter convert;
+};
+
+struct layout_t
+{
+    const char *name;
+    pixel_layout_t layout;
+    std::vector<kernel_t> kernels;
+};
+
+template <pixel_layout_t L>
+static layout_t kernels_for(const char *name)
+{
+    layout_t result = {name, L, {{"scalar", convert_row_pair_scalar<L>}}};
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if constexpr (is_packed_yuv(L))
+    {
+        result.kernels.push_back({"sse2", convert_packed_sse2<L>});
+        if (__builtin_cpu_supports("avx2"))
+            result.kernels.push_back({"avx2", convert_packed_avx2<L>});
+    }
+    else
+    {
+        if (__builtin_cpu_supports("ssse3"))
+            result.kernels.push_back({"ssse3", convert_row_pair_ssse3<L>});
+        if (__builtin_cpu_supports("avx2"))
+            result.kernels.push_back({"avx2", convert_row_pair_avx2<L>});
+    }
+#elif defined(CONVERT_NEON)
+    if constexpr (is_packed_yuv(L))
+        result.kernels.push_back({"neon", convert_packed_neon<L>});
+    else
+        result.kernels.push_back({"neon", convert_row_pair_neon<L>});
+#endif
+    return result;
+}
+
+static std::vector<std::string> split_list(const std::string &value)
+{
+    std::vector<std::string> items;
+    std::stringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+// A destination picture laid out the way the OUTPUT buffer is, with the given luma stride.
+struct picture_t
+{
+    std::vector<uint8_t> bytes;
+    yuv420_image_t image;
+
+    picture_t(uint32_t stride, uint32_t height, bool nv12) : bytes(stride * height * 3 / 2)
+    {
+        image.y = bytes.data();
+        image.y_stride = stride;
+        image.nv12 = nv12;
+        image.u = bytes.data() + stride * height;
+        image.uv_stride = nv12 ? stride : stride / 2;
+        image.v = nv12 ? nullptr : image.u + image.uv_stride * height / 2;
+    }
+};
+
+static bool check(const layout_t &layout, std::mt19937 &rng)
+{
+    bool ok = true;
+    for (uint32_t width : {2u, 14u, 30u, 62u, 130u, 642u})
+    {
+        uint32_t height = 6;
+        uint32_t src_stride = width * bytes_per_pixel(layout.layout) + 8;
+        std::vector<uint8_t> src(src_stride * height);
+        for (uint8_t &byte : src)
+            byte = rng();
+        for (bool nv12 : {true, false})
+        {
+            picture_t expected(width + 2, height, nv12);
+            convert_rows(layout.kernels[0].convert, src.data(), src_stride, width, expected.image, 0, height / 2);
+            for (const kernel_t &kernel : layout.kernels)
+            {
+                picture_t actual(width + 2, height, nv12);
+                convert_rows(kernel.convert, src.data(), src_stride, width, actual.image, 0, height / 2);
+                if (actual.bytes != expected.bytes)
+                {
+                    printf("MISMATCH %s %s width=%u %s\n", layout.name, kernel.name, width, nv12 ? "nv12" : "i420");
+                    ok = false;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+// The vertical blend is the vectorized half of the scaler.
+static bool check_blend(std::mt19937 &rng)
+{
+    bool ok = true;
+    for (uint32_t n : {1u, 15u, 16u, 33u, 642u})
+        for (uint32_t w = 0; w < 128; w += 5)
+        {
+            std::vector<uint8_t> a(n), b(n), expected(n), actual(n);
+            for (uint32_t i = 0; i < n; i++)
+                a[i] = rng(), b[i] = rng();
+            blend_rows_scalar(a.data(), b.data(), expected.data(), n, w);
+            blend_rows(a.data(), b.data(), actual.data(), n, w);
+            if (actual != expected)
+            {
+                printf("MISMATCH blend n=%u w=%u\n", n, w);
+                ok = false;
+            }
+        }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    std::map<std::string, std::string> args = {{"size", "1280x720,1920x1080"}, {"threads", "1,2,4"}, {"iterations", "50"}};
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos || !args.count(arg.substr(0, eq)))
+        {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            return 2;
+        }
+        args[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    uint32_t iterations = std::stoul(args["iterations"]);
+
+    std::vector<layout_t> layouts = {
+        kernels_for<pixel_layout_t::RGBA>("rgba"), kernels_for<pixel_layout_t::BGRA>("bgra"), kernels_for<pixel_layout_t::RGB24>("rgb24"),
+        kernels_for<pixel_layout_t::YUYV>("yuyv"), kernels_for<pixel_layout_t::UYVY>("uyvy"),
+    };
+
+    std::mt19937 rng(1);
+    bool ok = true;
+    for (const layout_t &layout : layouts)
+        ok = check(layout, rng) && ok;
+    ok = check_blend(rng) && ok;
+    printf("correctness: %s\n\n", ok ? "all kernels match the scalar reference" : "FAILED");
+
+    printf("%-6s %-10s %-5s %-7s %7s %10s %10s %8s\n", "input", "size", "out", "kernel", "threads", "ms/frame", "Mpix/s", "speedup");
+    for (const std::string &size : split_list(args["size"]))
+    {
+        uint32_t width = 0, height = 0;
+        sscanf(size.c_str(), "%ux%u", &width, &height);
+        for (const layout_t &layout : layouts)
+        {
+            uint32_t src_stride = width * bytes_per_pixel(layout.layout);
+            std::vector<uint8_t> src(src_stride * height);
+            for (uint8_t &byte : src)
+                byte = rng();
+            for (bool nv12 : {true, false})
+            {
+                picture_t picture(width, height, nv12);
+                double scalar_ms = 0;
+                auto time = [&](row_pair_converter convert, RowPool &pool) {
+                    std::function<void(uint32_t, uint32_t)> job = [&](uint32_t begin, uint32_t end) {
+                        convert_rows(convert, src.data(), src_stride, width, picture.image, begin, end);
+                    };
+                    pool.run(height / 2, job);
+                    auto begin = std::chrono::steady_clock::now();
+                    for (uint32_t i = 0; i < iterations; i++)
+                        pool.run(height / 2, job);
+                    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() / iterations;
+                };
+                auto report = [&](const char *kernel, uint32_t threads, double ms) {
+                    printf("%-6s %-10s %-5s %-7s %7u %10.3f %10.1f %7.2fx\n", layout.name, size.c_str(), nv12 ? "nv12" : "i420", kernel, threads, ms, width * height / ms / 1000,
+                           scalar_ms / ms);
+                };
+                RowPool single(1);
+                for (const kernel_t &kernel : layout.kernels)
+                {
+                    double ms = time(kernel.convert, single);
+                    if (kernel.convert == layout.kernels[0].convert)
+                        scalar_ms = ms;
+                    report(kernel.name, 1, ms);
+                }
+                // the kernel the feed path would pick, split across threads
+                for (const std::string &count : split_list(args["threads"]))
+                {
+                    uint32_t threads = std::stoul(count);
+                    if (threads < 2)
+                        continue;
+                    RowPool pool(threads);
+                    report(layout.kernels.back().name, threads, time(select_converter(layout.layout), pool));
+                }
+            }
+        }
+    }
+
+    printf("\n%-10s %-10s %-5s %7s %10s\n", "scale", "to", "out", "threads", "ms/frame");
+    for (const std::string &size : split_list(args["size"]))
+    {
+        uint32_t width = 0, height = 0;
+        sscanf(size.c_str(), "%ux%u", &width, &height);
+        for (bool nv12 : {true, false})
+        {
+            picture_t source(width, height, nv12);
+            for (uint8_t &byte : source.bytes)
+                byte = rng();
+            for (uint32_t divisor : {2u, 3u})
+            {
+                uint32_t to_width = width / divisor & ~1u, to_height = height / divisor & ~1u;
+                picture_t layer(to_width, to_height, nv12);
+                Yuv420Scaler scaler(width, height, to_width, to_height);
+                for (const std::string &count : split_list(args["threads"]))
+                {
+                    RowPool pool(std::stoul(count));
+                    scaler.scale(source.image, layer.image, pool);
+                    auto begin = std::chrono::steady_clock::now();
+                    for (uint32_t i = 0; i < iterations; i++)
+                        scaler.scale(source.image, layer.image, pool);
+                    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() / iterations;
+                    std::string to = std::to_string(to_width) + "x" + std::to_string(to_height);
+                    printf("%-10s %-10s %-5s %7u %10.3f\n", size.c_str(), to.c_str(), nv12 ? "nv12" : "i420", pool.threads(), ms);
+                }
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
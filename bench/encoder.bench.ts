@@ -0,0 +1,174 @@
+/**
+ * Drives `H264Encoder.feed` the way an application does and reports fps, feed->callback latency
+ * percentiles, CPU per frame and bytes copied per frame for FD and BUFFER input across a matrix of
+ * resolutions, bitrates and buffer counts. Results are appended to a JSON file so builds can be compared.
+ *
+ *   pnpm bench:node [--backend v4l2] [--frames 300] [--fps 0] [--out bench/results.json]
+ *
+ * Defaults to the emulated backend so it runs anywhere; pass `--backend v4l2` on a Pi.
+ */
+import fs from 'fs';
+import os from 'os';
+
+import H264Encoder from '../src/H264Encoder';
+import { type EncodedFrame, EncoderInputType } from '../src/types';
+
+interface BenchCase {
+  inputType: EncoderInputType;
+  width: number;
+  height: number;
+  bitrate: number;
+  buffers: number;
+  lendBuffers: boolean;
+}
+
+interface BenchResult extends BenchCase {
+  input: 'fd' | 'buffer';
+  frames: number;
+  seconds: number;
+  fps: number;
+  latencyMs: { p50: number; p90: number; p99: number; max: number };
+  cpuUsPerFrame: number;
+  bytesCopiedPerFrame: number;
+  encodedBytesPerFrame: number;
+  error: string | null;
+}
+
+const args = new Map<string, string>();
+for (let i = 2; i < process.argv.length; i += 2) args.set(process.argv[i].replace(/^--/, ''), process.argv[i + 1]);
+
+const backend = (args.get('backend') ?? 'emulated') as 'v4l2' | 'emulated';
+const frames = Number(args.get('frames') ?? 300);
+const fps = Number(args.get('fps') ?? 0);
+const out = args.get('out') ?? 'bench/results.json';
+
+const sizes = [
+  [640, 480],
+  [1280, 720],
+  [1920, 1080],
+];
+const bitrates = [2_000_000, 8_000_000];
+const bufferCounts = [2, 4, 8];
+
+const percentile = (sorted: number[], p: number) => (sorted.length ? sorted[Math.min(sorted.length - 1, Math.round(p * (sorted.length - 1)))] : 0);
+const sleep = (ms: number) => new Promise((resolve) => setTimeout(resolve, ms));
+
+async function run(bench: BenchCase): Promise<BenchResult> {
+  const pictureSize = (bench.width * bench.height * 3) / 2;
+  const picture = new ArrayBuffer(pictureSize);
+  // The emulated backend never reads a dmabuf, so any open fd stands in for a camera frame.
+  const pictureFd = bench.inputType === EncoderInputType.FD ? fs.openSync('/dev/zero', 'r') : -1;
+  const fedAt: bigint[] = [];
+  const latencies: number[] = [];
+  let encodedBytes = 0;
+  let error: string | null = null;
+  let done: () => void = () => {};
+  const finished = new Promise<void>((resolve) => (done = resolve));
+
+  let encoder: H264Encoder | undefined;
+  try {
+    encoder = new H264Encoder(
+      {
+        width: bench.width,
+        height: bench.height,
+        bitrate: bench.bitrate,
+        level: 13,
+        bytesperline: bench.width,
+        framerate: fps || 30,
+        inputType: bench.inputType,
+        pixelFormat: 0x32315559, // YU12
+        outputBuffers: bench.buffers,
+        captureBuffers: bench.buffers,
+        lendBuffers: bench.lendBuffers,
+        batch: true,
+        maxBatchFrames: bench.buffers,
+        backend,
+      },
+      (err, _ok, data) => {
+        if (err) {
+          error = String(err);
+          done();
+          return;
+        }
+        if (!Array.isArray(data)) return;
+        const now = process.hrtime.bigint();
+        for (const frame of data as EncodedFrame[]) {
+          encodedBytes += frame.data.byteLength;
+          const fed = fedAt.shift();
+          if (fed !== undefined) latencies.push(Number(now - fed) / 1e6);
+          if (bench.lendBuffers) encoder?.release(frame.data);
+        }
+        if (latencies.length >= frames) done();
+      },
+    );
+  } catch (e) {
+    error = String(e);
+  }
+
+  const begin = process.hrtime.bigint();
+  const cpuBegin = process.cpuUsage();
+  for (let i = 0; encoder && i < frames && !error; i++) {
+    if (fps) {
+      const due = begin + BigInt(Math.round((i * 1e9) / fps));
+      const wait = Number(due - process.hrtime.bigint()) / 1e6;
+      if (wait > 0) await sleep(wait);
+    }
+    for (;;) {
+      fedAt.push(process.hrtime.bigint());
+      const ret = bench.inputType === EncoderInputType.FD ? encoder.feed(pictureFd, pictureSize) : encoder.feed(picture, pictureSize);
+      if (ret === 0) break;
+      fedAt.pop();
+      // every OUTPUT buffer is with the encoder; yield so callbacks can run
+      await sleep(1);
+    }
+  }
+  if (encoder && !error) await Promise.race([finished, sleep(2000)]);
+  const seconds = Number(process.hrtime.bigint() - begin) / 1e9;
+  const cpu = process.cpuUsage(cpuBegin);
+  encoder?.stop();
+  if (pictureFd >= 0) fs.closeSync(pictureFd);
+
+  latencies.sort((a, b) => a - b);
+  const count = latencies.length || 1;
+  // BUFFER input is copied into an OUTPUT buffer; encoded frames are copied out unless a capture buffer was lent.
+  const copiedIn = bench.inputType === EncoderInputType.BUFFER ? pictureSize : 0;
+  const copiedOut = bench.lendBuffers ? 0 : encodedBytes / count;
+  return {
+    ...bench,
+    input: bench.inputType === EncoderInputType.FD ? 'fd' : 'buffer',
+    frames: latencies.length,
+    seconds,
+    fps: latencies.length / seconds,
+    latencyMs: { p50: percentile(latencies, 0.5), p90: percentile(latencies, 0.9), p99: percentile(latencies, 0.99), max: latencies[latencies.length - 1] ?? 0 },
+    cpuUsPerFrame: (cpu.user + cpu.system) / count,
+    bytesCopiedPerFrame: copiedIn + copiedOut,
+    encodedBytesPerFrame: encodedBytes / count,
+    error,
+  };
+}
+
+const results: BenchResult[] = [];
+for (const inputType of [EncoderInputType.FD, EncoderInputType.BUFFER]) {
+  for (const [width, height] of sizes) {
+    for (const bitrate of bitrates) {
+      for (const buffers of bufferCounts) {
+        for (const lendBuffers of [false, true]) {
+          const result = await run({ inputType, width, height, bitrate, buffers, lendBuffers });
+          results.push(result);
+          console.log(
+            `${result.input.padEnd(6)} ${`${width}x${height}`.padEnd(9)} ${String(bitrate).padStart(8)} bufs=${buffers} lend=${lendBuffers ? 1 : 0} ` +
+              (result.error
+                ? `error: ${result.error}`
+                : `${result.fps.toFixed(1)} fps  p50 ${result.latencyMs.p50.toFixed(2)} ms  p99 ${result.latencyMs.p99.toFixed(2)} ms  ` +
+                  `cpu ${result.cpuUsPerFrame.toFixed(0)} us/f  copied ${result.bytesCopiedPerFrame.toFixed(0)} B/f`),
+          );
+        }
+      }
+    }
+  }
+}
+
+const runs = fs.existsSync(out) ? JSON.parse(fs.readFileSync(out, 'utf8')) : [];
+runs.push({ tool: 'encoder.bench.ts', timestamp: new Date().toISOString(), node: process.version, arch: os.arch(), backend, frames, fps, results });
+fs.writeFileSync(out, JSON.stringify(runs, null, 2));
+console.log(`results appended to ${out}`);
@@ -0,0 +1,279 @@
+// End-to-end encoder benchmark: drives the same EncoderSession the addon uses, from a feeding thread and
+// a dequeuing thread, and reports fps, feed->frame latency percentiles, CPU per frame and bytes copied per frame.
+//
+//   ./build/Release/encoder_bench [backend=emulated|v4l2] [input=buffer|fd] [frames=300] [fps=0]
+//                                 [size=1280x720,1920x1080] [bitrate=4000000] [buffers=2,4,8] [lend=0|1]
+//                                 [latency=5] [json=results.json]
+//
+// Comma separated values are combined into a matrix. fps=0 feeds as fast as the encoder accepts frames.
+// With the emulated backend the emulation thread's CPU time is part of the CPU figure.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+#include "../cpp/encoder_session.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_case_t
+{
+    std::string backend;
+    std::string input;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bitrate;
+    uint32_t buffers;
+    bool lend;
+};
+
+struct bench_result_t
+{
+    bench_case_t config;
+    std::string error;
+    uint32_t frames = 0;
+    double seconds = 0;
+    double fps = 0;
+    double p50_ms = 0;
+    double p90_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+    double cpu_us_per_frame = 0;
+    double bytes_copied_per_frame = 0;
+    double encoded_bytes_per_frame = 0;
+    // share of encoded-frame copies served from the frame pool
+    double pool_hit_rate = 0;
+};
+
+static std::vector<std::string> split_list(const std::string &value)
+{
+    std::vector<std::string> items;
+    std::stringstream in(value);
+    std::string item;
+    while (std::getline(in, item, ','))
+        items.push_back(item);
+    return items;
+}
+
+static double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double percentile(std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+static bench_result_t run(const bench_case_t &bench, uint32_t frames, uint32_t fps, double latency_ms)
+{
+    bench_result_t result;
+    result.config = bench;
+
+    encoder_config_t config;
+    config.backend = bench.backend;
+    config.width = bench.width;
+    config.height = bench.height;
+    config.bitrate_bps = bench.bitrate;
+    config.pixel_format = V4L2_PIX_FMT_YUV420;
+    config.output_buffer_count = bench.buffers;
+    config.capture_buffer_count = bench.buffers;
+    config.feed_type = bench.input == "fd" ? 1 : 2;
+    config.lend_buffers = bench.lend;
+    config.emulated_latency_ms = latency_ms;
+    config.framerate = fps ? fps : 30;
+
+    EncoderSession session;
+    result.error = session.open(config);
+    if (!result.error.empty())
+        return result;
+
+    // A frame as the addon would receive it from JS: one I420 picture, or an fd standing in for a dmabuf.
+    std::vector<uint8_t> picture(bench.width * bench.height * 3 / 2, 0x80);
+    int picture_fd = -1;
+    if (bench.input == "fd")
+        picture_fd = open("/dev/zero", O_RDONLY);
+
+    // The encoder returns frames in feed order, so latency is measured against a FIFO of feed times.
+    std::mutex times_mutex;
+    std::deque<bench_clock::time_point> fed_at;
+    std::vector<double> latencies;
+    latencies.reserve(frames);
+    uint64_t encoded_bytes = 0;
+
+    std::string error;
+    std::thread dequeuer([&] {
+        while (!session.stopped)
+        {
+            bool ok = session.wait(
+                200,
+                [&](std::shared_ptr<frame_data_t> frame) {
+                    auto now = bench_clock::now();
+                    encoded_bytes += frame->size;
+                    std::lock_guard<std::mutex> lock(times_mutex);
+                    if (!fed_at.empty())
+                    {
+                        latencies.push_back(std::chrono::duration<double, std::milli>(now - fed_at.front()).count());
+                        fed_at.pop_front();
+                    }
+                    // dropping the frame releases the copy, or hands a lent slot straight back to the driver
+                },
+                error);
+            if (!ok)
+                break;
+        }
+    });
+
+    double cpu_begin = cpu_seconds();
+    uint64_t copied_begin = session.stats.bytes_copied;
+    uint64_t hits_begin = session.frame_pool->hits, misses_begin = session.frame_pool->misses;
+    auto begin = bench_clock::now();
+    auto interval = fps ? std::chrono::microseconds(1000000 / fps) : std::chrono::microseconds(0);
+    for (uint32_t i = 0; i < frames && error.empty(); i++)
+    {
+        if (fps)
+            std::this_thread::sleep_until(begin + interval * i);
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(times_mutex);
+                fed_at.push_back(bench_clock::now());
+            }
+            int ret = bench.input == "fd" ? session.feed(picture_fd, picture.size()) : session.feed(picture.data(), picture.size());
+            if (ret == 0)
+                break;
+            {
+                std::lock_guard<std::mutex> lock(times_mutex);
+                fed_at.pop_back();
+            }
+            // every OUTPUT slot is with the driver: wait until the dequeuer reclaims one
+            std::unique_lock<std::mutex> lock(session.operation_mutex);
+            session.frame_available.wait_for(lock, std::chrono::milliseconds(20), [&] { return !session.free_outputs.empty(); });
+        }
+    }
+    // give the encoder a moment to return what is still in flight
+    auto deadline = bench_clock::now() + std::chrono::seconds(2);
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(times_mutex);
+            if (latencies.size() >= frames || bench_clock::now() > deadline || !error.empty())
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    result.seconds = std::chrono::duration<double>(bench_clock::now() - begin).count();
+    double cpu = cpu_seconds() - cpu_begin;
+    session.stop();
+    dequeuer.join();
+    if (picture_fd >= 0)
+        close(picture_fd);
+    if (!error.empty())
+        result.error = error;
+
+    result.frames = latencies.size();
+    if (result.frames == 0)
+        return result;
+    std::sort(latencies.begin(), latencies.end());
+    result.fps = result.frames / result.seconds;
+    result.p50_ms = percentile(latencies, 0.50);
+    result.p90_ms = percentile(latencies, 0.90);
+    result.p99_ms = percentile(latencies, 0.99);
+    result.max_ms = latencies.back();
+    result.cpu_us_per_frame = cpu * 1e6 / result.frames;
+    result.bytes_copied_per_frame = (double)(session.stats.bytes_copied - copied_begin) / result.frames;
+    result.encoded_bytes_per_frame = (double)encoded_bytes / result.frames;
+    uint64_t hits = session.frame_pool->hits - hits_begin, takes = hits + session.frame_pool->misses - misses_begin;
+    result.pool_hit_rate = takes ? (double)hits / takes : 0;
+    return result;
+}
+
+static std::string to_json(const std::vector<bench_result_t> &results, uint32_t frames, uint32_t fps)
+{
+    std::ostringstream out;
+    out << "{\n  \"tool\": \"encoder_bench\",\n  \"compiler\": \"" << __VERSION__ << "\",\n  \"timestamp\": " << time(nullptr) << ",\n";
+    out << "  \"frames\": " << frames << ",\n  \"fps\": " << fps << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const bench_result_t &r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"backend\": \"" << r.config.backend << "\", \"input\": \"" << r.config.input << "\", \"width\": " << r.config.width
+            << ", \"height\": " << r.config.height << ", \"bitrate\": " << r.config.bitrate << ", \"buffers\": " << r.config.buffers
+            << ", \"lend\": " << (r.config.lend ? "true" : "false") << ", \"frames\": " << r.frames << ", \"seconds\": " << r.seconds << ", \"fps\": " << r.fps
+            << ", \"latencyMs\": {\"p50\": " << r.p50_ms << ", \"p90\": " << r.p90_ms << ", \"p99\": " << r.p99_ms << ", \"max\": " << r.max_ms
+            << "}, \"cpuUsPerFrame\": " << r.cpu_us_per_frame << ", \"bytesCopiedPerFrame\": " << r.bytes_copied_per_frame
+            << ", \"encodedBytesPerFrame\": " << r.encoded_bytes_per_frame << ", \"framePoolHitRate\": " << r.pool_hit_rate << ", \"error\": " << (r.error.empty() ? "null" : "\"" + r.error + "\"") << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+int main(int argc, char **argv)
+{
+    std::map<std::string, std::string> args = {
+        {"backend", "emulated"}, {"input", "buffer,fd"}, {"frames", "300"}, {"fps", "0"}, {"size", "1280x720,1920x1080"},
+        {"bitrate", "4000000"},  {"buffers", "2,4,8"},   {"lend", "0"},     {"latency", "5"}, {"json", ""},
+    };
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos || !args.count(arg.substr(0, eq)))
+        {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            return 2;
+        }
+        args[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    uint32_t frames = std::stoul(args["frames"]);
+    uint32_t fps = std::stoul(args["fps"]);
+    double latency = std::stod(args["latency"]);
+
+    std::vector<bench_case_t> cases;
+    for (auto &backend : split_list(args["backend"]))
+        for (auto &input : split_list(args["input"]))
+            for (auto &size : split_list(args["size"]))
+                for (auto &bitrate : split_list(args["bitrate"]))
+                    for (auto &buffers : split_list(args["buffers"]))
+                        for (auto &lend : split_list(args["lend"]))
+                        {
+                            uint32_t width = 0, height = 0;
+                            sscanf(size.c_str(), "%ux%u", &width, &height);
+                            cases.push_back({backend, input, width, height, (uint32_t)std::stoul(bitrate), (uint32_t)std::stoul(buffers), lend == "1"});
+                        }
+
+    std::vector<bench_result_t> results;
+    printf("%-9s %-6s %-10s %9s %4s %4s %8s %8s %8s %8s %10s %12s %6s\n", "backend", "input", "size", "bitrate", "bufs", "lend", "fps", "p50 ms", "p99 ms", "max ms", "cpu us/f",
+           "copied B/f", "pool%");
+    for (const bench_case_t &bench : cases)
+    {
+        bench_result_t r = run(bench, frames, fps, latency);
+        std::string size = std::to_string(bench.width) + "x" + std::to_string(bench.height);
+        if (!r.error.empty())
+            printf("%-9s %-6s %-10s %9u %4u %4d  error: %s\n", bench.backend.c_str(), bench.input.c_str(), size.c_str(), bench.bitrate, bench.buffers, bench.lend, r.error.c_str());
+        else
+            printf("%-9s %-6s %-10s %9u %4u %4d %8.1f %8.2f %8.2f %8.2f %10.1f %12.0f %6.1f\n", bench.backend.c_str(), bench.input.c_str(), size.c_str(), bench.bitrate, bench.buffers,
+                   bench.lend, r.fps, r.p50_ms, r.p99_ms, r.max_ms, r.cpu_us_per_frame, r.bytes_copied_per_frame, r.pool_hit_rate * 100);
+        results.push_back(r);
+    }
+
+    std::string json = to_json(results, frames, fps);
+    if (!args["json"].empty())
+        std::ofstream(args["json"]) << json;
+    else
+        std::cout << json;
+    return 0;
+}
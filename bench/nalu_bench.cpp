@@ -0,0 +1,213 @@
+// Start-code scanner benchmark: checks every kernel against the scalar reference, then times them
+// against the memmem loop OnProgress used before.
+//
+//   ./build/Release/nalu_bench [stream.h264 ...]
+//
+// Without arguments it runs on synthetic access units (3- and 4-byte start codes, emulation prevention
+// applied). Recorded Annex B files are split into access units first.
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../cpp/nalu.hpp"
+
+struct kernel_t
+{
+    const char *name;
+    start_code_scanner scan;
+};
+
+// The splitter OnProgress used before: memmem for the 4-byte prefix only.
+static size_t split_memmem(const uint8_t *buf, size_t size, nalu_t *out, size_t capacity)
+{
+    static const uint8_t prefix[4] = {0x00, 0x00, 0x00, 0x01};
+    size_t count = 0;
+    size_t k = 0;
+    const uint8_t *last = nullptr;
+    for (;;)
+    {
+        const uint8_t *pos = (const uint8_t *)memmem(buf + k, size - k, prefix, 4);
+        if (last && count <= capacity)
+            out[count - 1].size = (pos ? pos : buf + size) - last;
+        if (pos == NULL)
+            break;
+        if (count < capacity)
+        {
+            out[count].offset = pos - buf;
+            out[count].start_code = 4;
+            out[count].type = pos[4] & 0x1f;
+        }
+        count++;
+        last = pos;
+        k = pos - buf + 4;
+    }
+    return count;
+}
+
+// Appends one NAL unit with a random payload, escaping 00 00 0x like an encoder would.
+static void append_nalu(std::vector<uint8_t> &au, std::mt19937 &rng, uint8_t header, size_t payload, bool long_code)
+{
+    if (long_code)
+        au.push_back(0);
+    au.insert(au.end(), {0, 0, 1, header});
+    int zeros = 0;
+    for (size_t i = 0; i < payload; i++)
+    {
+        // skew towards zeros so the scanners see plenty of near misses
+        uint8_t byte = rng() % 4 == 0 ? 0 : (uint8_t)rng();
+        if (zeros >= 2 && byte <= 3)
+        {
+            au.push_back(3);
+            zeros = 0;
+        }
+        au.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+    if (au.back() == 0)
+        au.push_back(0x80);
+}
+
+static std::vector<std::vector<uint8_t>> synthetic_stream(size_t frames, size_t idr_size, size_t p_size)
+{
+    std::mt19937 rng(1234);
+    std::vector<std::vector<uint8_t>> stream;
+    for (size_t f = 0; f < frames; f++)
+    {
+        std::vector<uint8_t> au;
+        if (f % 30 == 0)
+        {
+            append_nalu(au, rng, 0x67, 12, true);
+            append_nalu(au, rng, 0x68, 4, true);
+            append_nalu(au, rng, 0x06, 24, false);
+            // IDR split over several slices
+            for (int s = 0; s < 4; s++)
+                append_nalu(au, rng, 0x65, idr_size / 4, s == 0);
+        }
+        else
+        {
+            append_nalu(au, rng, 0x41, p_size, true);
+        }
+        stream.push_back(std::move(au));
+    }
+    return stream;
+}
+
+static std::vector<std::vector<uint8_t>> recorded_stream(const char *path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<uint8_t>> stream;
+    for (auto [offset, size] : split_access_units(data.data(), data.size()))
+        stream.emplace_back(data.begin() + offset, data.begin() + offset + size);
+    return stream;
+}
+
+static bool same(const std::vector<nalu_t> &a, size_t na, const std::vector<nalu_t> &b, size_t nb)
+{
+    if (na != nb)
+        return false;
+    for (size_t i = 0; i < na; i++)
+    {
+        if (a[i].offset != b[i].offset || a[i].size != b[i].size || a[i].start_code != b[i].start_code || a[i].type != b[i].type)
+            return false;
+    }
+    return true;
+}
+
+static bool verify(const std::vector<std::vector<uint8_t>> &stream, const std::vector<kernel_t> &kernels)
+{
+    std::vector<nalu_t> expected(4096), actual(4096);
+    for (size_t f = 0; f < stream.size(); f++)
+    {
+        const std::vector<uint8_t> &au = stream[f];
+        size_t n = split_nalus(au.data(), au.size(), expected.data(), expected.size(), find_start_code_scalar);
+        for (const kernel_t &kernel : kernels)
+        {
+            size_t m = split_nalus(au.data(), au.size(), actual.data(), actual.size(), kernel.scan);
+            if (!same(expected, n, actual, m))
+            {
+                std::cerr << kernel.name << ": mismatch in access unit " << f << " (" << m << " units, expected " << n << ")" << std::endl;
+                return false;
+            }
+            // every unaligned tail must agree too
+            for (size_t from = 0; from < 64 && from < au.size(); from++)
+            {
+                if (kernel.scan(au.data(), from, au.size()) != find_start_code_scalar(au.data(), from, au.size()))
+                {
+                    std::cerr << kernel.name << ": scan from " << from << " differs in access unit " << f << std::endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template <typename Split>
+static double run(const std::vector<std::vector<uint8_t>> &stream, size_t bytes, Split split)
+{
+    std::vector<nalu_t> table(256);
+    size_t sink = 0;
+    // repeat until ~256 MiB have been scanned so that short streams still give a stable number
+    size_t rounds = std::max<size_t>(1, (256u << 20) / std::max<size_t>(bytes, 1));
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (const std::vector<uint8_t> &au : stream)
+            sink += split(au.data(), au.size(), table.data(), table.size());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    if (sink == 0)
+        std::cerr << "no units found" << std::endl;
+    return bytes * rounds / seconds / (1 << 20);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<kernel_t> kernels = {{"scalar", find_start_code_scalar}};
+#if defined(__x86_64__)
+    kernels.push_back({"sse2", find_start_code_sse2});
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        kernels.push_back({"avx2", find_start_code_avx2});
+#endif
+#ifdef NALU_NEON
+    kernels.push_back({"neon", find_start_code_neon});
+#endif
+
+    std::vector<std::pair<std::string, std::vector<std::vector<uint8_t>>>> streams;
+    if (argc > 1)
+    {
+        for (int i = 1; i < argc; i++)
+            streams.emplace_back(argv[i], recorded_stream(argv[i]));
+    }
+    else
+    {
+        streams.emplace_back("synthetic 1080p 4Mbps", synthetic_stream(300, 120 << 10, 14 << 10));
+        streams.emplace_back("synthetic 1080p 20Mbps", synthetic_stream(300, 600 << 10, 70 << 10));
+    }
+
+    for (auto &[name, stream] : streams)
+    {
+        size_t bytes = 0;
+        for (auto &au : stream)
+            bytes += au.size();
+        std::cout << name << ": " << stream.size() << " access units, " << bytes / 1024.0 / 1024.0 << " MiB" << std::endl;
+        if (!verify(stream, kernels))
+            return 1;
+        printf("  %-8s %10.1f MiB/s\n", "memmem", run(stream, bytes, split_memmem));
+        for (const kernel_t &kernel : kernels)
+        {
+            printf("  %-8s %10.1f MiB/s\n", kernel.name, run(stream, bytes, [&](const uint8_t *buf, size_t size, nalu_t *out, size_t capacity) {
+                       return split_nalus(buf, size, out, capacity, kernel.scan);
+                   }));
+        }
+    }
+    return 0;
+}
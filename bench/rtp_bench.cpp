@@ -0,0 +1,246 @@
+// RTP packetizer benchmark: sends synthetic access units through RtpSink to a receiver on the loopback
+// interface, reassembles them from the packets (single NAL, STAP-A, FU-A) and checks they match what was sent,
+// then times packetizing alone (the batch mode JS gets) and packetizing plus sendmmsg().
+//
+//   ./build/Release/rtp_bench [frames=300] [mtu=1200] [gop=30] [idr=60000] [p=12000]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <netinet/in.h>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "../cpp/rtp_packetizer.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+static void append_nalu(std::vector<uint8_t> &au, std::mt19937 &rng, uint8_t header, size_t payload)
+{
+    au.insert(au.end(), {0, 0, 0, 1, header});
+    int zeros = 0;
+    for (size_t i = 0; i < payload; i++)
+    {
+        uint8_t byte = rng() % 4 == 0 ? 0 : (uint8_t)rng();
+        if (zeros >= 2 && byte <= 3)
+        {
+            au.push_back(3);
+            zeros = 0;
+        }
+        au.push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+    if (au.back() == 0)
+        au.push_back(0x80);
+}
+
+// AUD on every frame, SPS/PPS and an IDR slice every `gop` frames, P slices in between.
+static std::vector<std::vector<uint8_t>> synthetic_stream(size_t frames, size_t gop, size_t idr_size, size_t p_size)
+{
+    std::mt19937 rng(1234);
+    std::vector<std::vector<uint8_t>> stream(frames);
+    for (size_t f = 0; f < frames; f++)
+    {
+        std::vector<uint8_t> &au = stream[f];
+        append_nalu(au, rng, 0x09, 1);
+        if (f % gop == 0)
+        {
+            append_nalu(au, rng, 0x67, 12);
+            append_nalu(au, rng, 0x68, 3);
+            append_nalu(au, rng, 0x65, idr_size);
+        }
+        else
+        {
+            append_nalu(au, rng, 0x41, p_size + rng() % p_size);
+        }
+    }
+    return stream;
+}
+
+// The access unit as the packetizer should send it: 4-byte start codes, without the AUD.
+static std::vector<uint8_t> expected(const std::vector<uint8_t> &au)
+{
+    nalu_t nalus[16];
+    size_t count = split_nalus(au.data(), au.size(), nalus, 16);
+    std::vector<uint8_t> out;
+    for (size_t i = 0; i < count && i < 16; i++)
+    {
+        const uint8_t *unit = au.data() + nalus[i].offset + nalus[i].start_code;
+        if ((unit[0] & 0x1f) == 9)
+            continue;
+        out.insert(out.end(), {0, 0, 0, 1});
+        out.insert(out.end(), unit, unit + nalus[i].size - nalus[i].start_code);
+    }
+    return out;
+}
+
+struct receiver_t
+{
+    int fd = -1;
+    uint16_t port = 0;
+    // reassembled access units by RTP timestamp, in arrival order
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> frames;
+    uint32_t packets = 0;
+    uint32_t markers = 0;
+    uint32_t sequence_gaps = 0;
+    std::string error;
+};
+
+// Depacketizes one RTP packet into the access unit of its timestamp.
+static void depacketize(receiver_t &receiver, const uint8_t *packet, size_t size, int &last_sequence)
+{
+    if (size < 13 || (packet[0] >> 6) != 2)
+    {
+        receiver.error = "malformed packet";
+        return;
+    }
+    receiver.packets++;
+    uint16_t sequence = packet[2] << 8 | packet[3];
+    if (last_sequence >= 0 && sequence != (uint16_t)(last_sequence + 1))
+        receiver.sequence_gaps++;
+    last_sequence = sequence;
+    uint32_t timestamp = packet[4] << 24 | packet[5] << 16 | packet[6] << 8 | packet[7];
+    if (packet[1] & 0x80)
+        receiver.markers++;
+    if (receiver.frames.empty() || receiver.frames.back().first != timestamp)
+        receiver.frames.push_back({timestamp, {}});
+    std::vector<uint8_t> &au = receiver.frames.back().second;
+    const uint8_t *payload = packet + 12;
+    size_t length = size - 12;
+    uint8_t type = payload[0] & 0x1f;
+    if (type == 24)
+    {
+        for (size_t offset = 1; offset + 2 <= length;)
+        {
+            size_t unit = payload[offset] << 8 | payload[offset + 1];
+            au.insert(au.end(), {0, 0, 0, 1});
+            au.insert(au.end(), payload + offset + 2, payload + offset + 2 + unit);
+            offset += 2 + unit;
+        }
+    }
+    else if (type == 28)
+    {
+        if (payload[1] & 0x80)
+            au.insert(au.end(), {0, 0, 0, 1, (uint8_t)((payload[0] & 0xe0) | (payload[1] & 0x1f))});
+        au.insert(au.end(), payload + 2, payload + length);
+    }
+    else
+    {
+        au.insert(au.end(), {0, 0, 0, 1});
+        au.insert(au.end(), payload, payload + length);
+    }
+}
+
+static void receive(receiver_t *receiver, uint32_t expected_packets)
+{
+    std::vector<std::vector<uint8_t>> buffers(64, std::vector<uint8_t>(2048));
+    std::vector<struct iovec> iov(64);
+    std::vector<struct mmsghdr> messages(64);
+    int last_sequence = -1;
+    while (receiver->packets < expected_packets)
+    {
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            iov[i] = {buffers[i].data(), buffers[i].size()};
+            messages[i] = {};
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        // a second without packets means the rest was lost
+        struct timespec timeout = {1, 0};
+        int count = recvmmsg(receiver->fd, messages.data(), messages.size(), MSG_WAITFORONE, &timeout);
+        if (count <= 0)
+            return;
+        for (int i = 0; i < count; i++)
+            depacketize(*receiver, buffers[i].data(), messages[i].msg_len, last_sequence);
+    }
+}
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    std::map<std::string, std::string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (eq != std::string::npos)
+            args[arg.substr(0, eq)] = arg.substr(eq + 1);
+    }
+    auto number = [&](const char *name, size_t fallback) { return args.count(name) ? (size_t)std::stoul(args[name]) : fallback; };
+    size_t frames = number("frames", 300);
+    uint32_t mtu = number("mtu", 1200);
+    std::vector<std::vector<uint8_t>> stream = synthetic_stream(frames, number("gop", 30), number("idr", 60000), number("p", 12000));
+
+    // batch mode: packetizing and copying into one buffer per frame, what the JS callback receives
+    RtpSink batcher(mtu, 96, 0, 90000);
+    uint64_t batch_packets = 0;
+    double cpu = cpu_seconds();
+    auto started = bench_clock::now();
+    for (int round = 0; round < 10; round++)
+    {
+        for (size_t f = 0; f < frames; f++)
+            batch_packets += batcher.add(stream[f].data(), stream[f].size(), batcher.packetizer.timestamp(f * 33333), f % 30 == 0)->packets.size() / 2;
+    }
+    double seconds = std::chrono::duration<double>(bench_clock::now() - started).count();
+    printf("batch:    %8.0f frames/s, %6.0f ns CPU/packet (%llu packets)\n", frames * 10 / seconds, (cpu_seconds() - cpu) * 1e9 / batch_packets,
+           (unsigned long long)batch_packets);
+
+    // direct mode against a loopback receiver
+    receiver_t receiver;
+    receiver.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int buffer_size = 64 << 20;
+    setsockopt(receiver.fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(receiver.fd, (struct sockaddr *)&address, length) < 0 || getsockname(receiver.fd, (struct sockaddr *)&address, &length) < 0)
+    {
+        printf("failed to bind the receiver: %s\n", strerror(errno));
+        return 1;
+    }
+    RtpSink sink(mtu, 96, 0x1234, 90000);
+    std::string error;
+    if (!sink.connect("127.0.0.1", ntohs(address.sin_port), error))
+    {
+        printf("%s\n", error.c_str());
+        return 1;
+    }
+    std::thread thread(receive, &receiver, (uint32_t)(batch_packets / 10));
+    cpu = cpu_seconds();
+    started = bench_clock::now();
+    for (size_t f = 0; f < frames; f++)
+    {
+        sink.add(stream[f].data(), stream[f].size(), sink.packetizer.timestamp(f * 33333), f % 30 == 0);
+        // leave the receiver time to drain its socket every few frames, like a live stream would
+        if (f % 8 == 7)
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    double send_cpu = cpu_seconds() - cpu;
+    seconds = std::chrono::duration<double>(bench_clock::now() - started).count();
+    thread.join();
+    close(receiver.fd);
+
+    uint64_t sent = sink.packets_sent.load();
+    size_t matched = 0;
+    for (size_t f = 0; f < frames && f < receiver.frames.size(); f++)
+        matched += receiver.frames[f].second == expected(stream[f]);
+    printf("sendmmsg: %8.0f frames/s, %6.0f ns CPU/packet, %llu packets sent, %llu dropped, %.1f MB\n", frames / seconds, send_cpu * 1e9 / std::max<uint64_t>(sent, 1),
+           (unsigned long long)sent, (unsigned long long)sink.packets_dropped.load(), sink.bytes_sent.load() / 1e6);
+    printf("receiver: %u packets, %zu/%zu frames intact, %u markers, %u sequence gaps%s%s\n", receiver.packets, matched, frames, receiver.markers, receiver.sequence_gaps,
+           receiver.error.empty() ? "" : ", ", receiver.error.c_str());
+    return matched == frames && receiver.markers == frames ? 0 : 1;
+}
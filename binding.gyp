@@ -3,6 +3,8 @@
         # use cross platform compile or not
         "FLAG": "<!(echo $FLAG)",
         "TARGET_ARCH": "<!(echo $TARGET_ARCH)",
+        # build the native benchmarks as well (BENCH=1)
+        "BENCH": "<!(echo $BENCH)",
     },
     "targets": [
         {
@@ -39,5 +41,38 @@
                 }]
             ]
         },
+    ],
+    "conditions": [
+        ["BENCH=='1'", {
+            "targets": [
+                {
+                    "target_name": "nalu_bench",
+                    "type": "executable",
+                    "sources": ["bench/nalu_bench.cpp"],
+                    "cflags_cc": ["-std=c++23", "-O2"],
+                },
+                {
+                    "target_name": "convert_bench",
+                    "type": "executable",
+                    "sources": ["bench/convert_bench.cpp"],
+                    "cflags_cc": ["-std=c++23", "-O2", "-pthread"],
+                    "ldflags": ["-pthread"],
+                },
+                {
+                    "target_name": "encoder_bench",
+                    "type": "executable",
+                    "sources": ["bench/encoder_bench.cpp"],
+                    "cflags_cc": ["-std=c++23", "-O2", "-pthread"],
+                    "ldflags": ["-pthread"],
+                },
+                {
+                    "target_name": "rtp_bench",
+                    "type": "executable",
+                    "sources": ["bench/rtp_bench.cpp"],
+                    "cflags_cc": ["-std=c++23", "-O2", "-pthread"],
+                    "ldflags": ["-pthread"],
+                },
+            ]
+        }]
     ]
 }
@@ -0,0 +1,158 @@
+#ifndef __DEVICE_REGISTRY_H__
+#define __DEVICE_REGISTRY_H__
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <mutex>
+#include <string>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <vector>
+
+// A stateful H.264 encoder node and the load placed on it by this process.
+struct encoder_device_t
+{
+    std::string path;
+    std::string card;
+    std::string driver;
+    std::string bus_info;
+    uint32_t sessions = 0;
+    // sum of width * height * framerate over the sessions on this node
+    uint64_t pixel_rate = 0;
+};
+
+// True if `fd` is a memory-to-memory device that produces H.264 on its CAPTURE queue.
+inline bool is_h264_encoder(int fd, encoder_device_t &device)
+{
+    struct v4l2_capability cap = {};
+    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0)
+        return false;
+    uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+    if (!(caps & V4L2_CAP_VIDEO_M2M_MPLANE))
+        return false;
+    device.card = (const char *)cap.card;
+    device.driver = (const char *)cap.driver;
+    device.bus_info = (const char *)cap.bus_info;
+    struct v4l2_fmtdesc fmt = {};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    for (fmt.index = 0; ioctl(fd, VIDIOC_ENUM_FMT, &fmt) == 0; fmt.index++)
+        if (fmt.pixelformat == V4L2_PIX_FMT_H264)
+            return true;
+    return false;
+}
+
+// Every /dev/videoN that is an H.264 M2M encoder, in node order.
+inline std::vector<encoder_device_t> probe_encoder_devices(const std::string &dir = "/dev")
+{
+    std::vector<std::pair<int, encoder_device_t>> found;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+        return {};
+    while (struct dirent *entry = readdir(d))
+    {
+        if (strncmp(entry->d_name, "video", 5) != 0 || !isdigit((unsigned char)entry->d_name[5]))
+            continue;
+        encoder_device_t device;
+        device.path = dir + "/" + entry->d_name;
+        int fd = open(device.path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (is_h264_encoder(fd, device))
+            found.emplace_back(atoi(entry->d_name + 5), device);
+        close(fd);
+    }
+    closedir(d);
+    std::sort(found.begin(), found.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    std::vector<encoder_device_t> devices;
+    for (auto &item : found)
+        devices.push_back(std::move(item.second));
+    return devices;
+}
+
+// Places sessions on encoder nodes. Probes once, on first use, and keeps per-node load counters
+// so that each new session goes to the node with the lowest pixel rate (then the fewest sessions).
+class DeviceRegistry
+{
+  public:
+    // Used when probing finds nothing, so the error names the node the addon always used.
+    static constexpr const char *DEFAULT_DEVICE = "/dev/video11";
+
+    static DeviceRegistry &shared()
+    {
+        static DeviceRegistry registry;
+        return registry;
+    }
+
+    // Re-probes the nodes, keeping the load of those still present. Returns a snapshot.
+    std::vector<encoder_device_t> refresh()
+    {
+        std::vector<encoder_device_t> probed = probe_encoder_devices();
+        std::lock_guard<std::mutex> lock(mutex);
+        for (encoder_device_t &device : probed)
+        {
+            auto it = find(device.path);
+            if (it != devices.end())
+            {
+                device.sessions = it->sessions;
+                device.pixel_rate = it->pixel_rate;
+            }
+        }
+        devices = std::move(probed);
+        probed_once = true;
+        return devices;
+    }
+
+    std::vector<encoder_device_t> list()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (probed_once)
+                return devices;
+        }
+        return refresh();
+    }
+
+    // Picks the node for a new session and charges `pixel_rate` to it. `requested` (the `device` option)
+    // bypasses the choice but is still accounted for if it is a known node.
+    std::string acquire(const std::string &requested, uint64_t pixel_rate)
+    {
+        list();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = requested.empty() ? std::min_element(devices.begin(), devices.end(),
+                                                       [](const encoder_device_t &a, const encoder_device_t &b) {
+                                                           return a.pixel_rate != b.pixel_rate ? a.pixel_rate < b.pixel_rate : a.sessions < b.sessions;
+                                                       })
+                                    : find(requested);
+        if (it == devices.end())
+            return requested.empty() ? DEFAULT_DEVICE : requested;
+        it->sessions++;
+        it->pixel_rate += pixel_rate;
+        return it->path;
+    }
+
+    void release(const std::string &path, uint64_t pixel_rate)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = find(path);
+        if (it == devices.end() || it->sessions == 0)
+            return;
+        it->sessions--;
+        it->pixel_rate -= std::min(it->pixel_rate, pixel_rate);
+    }
+
+  private:
+    std::mutex mutex;
+    std::vector<encoder_device_t> devices;
+    bool probed_once = false;
+
+    std::vector<encoder_device_t>::iterator find(const std::string &path)
+    {
+        return std::find_if(devices.begin(), devices.end(), [&](const encoder_device_t &device) { return device.path == path; });
+    }
+};
+
+#endif
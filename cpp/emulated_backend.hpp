@@ -0,0 +1,673 @@
+#ifndef __EMULATED_BACKEND_H__
+#define __EMULATED_BACKEND_H__
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <linux/videodev2.h>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <thread>
+#include <vector>
+
+#include "encoder_backend.hpp"
+#include "nalu.hpp"
+
+// Bit writer for the few RBSP syntax elements the emulation needs to produce valid parameter sets.
+class rbsp_writer
+{
+  public:
+    std::vector<uint8_t> bytes;
+
+    void bits(uint32_t value, int count)
+    {
+        for (int i = count - 1; i >= 0; i--)
+        {
+            if (used == 0)
+                bytes.push_back(0);
+            bytes.back() |= ((value >> i) & 1) << (7 - used);
+            used = (used + 1) & 7;
+        }
+    }
+
+    // unsigned Exp-Golomb
+    void ue(uint32_t value)
+    {
+        uint32_t v = value + 1;
+        int length = 32 - __builtin_clz(v);
+        bits(0, length - 1);
+        bits(v, length);
+    }
+
+    void se(int32_t value)
+    {
+        ue(value > 0 ? 2 * value - 1 : -2 * value);
+    }
+
+    void trailing()
+    {
+        bits(1, 1);
+        if (used)
+            bits(0, 8 - used);
+    }
+
+    // Appends the NAL unit with a 4-byte start code, inserting emulation prevention bytes.
+    void emit(std::vector<uint8_t> &out, uint8_t header) const
+    {
+        out.insert(out.end(), {0, 0, 0, 1, header});
+        int zeros = 0;
+        for (uint8_t byte : bytes)
+        {
+            if (zeros >= 2 && byte <= 3)
+            {
+                out.push_back(3);
+                zeros = 0;
+            }
+            out.push_back(byte);
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+    }
+
+  private:
+    int used = 0;
+};
+
+// A software stand-in for the stateful H.264 encoder node. It implements the subset of the V4L2 M2M
+// interface the encoder uses (formats, controls, REQBUFS/QUERYBUF/QBUF/DQBUF, streaming, the drain command)
+// with the same queue semantics, and "encodes" on its own thread: every queued OUTPUT buffer becomes one access unit in a
+// queued CAPTURE buffer after `latency`. Completions are signalled through an eventfd, so the addon's
+// poll/dequeue/delivery path runs unchanged. The access units are synthetic (valid SPS/PPS, filler slices
+// sized from the bitrate) or replayed from a recorded Annex B stream.
+class EmulatedBackend : public EncoderBackend
+{
+  public:
+    // simulated encode time per frame; frames are encoded one after another like on the hardware
+    std::chrono::microseconds latency{5000};
+
+    EmulatedBackend()
+    {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        output_format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        capture_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        worker = std::thread(&EmulatedBackend::run, this);
+    }
+
+    ~EmulatedBackend()
+    {
+        close();
+    }
+
+    // Replays the access units of a recorded Annex B file, in a loop, instead of synthetic ones.
+    bool load_replay(const std::string &path, std::string &error)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            error = "Failed to open replay file " + path;
+            return false;
+        }
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::lock_guard<std::mutex> lock(mutex);
+        replay.clear();
+        for (auto [offset, size] : split_access_units(data.data(), data.size()))
+            replay.emplace_back(data.begin() + offset, data.begin() + offset + size);
+        if (replay.empty())
+        {
+            error = "No H.264 access units in " + path;
+            return false;
+        }
+        return true;
+    }
+
+    int ioctl(unsigned long request, void *arg) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        switch (request)
+        {
+        case VIDIOC_S_CTRL:
+            return set_control((struct v4l2_control *)arg);
+        case VIDIOC_G_CTRL:
+            return get_control((struct v4l2_control *)arg);
+        case VIDIOC_G_FMT:
+            return get_format((struct v4l2_format *)arg);
+        case VIDIOC_S_FMT:
+            return set_format((struct v4l2_format *)arg);
+        case VIDIOC_S_PARM:
+            return set_parm((struct v4l2_streamparm *)arg);
+        case VIDIOC_REQBUFS:
+            return request_buffers((struct v4l2_requestbuffers *)arg);
+        case VIDIOC_QUERYBUF:
+            return query_buffer((struct v4l2_buffer *)arg);
+        case VIDIOC_QBUF:
+            return queue_buffer((struct v4l2_buffer *)arg);
+        case VIDIOC_DQBUF:
+            return dequeue_buffer((struct v4l2_buffer *)arg);
+        case VIDIOC_STREAMON:
+        case VIDIOC_STREAMOFF:
+            return set_streaming(*(int *)arg, request == VIDIOC_STREAMON);
+        case VIDIOC_ENCODER_CMD:
+            return encoder_command((struct v4l2_encoder_cmd *)arg);
+        }
+        return fail(ENOTTY);
+    }
+
+    void *mmap(size_t length, off_t offset) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue_t &q = offset >= CAPTURE_OFFSET ? capture : output;
+        uint32_t index = (offset % CAPTURE_OFFSET) / SLOT_OFFSET;
+        if (index >= q.slots.size() || length > q.slots[index].memory.size())
+        {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+        q.slots[index].mapped = true;
+        return q.slots[index].memory.data();
+    }
+
+    // The memory belongs to the slots; like vb2, REQBUFS refuses to free them while they are mapped.
+    void munmap(void *start, size_t) override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (queue_t *q : {&output, &capture})
+        {
+            for (slot_t &slot : q->slots)
+            {
+                if (slot.memory.data() == start)
+                    slot.mapped = false;
+            }
+        }
+    }
+
+    int poll_fd() const override
+    {
+        return event_fd;
+    }
+
+    short poll_events() const override
+    {
+        return POLLIN;
+    }
+
+    void close() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!running)
+                return;
+            running = false;
+        }
+        wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+        ::close(event_fd);
+        event_fd = -1;
+    }
+
+  private:
+    // QUERYBUF offsets encode queue and index, so mmap() can find the slot again
+    static constexpr off_t SLOT_OFFSET = 1 << 24;
+    static constexpr off_t CAPTURE_OFFSET = (off_t)SLOT_OFFSET * VIDEO_MAX_FRAME;
+
+    struct slot_t
+    {
+        std::vector<uint8_t> memory;
+        uint32_t bytesused = 0;
+        uint32_t flags = 0;
+        struct timeval timestamp = {};
+        bool mapped = false;
+    };
+
+    struct queue_t
+    {
+        uint32_t memory = V4L2_MEMORY_MMAP;
+        bool streaming = false;
+        std::vector<slot_t> slots;
+        std::deque<uint32_t> queued;
+        std::deque<uint32_t> done;
+        uint32_t sequence = 0;
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread worker;
+    int event_fd = -1;
+    bool running = true;
+    // bumped by STREAMOFF so an encode in progress is dropped instead of completed
+    uint64_t epoch = 0;
+    // V4L2_ENC_CMD_STOP: finish the queued OUTPUT buffers, then return an empty CAPTURE buffer flagged LAST
+    bool draining = false;
+    // the LAST buffer went out; nothing is encoded until V4L2_ENC_CMD_START or a CAPTURE STREAMOFF
+    bool halted = false;
+
+    struct v4l2_format output_format = {};
+    struct v4l2_format capture_format = {};
+    queue_t output;
+    queue_t capture;
+    uint32_t bitrate = 4 * 1024 * 1024;
+    uint32_t framerate = 30;
+    int32_t i_period = 60;
+    int32_t level = V4L2_MPEG_VIDEO_H264_LEVEL_4_2;
+    bool force_key_frame = false;
+    uint64_t frames = 0;
+    std::vector<std::vector<uint8_t>> replay;
+    uint32_t random = 0x12345678;
+
+    static int fail(int error)
+    {
+        errno = error;
+        return -1;
+    }
+
+    queue_t *queue_for(uint32_t type)
+    {
+        if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+            return &output;
+        if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+            return &capture;
+        return nullptr;
+    }
+
+    int set_control(struct v4l2_control *ctrl)
+    {
+        switch (ctrl->id)
+        {
+        case V4L2_CID_MPEG_VIDEO_BITRATE:
+            bitrate = ctrl->value;
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
+            i_period = ctrl->value;
+            break;
+        case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+            level = ctrl->value;
+            break;
+        case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
+            force_key_frame = true;
+            break;
+        }
+        return 0;
+    }
+
+    int get_control(struct v4l2_control *ctrl)
+    {
+        switch (ctrl->id)
+        {
+        case V4L2_CID_MPEG_VIDEO_BITRATE:
+            ctrl->value = bitrate;
+            return 0;
+        case V4L2_CID_MPEG_VIDEO_H264_I_PERIOD:
+            ctrl->value = i_period;
+            return 0;
+        case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+            ctrl->value = level;
+            return 0;
+        }
+        return fail(EINVAL);
+    }
+
+    int get_format(struct v4l2_format *fmt)
+    {
+        if (fmt->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+            *fmt = output_format;
+        else if (fmt->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+            *fmt = capture_format;
+        else
+            return fail(EINVAL);
+        return 0;
+    }
+
+    static uint32_t frame_size(uint32_t fourcc, uint32_t width, uint32_t height, uint32_t &bytesperline)
+    {
+        switch (fourcc)
+        {
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_UYVY:
+            bytesperline = std::max(bytesperline, width * 2);
+            return bytesperline * height;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_BGR24:
+            bytesperline = std::max(bytesperline, width * 3);
+            return bytesperline * height;
+        case V4L2_PIX_FMT_RGBA32:
+        case V4L2_PIX_FMT_BGR32:
+            bytesperline = std::max(bytesperline, width * 4);
+            return bytesperline * height;
+        default:
+            // 4:2:0 (YUV420, NV12, ...)
+            bytesperline = std::max(bytesperline, width);
+            return bytesperline * height * 3 / 2;
+        }
+    }
+
+    int set_format(struct v4l2_format *fmt)
+    {
+        queue_t *q = queue_for(fmt->type);
+        if (!q)
+            return fail(EINVAL);
+        if (!q->slots.empty())
+            return fail(EBUSY);
+        struct v4l2_pix_format_mplane &pix = fmt->fmt.pix_mp;
+        pix.num_planes = 1;
+        if (q == &output)
+        {
+            uint32_t bytesperline = pix.plane_fmt[0].bytesperline;
+            pix.plane_fmt[0].sizeimage = frame_size(pix.pixelformat, pix.width, pix.height, bytesperline);
+            pix.plane_fmt[0].bytesperline = bytesperline;
+            output_format = *fmt;
+        }
+        else
+        {
+            pix.plane_fmt[0].bytesperline = 0;
+            pix.plane_fmt[0].sizeimage = std::max(pix.plane_fmt[0].sizeimage, 512u << 10);
+            capture_format = *fmt;
+        }
+        return 0;
+    }
+
+    int set_parm(struct v4l2_streamparm *params)
+    {
+        const struct v4l2_fract &tpf = params->parm.output.timeperframe;
+        if (tpf.numerator && tpf.denominator)
+            framerate = std::max(tpf.denominator / tpf.numerator, 1u);
+        return 0;
+    }
+
+    int request_buffers(struct v4l2_requestbuffers *req)
+    {
+        queue_t *q = queue_for(req->type);
+        if (!q)
+            return fail(EINVAL);
+        if (q->streaming)
+            return fail(EBUSY);
+        for (const slot_t &slot : q->slots)
+        {
+            if (slot.mapped)
+                return fail(EBUSY);
+        }
+        q->slots.clear();
+        q->queued.clear();
+        q->done.clear();
+        q->memory = req->memory;
+        req->count = std::min(req->count, (uint32_t)VIDEO_MAX_FRAME);
+        const struct v4l2_format &fmt = q == &output ? output_format : capture_format;
+        q->slots.resize(req->count);
+        for (slot_t &slot : q->slots)
+        {
+            if (req->memory == V4L2_MEMORY_MMAP)
+                slot.memory.resize(fmt.fmt.pix_mp.plane_fmt[0].sizeimage);
+        }
+        return 0;
+    }
+
+    int query_buffer(struct v4l2_buffer *buf)
+    {
+        queue_t *q = queue_for(buf->type);
+        if (!q || buf->index >= q->slots.size() || buf->length < 1)
+            return fail(EINVAL);
+        buf->length = 1;
+        buf->m.planes[0].length = q->slots[buf->index].memory.size();
+        buf->m.planes[0].m.mem_offset = (q == &capture ? CAPTURE_OFFSET : 0) + buf->index * SLOT_OFFSET;
+        return 0;
+    }
+
+    int queue_buffer(struct v4l2_buffer *buf)
+    {
+        queue_t *q = queue_for(buf->type);
+        if (!q || buf->index >= q->slots.size() || buf->memory != q->memory)
+            return fail(EINVAL);
+        for (uint32_t index : q->queued)
+        {
+            if (index == buf->index)
+                return fail(EINVAL);
+        }
+        slot_t &slot = q->slots[buf->index];
+        slot.bytesused = buf->m.planes[0].bytesused;
+        slot.timestamp = buf->timestamp;
+        q->queued.push_back(buf->index);
+        wake.notify_all();
+        return 0;
+    }
+
+    int dequeue_buffer(struct v4l2_buffer *buf)
+    {
+        queue_t *q = queue_for(buf->type);
+        if (!q)
+            return fail(EINVAL);
+        // like the drivers: after the LAST buffer, DQBUF on CAPTURE fails with EPIPE instead of waiting
+        if (q->done.empty())
+            return fail(q == &capture && halted ? EPIPE : EAGAIN);
+        uint32_t index = q->done.front();
+        q->done.pop_front();
+        const slot_t &slot = q->slots[index];
+        buf->index = index;
+        buf->flags = slot.flags;
+        buf->timestamp = slot.timestamp;
+        buf->sequence = q->sequence++;
+        buf->length = 1;
+        buf->m.planes[0].bytesused = slot.bytesused;
+        buf->m.planes[0].length = slot.memory.size();
+        // keep the eventfd readable exactly while something can be dequeued
+        if (output.done.empty() && capture.done.empty())
+        {
+            uint64_t value;
+            if (read(event_fd, &value, sizeof(value)) < 0)
+                value = 0;
+        }
+        return 0;
+    }
+
+    int set_streaming(int type, bool on)
+    {
+        queue_t *q = queue_for(type);
+        if (!q)
+            return fail(EINVAL);
+        q->streaming = on;
+        if (!on)
+        {
+            // like vb2: every buffer goes back to userspace ownership
+            q->queued.clear();
+            q->done.clear();
+            q->sequence = 0;
+            epoch++;
+            // a new CAPTURE stream starts over, with an IDR
+            if (q == &capture)
+            {
+                draining = halted = false;
+                frames = 0;
+            }
+        }
+        wake.notify_all();
+        return 0;
+    }
+
+    int encoder_command(struct v4l2_encoder_cmd *cmd)
+    {
+        switch (cmd->cmd)
+        {
+        case V4L2_ENC_CMD_STOP:
+            if (draining)
+                return fail(EBUSY);
+            draining = !halted;
+            break;
+        case V4L2_ENC_CMD_START:
+            draining = halted = false;
+            break;
+        default:
+            return fail(EINVAL);
+        }
+        wake.notify_all();
+        return 0;
+    }
+
+    // Every OUTPUT buffer queued before the STOP command is encoded, so the LAST buffer can go out.
+    bool drained() const
+    {
+        return draining && output.queued.empty() && capture.streaming && !capture.queued.empty();
+    }
+
+    bool ready() const
+    {
+        return output.streaming && capture.streaming && !halted && !output.queued.empty() && !capture.queued.empty();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running)
+        {
+            wake.wait(lock, [this] { return !running || ready() || drained(); });
+            if (!running)
+                break;
+            if (!ready())
+            {
+                uint32_t out = capture.queued.front();
+                capture.queued.pop_front();
+                slot_t &last = capture.slots[out];
+                last.bytesused = 0;
+                last.flags = V4L2_BUF_FLAG_LAST;
+                last.timestamp = {};
+                capture.done.push_back(out);
+                draining = false;
+                halted = true;
+                signal();
+                continue;
+            }
+            uint32_t in = output.queued.front();
+            uint32_t out = capture.queued.front();
+            uint64_t started = epoch;
+
+            lock.unlock();
+            std::this_thread::sleep_for(latency);
+            lock.lock();
+            // STREAMOFF or REQBUFS while "encoding": the buffers are not ours any more
+            if (started != epoch || !ready() || output.queued.front() != in || capture.queued.front() != out)
+                continue;
+            output.queued.pop_front();
+            capture.queued.pop_front();
+
+            slot_t &src = output.slots[in];
+            slot_t &dst = capture.slots[out];
+            encode(dst);
+            dst.timestamp = src.timestamp;
+            src.flags = 0;
+            output.done.push_back(in);
+            capture.done.push_back(out);
+            signal();
+        }
+    }
+
+    void signal()
+    {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0)
+            std::cerr << "emulated encoder: eventfd write failed: " << strerror(errno) << std::endl;
+    }
+
+    uint8_t level_idc() const
+    {
+        static const uint8_t levels[] = {10, 9, 11, 12, 13, 20, 21, 22, 30, 31, 32, 40, 41, 42, 50, 51, 52};
+        return level >= 0 && level < (int32_t)sizeof(levels) ? levels[level] : 42;
+    }
+
+    void append_parameter_sets(std::vector<uint8_t> &au) const
+    {
+        uint32_t width = output_format.fmt.pix_mp.width;
+        uint32_t height = output_format.fmt.pix_mp.height;
+        uint32_t mb_width = (width + 15) / 16;
+        uint32_t mb_height = (height + 15) / 16;
+
+        rbsp_writer sps;
+        sps.bits(100, 8); // High profile
+        sps.bits(0, 8);
+        sps.bits(level_idc(), 8);
+        sps.ue(0);        // seq_parameter_set_id
+        sps.ue(1);        // chroma_format_idc 4:2:0
+        sps.ue(0);        // bit_depth_luma_minus8
+        sps.ue(0);        // bit_depth_chroma_minus8
+        sps.bits(0, 1);   // qpprime_y_zero_transform_bypass_flag
+        sps.bits(0, 1);   // seq_scaling_matrix_present_flag
+        sps.ue(0);        // log2_max_frame_num_minus4
+        sps.ue(2);        // pic_order_cnt_type
+        sps.ue(1);        // max_num_ref_frames
+        sps.bits(0, 1);   // gaps_in_frame_num_value_allowed_flag
+        sps.ue(mb_width - 1);
+        sps.ue(mb_height - 1);
+        sps.bits(1, 1);   // frame_mbs_only_flag
+        sps.bits(1, 1);   // direct_8x8_inference_flag
+        bool crop = mb_width * 16 != width || mb_height * 16 != height;
+        sps.bits(crop, 1);
+        if (crop)
+        {
+            sps.ue(0);
+            sps.ue((mb_width * 16 - width) / 2);
+            sps.ue(0);
+            sps.ue((mb_height * 16 - height) / 2);
+        }
+        sps.bits(0, 1);   // vui_parameters_present_flag
+        sps.trailing();
+        sps.emit(au, 0x67);
+
+        rbsp_writer pps;
+        pps.ue(0);        // pic_parameter_set_id
+        pps.ue(0);        // seq_parameter_set_id
+        pps.bits(0, 1);   // entropy_coding_mode_flag
+        pps.bits(0, 1);   // bottom_field_pic_order_in_frame_present_flag
+        pps.ue(0);        // num_slice_groups_minus1
+        pps.ue(0);        // num_ref_idx_l0_default_active_minus1
+        pps.ue(0);        // num_ref_idx_l1_default_active_minus1
+        pps.bits(0, 1);   // weighted_pred_flag
+        pps.bits(0, 2);   // weighted_bipred_idc
+        pps.se(0);        // pic_init_qp_minus26
+        pps.se(0);        // pic_init_qs_minus26
+        pps.se(0);        // chroma_qp_index_offset
+        pps.bits(1, 1);   // deblocking_filter_control_present_flag
+        pps.bits(0, 1);   // constrained_intra_pred_flag
+        pps.bits(0, 1);   // redundant_pic_cnt_present_flag
+        pps.trailing();
+        pps.emit(au, 0x68);
+    }
+
+    // Writes the next access unit into `dst`.
+    void encode(slot_t &dst)
+    {
+        std::vector<uint8_t> au;
+        bool keyframe;
+        if (!replay.empty())
+        {
+            au = replay[frames % replay.size()];
+            nalu_t nalus[16];
+            size_t count = split_nalus(au.data(), au.size(), nalus, 16);
+            keyframe = false;
+            for (size_t i = 0; i < count && i < 16; i++)
+                keyframe = keyframe || nalus[i].type == 5;
+        }
+        else
+        {
+            keyframe = force_key_frame || i_period <= 0 || frames % i_period == 0;
+            // a keyframe costs about four P frames
+            size_t size = std::max<size_t>(bitrate / 8 / framerate, 64) * (keyframe ? 4 : 1);
+            if (keyframe)
+                append_parameter_sets(au);
+            // slice header: first_mb_in_slice = 0, then filler; no zero bytes, so no escaping is needed
+            au.insert(au.end(), {0, 0, 0, 1, (uint8_t)(keyframe ? 0x65 : 0x41), 0x88});
+            size_t end = au.size() + size;
+            au.resize(end);
+            for (size_t i = end - size; i < end; i++)
+            {
+                random = random * 1664525 + 1013904223;
+                au[i] = (random >> 24) | 0x01;
+            }
+        }
+        force_key_frame = false;
+        frames++;
+        dst.bytesused = std::min(au.size(), dst.memory.size());
+        memcpy(dst.memory.data(), au.data(), dst.bytesused);
+        dst.flags = keyframe ? V4L2_BUF_FLAG_KEYFRAME : V4L2_BUF_FLAG_PFRAME;
+    }
+};
+
+#endif
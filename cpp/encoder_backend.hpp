@@ -0,0 +1,89 @@
+#ifndef __ENCODER_BACKEND_H__
+#define __ENCODER_BACKEND_H__
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <unistd.h>
+
+// Everything the encoder needs from a V4L2 M2M device: ioctls, buffer mappings and something to poll.
+// The hardware node and the software emulation both implement it, so the rest of the pipeline
+// cannot tell them apart.
+class EncoderBackend
+{
+  public:
+    virtual ~EncoderBackend() {}
+
+    // Same contract as ioctl(2): returns -1 and sets errno on failure.
+    virtual int ioctl(unsigned long request, void *arg) = 0;
+    // Maps the buffer QUERYBUF reported at `offset`. Returns MAP_FAILED on failure.
+    virtual void *mmap(size_t length, off_t offset) = 0;
+    virtual void munmap(void *start, size_t length) = 0;
+    // Readable when a CAPTURE buffer can be dequeued, for the events returned by poll_events().
+    virtual int poll_fd() const = 0;
+    virtual short poll_events() const = 0;
+    // Releases the device. Mappings that are still alive stay valid until they are unmapped.
+    virtual void close() = 0;
+};
+
+class V4L2Backend : public EncoderBackend
+{
+  public:
+    int fd = -1;
+
+    ~V4L2Backend()
+    {
+        close();
+    }
+
+    // Opens the node non-blocking, so that DQBUF reports EAGAIN once every ready buffer is drained.
+    // Returns false and sets `error` on failure.
+    bool open(const std::string &path, std::string &error)
+    {
+        fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+        {
+            error = "Failed to open " + path + ": " + std::string(strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    int ioctl(unsigned long request, void *arg) override
+    {
+        return ::ioctl(fd, request, arg);
+    }
+
+    void *mmap(size_t length, off_t offset) override
+    {
+        return ::mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    }
+
+    void munmap(void *start, size_t length) override
+    {
+        ::munmap(start, length);
+    }
+
+    int poll_fd() const override
+    {
+        return fd;
+    }
+
+    // POLLOUT: an OUTPUT (raw frame) buffer is done; POLLIN: a CAPTURE (encoded) buffer is ready.
+    short poll_events() const override
+    {
+        return POLLIN | POLLOUT;
+    }
+
+    void close() override
+    {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+    }
+};
+
+#endif
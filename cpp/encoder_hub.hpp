@@ -0,0 +1,242 @@
+#ifndef _ENCODER_HUB_H_
+#define _ENCODER_HUB_H_ 1
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <napi.h>
+#include <string>
+#include <vector>
+
+#include "h264_encoder.hpp"
+#include "simulcast_encoder.hpp"
+
+// What the encoder thread uses to wake the JS thread of a hub. It outlives the EncoderHub for calls already queued.
+struct hub_wake_t
+{
+    Napi::ThreadSafeFunction tsfn;
+    std::atomic<bool> scheduled = false;
+    // JS thread only; null once the hub was collected
+    class EncoderHub *owner = nullptr;
+};
+
+// Fans the output of one encoder (or one simulcast layer) out to several subscribers through the session's
+// FrameHub: JS callbacks that can pause, and file descriptors written natively. Independent of the encoder's
+// own callback, which keeps working as before.
+class EncoderHub : public Napi::ObjectWrap<EncoderHub>
+{
+  public:
+    static Napi::FunctionReference *constructor;
+    std::shared_ptr<EncoderSession> session;
+    // formats payloads (the `outputFormat` option) with its own NALU table
+    std::shared_ptr<EncoderOutput> output;
+    std::shared_ptr<hub_wake_t> wake;
+    // JS subscribers by id
+    std::map<uint32_t, Napi::FunctionReference> callbacks;
+    // native sinks added through this hub
+    std::vector<uint32_t> sinks;
+
+    EncoderHub(const Napi::CallbackInfo &info) : Napi::ObjectWrap<EncoderHub>(info)
+    {
+        Napi::Env env = info.Env();
+        Napi::HandleScope scope(env);
+        Napi::Object encoder = info[0].As<Napi::Object>();
+        Napi::Object option = info[1].IsObject() ? info[1].As<Napi::Object>() : Napi::Object::New(env);
+        if (encoder.InstanceOf(H264Encoder::constructor->Value()))
+        {
+            session = H264Encoder::Unwrap(encoder)->session;
+        }
+        else if (encoder.InstanceOf(SimulcastEncoder::constructor->Value()))
+        {
+            SimulcastEncoder *simulcast = SimulcastEncoder::Unwrap(encoder);
+            uint32_t layer = option.Get("layer").IsNumber() ? option.Get("layer").As<Napi::Number>().Uint32Value() : 0;
+            if (layer < simulcast->layers.size())
+                session = simulcast->layers[layer].session;
+        }
+        if (!session)
+        {
+            Napi::Error::New(env, "EncoderHub needs an H264Encoder, or a SimulcastEncoder and a valid layer").ThrowAsJavaScriptException();
+            return;
+        }
+        output = std::make_shared<EncoderOutput>(session, option);
+        wake = std::make_shared<hub_wake_t>();
+        wake->owner = this;
+        wake->tsfn = Napi::ThreadSafeFunction::New(env, Napi::Function::New(env, [](const Napi::CallbackInfo &) {}), "EncoderHub", 0, 1);
+        // the encoder keeps the process alive, not its hub
+        wake->tsfn.Unref(env);
+        std::shared_ptr<hub_wake_t> handler_wake = wake;
+        if (!session->hub.set_ready_handler([handler_wake] { schedule(handler_wake); }))
+        {
+            wake->tsfn.Release();
+            wake.reset();
+            Napi::Error::New(env, "The encoder already has a hub").ThrowAsJavaScriptException();
+            return;
+        }
+        if (option.Get("capacity").IsNumber())
+            session->hub.set_capacity(option.Get("capacity").As<Napi::Number>().Uint32Value());
+    }
+
+    ~EncoderHub()
+    {
+        if (!wake)
+            return;
+        for (auto &[id, callback] : callbacks)
+            session->hub.unsubscribe(id);
+        // nobody could unsubscribe the native sinks of this hub after it is gone; a finalizer must not wait for
+        // their writers, so the session's hub joins them when it closes
+        for (uint32_t id : sinks)
+            session->hub.unsubscribe(id, false);
+        session->hub.set_ready_handler(nullptr);
+        wake->owner = nullptr;
+        wake->tsfn.Release();
+    }
+
+    // subscribe(callback, { maxLag }?): calls back with every EncodedFrame from the next keyframe on. Returns an id.
+    Napi::Value subscribe(const Napi::CallbackInfo &info)
+    {
+        uint32_t id = session->hub.subscribe(max_lag(info[1]));
+        callbacks[id] = Napi::Persistent(info[0].As<Napi::Function>());
+        return Napi::Number::New(info.Env(), id);
+    }
+
+    // attachFd(fd, { maxLag }?): writes the Annex B stream to `fd` (a file, pipe or stream socket) from a native
+    // thread. The fd stays open but is made non-blocking. Returns an id.
+    Napi::Value attachFd(const Napi::CallbackInfo &info)
+    {
+        uint32_t id = session->hub.subscribe(max_lag(info[1]), info[0].As<Napi::Number>().Int32Value());
+        sinks.push_back(id);
+        return Napi::Number::New(info.Env(), id);
+    }
+
+    // attachFile(path, { maxLag }?): like attachFd() on a file created (or truncated) for the purpose.
+    Napi::Value attachFile(const Napi::CallbackInfo &info)
+    {
+        std::string path = info[0].As<Napi::String>().Utf8Value();
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            Napi::Error::New(info.Env(), "Failed to open " + path + ": " + strerror(errno)).ThrowAsJavaScriptException();
+            return info.Env().Undefined();
+        }
+        uint32_t id = session->hub.subscribe(max_lag(info[1]), fd, true);
+        sinks.push_back(id);
+        return Napi::Number::New(info.Env(), id);
+    }
+
+    Napi::Value unsubscribe(const Napi::CallbackInfo &info)
+    {
+        uint32_t id = info[0].As<Napi::Number>().Uint32Value();
+        callbacks.erase(id);
+        sinks.erase(std::remove(sinks.begin(), sinks.end(), id), sinks.end());
+        return Napi::Boolean::New(info.Env(), session->hub.unsubscribe(id));
+    }
+
+    // pause(id): frames queue up for the subscriber (up to its lag limit) instead of being delivered.
+    Napi::Value pause(const Napi::CallbackInfo &info)
+    {
+        return Napi::Boolean::New(info.Env(), session->hub.set_paused(info[0].As<Napi::Number>().Uint32Value(), true));
+    }
+
+    Napi::Value resume(const Napi::CallbackInfo &info)
+    {
+        bool found = session->hub.set_paused(info[0].As<Napi::Number>().Uint32Value(), false);
+        if (found)
+            schedule(wake);
+        return Napi::Boolean::New(info.Env(), found);
+    }
+
+    // Every subscriber: { id, native, paused, lag, delivered, dropped, bytes, error? }.
+    Napi::Value stats(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        Napi::Array result = Napi::Array::New(env);
+        session->hub.for_each([&](const hub_subscriber_t &subscriber, uint64_t lag) {
+            Napi::Object entry = Napi::Object::New(env);
+            entry.Set("id", subscriber.id);
+            entry.Set("native", subscriber.fd >= 0);
+            entry.Set("paused", subscriber.paused);
+            entry.Set("lag", (double)lag);
+            entry.Set("delivered", (double)subscriber.delivered);
+            entry.Set("dropped", (double)subscriber.dropped);
+            entry.Set("bytes", (double)subscriber.bytes);
+            if (subscriber.failed)
+                entry.Set("error", subscriber.error);
+            result.Set(result.Length(), entry);
+        });
+        return result;
+    }
+
+    // Removes every subscriber added through this hub, native sinks included.
+    Napi::Value close(const Napi::CallbackInfo &info)
+    {
+        for (auto &[id, callback] : callbacks)
+            session->hub.unsubscribe(id);
+        for (uint32_t id : sinks)
+            session->hub.unsubscribe(id);
+        callbacks.clear();
+        sinks.clear();
+        return info.Env().Undefined();
+    }
+
+    static Napi::Object Init(Napi::Env env, Napi::Object exports)
+    {
+        Napi::Function func = DefineClass(env, "EncoderHub",
+                                          {
+                                              InstanceMethod<&EncoderHub::subscribe>("subscribe", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::attachFd>("attachFd", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::attachFile>("attachFile", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::unsubscribe>("unsubscribe", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::pause>("pause", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::resume>("resume", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::stats>("stats", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&EncoderHub::close>("close", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                          });
+        *constructor = Napi::Persistent(func);
+        exports.Set("EncoderHub", func);
+        return exports;
+    }
+
+  private:
+    // lag limit from `{ maxLag }`, defaulting to the hub's capacity
+    uint32_t max_lag(const Napi::Value &option)
+    {
+        if (option.IsObject() && option.As<Napi::Object>().Get("maxLag").IsNumber())
+            return option.As<Napi::Object>().Get("maxLag").As<Napi::Number>().Uint32Value();
+        return session->hub.get_capacity();
+    }
+
+    // From any thread: one JS call covers every frame that arrives before it runs.
+    static void schedule(const std::shared_ptr<hub_wake_t> &wake)
+    {
+        if (wake->scheduled.exchange(true))
+            return;
+        wake->tsfn.NonBlockingCall([wake](Napi::Env env, Napi::Function) {
+            wake->scheduled = false;
+            if (wake->owner)
+                wake->owner->deliver(env);
+        });
+    }
+
+    // Hands every JS subscriber what it has not read yet.
+    void deliver(Napi::Env env)
+    {
+        Napi::HandleScope scope(env);
+        std::vector<uint32_t> ids;
+        for (auto &[id, callback] : callbacks)
+            ids.push_back(id);
+        for (uint32_t id : ids)
+        {
+            for (std::shared_ptr<frame_data_t> &frame : session->hub.read(id, UINT32_MAX))
+            {
+                // a callback may unsubscribe (itself or another) while frames are being handed out
+                auto it = callbacks.find(id);
+                if (it == callbacks.end())
+                    break;
+                it->second.Call({output->frame_payload(env, frame)});
+            }
+        }
+    }
+};
+
+Napi::FunctionReference *EncoderHub::constructor = new Napi::FunctionReference();
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef __ENCODER_LOOP_H__
+#define __ENCODER_LOOP_H__
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+
+// One thread that waits on the fds of many encoders with epoll and runs each one's handler when it is ready,
+// so encoders no longer hold a libuv threadpool thread each.
+class EncoderLoop
+{
+  public:
+    using handler_t = std::function<void(uint32_t events)>;
+
+    // The process-wide loop, started on first use.
+    static std::shared_ptr<EncoderLoop> shared()
+    {
+        static std::shared_ptr<EncoderLoop> loop = std::make_shared<EncoderLoop>();
+        return loop;
+    }
+
+    EncoderLoop()
+    {
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0)
+            throw std::runtime_error("Failed to create encoder loop: " + std::string(strerror(errno)));
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        thread = std::thread(&EncoderLoop::run, this);
+    }
+
+    ~EncoderLoop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake();
+        if (thread.joinable())
+            thread.join();
+        ::close(epoll_fd);
+        ::close(wake_fd);
+    }
+
+    // Starts watching `fd` for `events` (EPOLLIN/EPOLLOUT, level-triggered). Returns an id for remove(),
+    // or 0 and sets errno if epoll refuses the fd.
+    uint64_t add(int fd, uint32_t events, handler_t handler)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t id = next_id++;
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.u64 = id;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            return 0;
+        entries[id] = {fd, std::move(handler)};
+        return id;
+    }
+
+    // Stops watching. Once this returns the handler is not running and will not run again,
+    // so the fd can be closed. May be called from a handler, including the one being removed.
+    void remove(uint64_t id)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it == entries.end())
+            return;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+        entries.erase(it);
+        if (std::this_thread::get_id() != thread.get_id())
+            idle.wait(lock, [&] { return running != id; });
+    }
+
+    // Changes the events watched for `id`; 0 stops watching without removing it. Returns false for an unknown id.
+    bool set_events(uint64_t id, uint32_t events)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it == entries.end())
+            return false;
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.u64 = id;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, it->second.fd, &ev) == 0;
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+  private:
+    struct entry_t
+    {
+        int fd;
+        handler_t handler;
+    };
+
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable idle;
+    std::map<uint64_t, entry_t> entries;
+    uint64_t next_id = 1;
+    // id of the handler being run, 0 for none
+    uint64_t running = 0;
+    bool quit = false;
+
+    void wake()
+    {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            return;
+    }
+
+    void run()
+    {
+        epoll_event events[64];
+        for (;;)
+        {
+            int n = epoll_wait(epoll_fd, events, 64, -1);
+            if (n < 0 && errno != EINTR)
+                return;
+            for (int i = 0; i < n; i++)
+            {
+                uint64_t id = events[i].data.u64;
+                if (id == 0)
+                {
+                    uint64_t count;
+                    ssize_t ret = read(wake_fd, &count, sizeof(count));
+                    (void)ret;
+                    continue;
+                }
+                handler_t handler;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto it = entries.find(id);
+                    // removed by an earlier handler of this round
+                    if (it == entries.end())
+                        continue;
+                    handler = it->second.handler;
+                    running = id;
+                }
+                handler(events[i].events);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    running = 0;
+                }
+                idle.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (quit)
+                return;
+        }
+    }
+};
+
+#endif
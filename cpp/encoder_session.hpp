@@ -0,0 +1,1850 @@
+#ifndef __ENCODER_SESSION_H__
+#define __ENCODER_SESSION_H__
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <linux/videodev2.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "device_registry.hpp"
+#include "emulated_backend.hpp"
+#include "encoder_backend.hpp"
+#include "encoder_stats.hpp"
+#include "file_sink.hpp"
+#include "frame_hub.hpp"
+#include "frame_pool.hpp"
+#include "gop_cache.hpp"
+#include "input_pool.hpp"
+#include "pixel_convert.hpp"
+#include "rate_controller.hpp"
+#include "rtp_packetizer.hpp"
+#include "util.hpp"
+
+struct buffer
+{
+    void *start = nullptr;
+    int length = 0;
+    struct v4l2_buffer inner;
+    struct v4l2_plane plane;
+};
+
+// static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
+// {
+//     if (cs == libcamera::ColorSpace::Rec709)
+//         return V4L2_COLORSPACE_REC709;
+//     else if (cs == libcamera::ColorSpace::Smpte170m)
+//         return V4L2_COLORSPACE_SMPTE170M;
+
+//     // LOG(1, "H264: surprising colour space: " << libcamera::ColorSpace::toString(cs));
+//     return V4L2_COLORSPACE_SMPTE170M;
+// }
+
+// mmaps the buffer at `index` for the given type of device (capture or output).
+void map(EncoderBackend &device, uint32_t type, uint32_t index, struct buffer *buffer, enum v4l2_memory mem_type)
+{
+    struct v4l2_buffer *inner = &buffer->inner;
+
+    memset(inner, 0, sizeof(*inner));
+    memset(&buffer->plane, 0, sizeof(buffer->plane));
+    inner->type = type;
+    inner->memory = mem_type;
+
+    inner->index = index;
+    inner->length = 1;
+    inner->m.planes = &buffer->plane;
+    if (device.ioctl(VIDIOC_QUERYBUF, inner) < 0)
+        throw std::runtime_error("Failed to query buffer " + std::to_string(index) + ": " + std::string(strerror(errno)));
+    buffer->length = inner->m.planes[0].length;
+    buffer->start = device.mmap(buffer->length, inner->m.planes[0].m.mem_offset);
+    if (buffer->start == (void *)-1)
+    {
+        buffer->start = nullptr;
+        throw std::runtime_error("mmap failed: " + std::string(strerror(errno)));
+    }
+}
+
+// CAPTURE buffers, shared between the worker and the encoded frames lent to JS.
+// The mappings stay alive until the last lent frame is released or garbage collected,
+// so JS never reads a region that has been unmapped by stop().
+struct capture_ring_t
+{
+    std::mutex mutex;
+    std::shared_ptr<EncoderBackend> device;
+    // false once the stream is off; lent buffers are then only unmapped, never re-queued
+    bool streaming = false;
+    std::vector<struct buffer> slots;
+    std::vector<bool> lent;
+    // bumped every time a slot is returned, so a stale owner cannot return it twice
+    std::vector<uint32_t> generation;
+    uint32_t lent_count = 0;
+
+    ~capture_ring_t()
+    {
+        unmap();
+    }
+
+    void unmap()
+    {
+        for (auto &slot : slots)
+        {
+            if (slot.start)
+                device->munmap(slot.start, slot.length);
+        }
+        slots.clear();
+        lent.clear();
+        generation.clear();
+        lent_count = 0;
+    }
+
+    void resize(uint32_t count)
+    {
+        slots.resize(count);
+        lent.assign(count, false);
+        generation.assign(count, 0);
+    }
+
+    int queue(uint32_t index)
+    {
+        struct buffer &slot = slots[index];
+        slot.inner.m.planes = &slot.plane;
+        return device->ioctl(VIDIOC_QBUF, &slot.inner);
+    }
+
+    // Marks `index` as lent to JS. Always keeps one slot with the driver so the encoder never starves.
+    // Returns false when the caller has to fall back to copying.
+    bool try_lend(uint32_t index, uint32_t &gen)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (lent_count + 1 >= slots.size())
+            return false;
+        lent[index] = true;
+        lent_count++;
+        gen = generation[index];
+        return true;
+    }
+
+    // Hands a lent slot back to the driver. No-op if it has already been returned.
+    void give_back(uint32_t index, uint32_t gen)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index >= slots.size() || !lent[index] || generation[index] != gen)
+            return;
+        lent[index] = false;
+        lent_count--;
+        generation[index]++;
+        if (streaming)
+            queue(index);
+        else if (lent_count == 0)
+            unmap();
+    }
+
+    // Returns the lent slot containing `address`, used by an explicit release() from JS.
+    bool give_back(const uint8_t *address)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < slots.size(); i++)
+        {
+            const uint8_t *start = (const uint8_t *)slots[i].start;
+            if (!lent[i] || address < start || address >= start + slots[i].length)
+                continue;
+            lent[i] = false;
+            lent_count--;
+            generation[i]++;
+            if (streaming)
+                queue(i);
+            else if (lent_count == 0)
+                unmap();
+            return true;
+        }
+        return false;
+    }
+};
+
+// What JS passed along with a raw frame, handed back with the encoded one.
+struct frame_meta_t
+{
+    // presentation timestamp, in whatever units the caller uses
+    int64_t pts = 0;
+    bool has_pts = false;
+    // passed as a bigint, so it goes back to JS as one
+    bool pts_bigint = false;
+    // opaque to the encoder
+    double tag = 0;
+    bool has_tag = false;
+};
+
+// One encoded frame on its way to JS: a copy (pooled or on the heap), or a CAPTURE slot lent from the ring.
+struct frame_data_t
+{
+    uint32_t size;
+    uint8_t *data;
+    std::shared_ptr<capture_ring_t> ring;
+    uint32_t index = 0;
+    uint32_t generation = 0;
+    // set when `data` is a FramePool buffer of `capacity` bytes
+    std::shared_ptr<FramePool> pool;
+    size_t capacity = 0;
+    bool keyframe = false;
+    // monotonic_us() when the CAPTURE buffer was dequeued
+    uint64_t dequeued_us = 0;
+    // feed sequence number of the raw frame, what came with it and how long it took to encode;
+    // encode_us is 0 when the frame could not be matched
+    uint64_t sequence = 0;
+    frame_meta_t meta;
+    uint32_t encode_us = 0;
+
+    frame_data_t(uint32_t size, uint8_t *data) : size(size), data(data) {}
+    // Room for `size` bytes from `pool`, for the caller to fill.
+    frame_data_t(uint32_t size, std::shared_ptr<FramePool> _pool) : size(size), pool(std::move(_pool))
+    {
+        data = pool->take(size, capacity);
+    }
+    frame_data_t(uint32_t size, uint8_t *data, std::shared_ptr<capture_ring_t> ring, uint32_t index, uint32_t generation)
+        : size(size), data(data), ring(std::move(ring)), index(index), generation(generation)
+    {
+    }
+    frame_data_t(const frame_data_t &) = delete;
+    frame_data_t &operator=(const frame_data_t &) = delete;
+
+    // Takes over everything but the data from the frame this one is a copy of.
+    void inherit(const frame_data_t &from)
+    {
+        keyframe = from.keyframe;
+        dequeued_us = from.dequeued_us;
+        sequence = from.sequence;
+        meta = from.meta;
+        encode_us = from.encode_us;
+    }
+
+    ~frame_data_t()
+    {
+        if (ring)
+            ring->give_back(index, generation);
+        else if (pool)
+            pool->give(data, capacity);
+        else
+            delete[] data;
+    }
+};
+
+// What feed() did with a frame. Non-negative values mean the frame will be encoded.
+enum feed_status_t
+{
+    FEED_QUEUED = 0,
+    // drop-oldest: kept until an OUTPUT slot frees up, unless a newer frame replaces it first
+    FEED_HELD = 1,
+    // every OUTPUT slot is with the driver; feed again later
+    FEED_BUSY = -1,
+    // drop-newest: discarded because every OUTPUT slot is with the driver
+    FEED_DROPPED = -2,
+    // stopped, or the driver refused the buffer
+    FEED_ERROR = -3,
+};
+
+// What feed() does when every OUTPUT slot is with the driver.
+enum class feed_policy_t
+{
+    // return FEED_BUSY
+    REJECT,
+    // wait up to feed_timeout_ms for a slot, then return FEED_BUSY
+    BLOCK,
+    // discard the new frame
+    DROP_NEWEST,
+    // hold the new frame for the next free slot, discarding the one held before
+    DROP_OLDEST,
+};
+
+// Runtime changes requested from JS, applied by the encoder thread between frames. Later requests of the
+// same kind replace earlier ones that were not applied yet.
+struct control_changes_t
+{
+    bool keyframe = false;
+    // 0 leaves it unchanged
+    uint32_t bitrate = 0;
+    // I-frame period in frames, -1 leaves it unchanged
+    int32_t gop = -1;
+    // 0 leaves it unchanged
+    uint32_t framerate = 0;
+
+    bool empty() const
+    {
+        return !keyframe && !bitrate && gop < 0 && !framerate;
+    }
+};
+
+// Everything needed to open and configure an encoder session, independent of how it was requested.
+struct encoder_config_t
+{
+    uint32_t width = 640;
+    uint32_t height = 480;
+    uint32_t bitrate_bps = 4 * 1024 * 1024;
+    int level = V4L2_MPEG_VIDEO_H264_LEVEL_4_2;
+    uint32_t pixel_format = V4L2_PIX_FMT_YUYV;
+    uint8_t num_planes = 1;
+    // 0 lets the driver choose
+    uint32_t bytesperline = 0;
+    // 0 keeps the driver default
+    uint32_t colorspace = 0;
+    // 0 keeps the driver default
+    uint32_t framerate = 0;
+    // extra (id, value) controls applied before the format is set
+    std::vector<std::pair<uint32_t, int32_t>> controllers;
+    uint32_t output_buffer_count = 4;
+    uint32_t capture_buffer_count = 4;
+    /**
+     * 1: feed fd;
+     * 2: feed buffer;
+     */
+    uint8_t feed_type = 1;
+    // hand CAPTURE buffers out without copying; they return to the driver when the frame is released
+    bool lend_buffers = false;
+    std::string file;
+    // encoded frames the file writer may fall behind by
+    uint32_t file_queue_frames = 64;
+    file_sync_t file_sync = file_sync_t::NONE;
+    uint32_t file_sync_interval_ms = 1000;
+    // block the encoder instead of dropping frames when the file writer falls behind
+    bool file_block = false;
+    // write `file` as fragmented MP4 instead of raw Annex B
+    bool file_fmp4 = false;
+    // roll fMP4 files at the first keyframe after this many ms, 0 writes a single file
+    uint32_t segment_duration_ms = 0;
+    // hand fMP4 fragments to the consumer (take_fragments)
+    bool deliver_fragments = false;
+    // packetize encoded frames as RTP (RFC 6184) on the encoder thread
+    bool rtp = false;
+    // bytes of an RTP packet at most, header included
+    uint32_t rtp_mtu = 1200;
+    uint8_t rtp_payload_type = 96;
+    // 0 picks a random one
+    uint32_t rtp_ssrc = 0;
+    uint32_t rtp_clock_rate = 90000;
+    // ticks per second of the pts passed to feed(), for RTP timestamps that follow it; 0 means rtp_clock_rate
+    uint32_t rtp_pts_rate = 0;
+    rtp_timestamp_source_t rtp_timestamp_source = rtp_timestamp_source_t::AUTO;
+    // send the packets to this UDP destination; without one they go to the consumer in batches (take_rtp_batches)
+    std::string rtp_host;
+    uint16_t rtp_port = 0;
+    // bytes of copied-frame memory kept for reuse, 0 allocates every copy
+    uint32_t frame_pool_bytes = 8 << 20;
+    // bytes of the current GOP kept for consumers joining mid-stream; 0 keeps only the parameter sets
+    uint32_t gop_cache_bytes = 0;
+    // steer the bitrate setting so the output follows rate_target (0: bitrate_bps) within [rate_min, rate_max]
+    bool rate_control = false;
+    uint32_t rate_target = 0;
+    uint32_t rate_min = 0;
+    uint32_t rate_max = 0;
+    uint32_t rate_window_ms = 1000;
+    // "v4l2" or "emulated"
+    std::string backend = "v4l2";
+    // BUFFER input in this layout ("rgba", "bgra", "rgb24", "yuyv", "uyvy") is converted to pixel_format
+    // (NV12 or YUV420) while it is written into the OUTPUT buffer; empty feeds pixel_format as is
+    std::string input_format;
+    // bytes per source row, 0 for tightly packed rows
+    uint32_t input_stride = 0;
+    // threads a conversion is split across, 0 picks by frame size
+    uint32_t convert_threads = 0;
+    feed_policy_t feed_policy = feed_policy_t::REJECT;
+    uint32_t feed_timeout_ms = 100;
+    // encoder node; empty picks the least loaded one the DeviceRegistry found
+    std::string device_path;
+    // where BUFFER input lives: "copy" (MMAP buffers), "userptr", "dmabuf" or "auto" (dmabuf, then userptr).
+    // Anything but "copy" falls back to it when the kernel or driver refuses.
+    std::string input_memory = "copy";
+    double emulated_latency_ms = 5;
+    std::string emulated_replay;
+
+    enum v4l2_memory output_mem_type() const
+    {
+        return feed_type == 2 ? V4L2_MEMORY_MMAP : V4L2_MEMORY_DMABUF;
+    }
+};
+
+// One stateful encoder: the device (or its emulation), the OUTPUT/CAPTURE buffer rings and the
+// feed/dequeue logic. It knows nothing about JS, so the addon and the native benchmark drive the same code.
+class EncoderSession
+{
+  public:
+    encoder_config_t config;
+    std::shared_ptr<EncoderBackend> device;
+    std::vector<struct buffer> outputs;
+    std::shared_ptr<capture_ring_t> captures = std::make_shared<capture_ring_t>();
+    // memory of the frames copied out of CAPTURE buffers, reused once they are released
+    std::shared_ptr<FramePool> frame_pool = std::make_shared<FramePool>(0);
+    // OUTPUT slots currently owned by us (not queued to the driver), guarded by operation_mutex
+    std::vector<uint32_t> free_outputs;
+    std::unique_ptr<FileSink<frame_data_t>> file_sink;
+    GopCache<frame_data_t> gop_cache{frame_pool};
+    // subscribers attached through an EncoderHub
+    FrameHub<frame_data_t> hub;
+    std::unique_ptr<Fmp4Muxer> muxer;
+    std::unique_ptr<FileSink<mp4_fragment_t>> mp4_sink;
+    // fragments completed by the muxer and not yet taken by the consumer, guarded by operation_mutex
+    std::vector<std::shared_ptr<mp4_fragment_t>> fragments;
+    std::unique_ptr<RtpSink> rtp_sink;
+    // packets of the frames not yet taken by the consumer when there is no RTP destination, guarded by operation_mutex
+    std::vector<std::shared_ptr<rtp_batch_t>> rtp_batches;
+    bool stopped = false;
+    std::mutex operation_mutex; // 互斥量，保护 feed 和 stop 操作
+    std::condition_variable frame_available;
+    // whether anybody consumes encoded frames; if not, CAPTURE buffers are re-queued without copying
+    bool deliver_frames = true;
+
+    encoder_stats_t stats;
+    // Every queued OUTPUT buffer carries its feed sequence number as timestamp, which the driver copies to the
+    // CAPTURE buffer; fed_frames remembers when each of the last FEED_RING sequence numbers was fed, and with what.
+    static constexpr uint32_t FEED_RING = 64;
+    uint64_t feed_sequence = 0;
+    struct
+    {
+        uint64_t fed_us = 0;
+        frame_meta_t meta;
+    } fed_frames[FEED_RING];
+    // metadata for the frame being fed, guarded by operation_mutex
+    frame_meta_t feed_meta;
+    // the node this session was placed on, empty for the emulated backend
+    std::string device_path;
+    // whether device_path still carries this session's load
+    bool placed = false;
+    // drop-oldest: the newest frame that found no free slot, guarded by operation_mutex.
+    // Buffer input is copied; for fd input a dup keeps the dmabuf alive.
+    struct
+    {
+        std::vector<uint8_t> data;
+        int fd = -1;
+        uint32_t size = 0;
+        frame_meta_t meta;
+        bool valid = false;
+    } held;
+    // memory type of the OUTPUT queue, and the native buffers behind it unless that is MMAP
+    enum v4l2_memory output_memory = V4L2_MEMORY_MMAP;
+    std::shared_ptr<InputPool> input_pool;
+    uint32_t output_sizeimage = 0;
+    // layout of a 4:2:0 picture in an OUTPUT buffer, when pixel_format is NV12 or YUV420
+    bool output_yuv420 = false;
+    bool output_nv12 = false;
+    uint32_t output_stride = 0;
+    uint32_t output_luma_rows = 0;
+    // inputFormat conversion: kernel and threads
+    row_pair_converter converter = nullptr;
+    std::unique_ptr<RowPool> convert_pool;
+    pixel_layout_t convert_layout = pixel_layout_t::RGBA;
+    // a feed found no free slot; the next reclaimed slot raises `drained`. Guarded by operation_mutex.
+    bool congested = false;
+    std::atomic<bool> drained = false;
+    // readable while control changes wait for the encoder thread, which polls it next to the device
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // guards pending_controls and rate_controller, which JS and the encoder thread both touch
+    std::mutex controls_mutex;
+    control_changes_t pending_controls;
+    std::unique_ptr<RateController> rate_controller;
+    // failed control changes, reported through the callback; guarded by operation_mutex
+    std::vector<std::string> control_errors;
+    // flush(): a drain is under way, and the number of the latest one; guarded by operation_mutex
+    bool draining = false;
+    uint64_t flushes_requested = 0;
+    // number of the latest drain whose last buffer came back
+    std::atomic<uint64_t> flushes_completed = 0;
+    // the I-frame period or a raw control was changed, which the next user of the device would inherit
+    bool controls_dirty = false;
+    // stop() left the device to another session; `device` is only kept for an encoder thread still polling it
+    bool handed_over = false;
+    // the consumer's queue is full: encoded frames stay with the driver, which stalls, until resume_captures()
+    std::atomic<bool> captures_paused = false;
+
+    ~EncoderSession()
+    {
+        stop();
+        if (wake_fd >= 0)
+            ::close(wake_fd);
+    }
+
+    // All initialization that can fail is performed here.
+    // On failure, it returns the error message and cleans up any partially acquired resources.
+    std::string open(const encoder_config_t &_config)
+    {
+        std::string error = prepare(_config);
+        return error.empty() ? begin(_config) : error;
+    }
+
+    // The device part of open(): opens and configures it, streaming with nothing queued. A SessionPool does this ahead of time.
+    std::string prepare(const encoder_config_t &_config)
+    {
+        config = _config;
+        std::string error;
+        // 1. Open device, or its software emulation
+        if (config.backend == "emulated")
+        {
+            auto emulated = std::make_shared<EmulatedBackend>();
+            emulated->latency = std::chrono::microseconds((int64_t)(config.emulated_latency_ms * 1000));
+            device = emulated;
+            if (!config.emulated_replay.empty() && !emulated->load_replay(config.emulated_replay, error))
+            {
+                device->close();
+                return error;
+            }
+        }
+        else
+        {
+            auto v4l2 = std::make_shared<V4L2Backend>();
+            device = v4l2;
+            device_path = DeviceRegistry::shared().acquire(config.device_path, pixel_rate());
+            placed = true;
+            if (!v4l2->open(device_path, error))
+            {
+                unplace();
+                return error;
+            }
+        }
+        captures->device = device;
+
+        // 2. Configure V4L2 device. Wrap in try-catch to handle errors from ioctl/mmap.
+        try
+        {
+            configure_v4l2();
+        }
+        catch (const std::runtime_error &e)
+        {
+            error = e.what();
+            // Cleanup all resources acquired so far
+            release_device();
+            return error;
+        }
+        return error;
+    }
+
+    // The stream part of open(), on a prepared session: output file, pools and rate control, and the bitrate
+    // if it differs from the prepared one. `_config` must otherwise match the prepared settings. On failure the device is released.
+    std::string begin(const encoder_config_t &_config)
+    {
+        bool bitrate_changed = _config.bitrate_bps != config.bitrate_bps;
+        config = _config;
+        frame_pool->max_bytes = config.frame_pool_bytes;
+        gop_cache.max_bytes = config.gop_cache_bytes;
+        if (config.rate_control)
+        {
+            uint32_t target = config.rate_target ? config.rate_target : config.bitrate_bps;
+            rate_controller = std::make_unique<RateController>(target, config.rate_min ? config.rate_min : target / 8, config.rate_max ? config.rate_max : target * 2,
+                                                               config.rate_window_ms, config.bitrate_bps);
+        }
+        std::string error;
+        v4l2_control ctrl = {};
+        ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+        ctrl.value = config.bitrate_bps;
+        if (bitrate_changed && device->ioctl(VIDIOC_S_CTRL, &ctrl) < 0)
+            error = "Failed to set bitrate: " + std::string(strerror(errno));
+        // Open output file if specified
+        bool opened = error.empty();
+        if (opened && !config.file.empty() && config.file_fmp4)
+            opened = open_sink(mp4_sink, error);
+        else if (opened && !config.file.empty())
+            opened = open_sink(file_sink, error);
+        if (!opened)
+        {
+            stream_off();
+            release_device();
+            return error;
+        }
+        if (mp4_sink || config.deliver_fragments)
+            muxer = std::make_unique<Fmp4Muxer>(config.width, config.height, config.framerate, config.segment_duration_ms);
+        if (config.rtp)
+        {
+            rtp_sink = std::make_unique<RtpSink>(config.rtp_mtu, config.rtp_payload_type, config.rtp_ssrc, config.rtp_clock_rate);
+            rtp_sink->packetizer.source = config.rtp_timestamp_source;
+        }
+        if (rtp_sink && !config.rtp_host.empty() && !rtp_sink->connect(config.rtp_host, config.rtp_port, error))
+        {
+            rtp_sink.reset();
+            muxer.reset();
+            file_sink.reset();
+            mp4_sink.reset();
+            stream_off();
+            release_device();
+        }
+        return error;
+    }
+
+    template <typename Frame>
+    bool open_sink(std::unique_ptr<FileSink<Frame>> &sink, std::string &error)
+    {
+        sink = std::make_unique<FileSink<Frame>>();
+        sink->sync = config.file_sync;
+        sink->sync_interval_ms = config.file_sync_interval_ms;
+        sink->block = config.file_block;
+        sink->roll = config.segment_duration_ms > 0;
+        if (sink->open(config.file, config.file_queue_frames, error))
+            return true;
+        sink.reset();
+        return false;
+    }
+
+    // Passes whatever the muxer completed to the fMP4 file and the consumer.
+    void dispatch_fragments(size_t from)
+    {
+        for (size_t i = from; i < fragments.size(); i++)
+        {
+            if (mp4_sink)
+                mp4_sink->push(fragments[i]);
+        }
+        if (!config.deliver_fragments)
+            fragments.clear();
+    }
+
+    // Fragments completed since the last call; after stop() this includes the final, partial GOP.
+    std::vector<std::shared_ptr<mp4_fragment_t>> take_fragments()
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        return std::move(fragments);
+    }
+
+    // RTP packets of the frames encoded since the last call, when there is no RTP destination.
+    std::vector<std::shared_ptr<rtp_batch_t>> take_rtp_batches()
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        return std::move(rtp_batches);
+    }
+
+    // Unmaps every buffer, frees the driver-side queues and closes the device, unless it was handed over.
+    void release_device()
+    {
+        if (handed_over)
+            return;
+        release_buffers();
+        if (device)
+            device->close();
+        unplace();
+    }
+
+    // Unmaps every buffer and frees the driver-side queues, which must not be streaming.
+    void release_buffers()
+    {
+        {
+            // Lent slots keep their mapping (and the underlying buffers) alive until JS lets go of them.
+            std::lock_guard<std::mutex> lock(captures->mutex);
+            captures->streaming = false;
+            if (captures->lent_count == 0)
+                captures->unmap();
+        }
+        for (auto &slot : outputs)
+        {
+            // USERPTR/DMABUF slots point into input_pool, which JS may still hold
+            if (slot.start && output_memory == V4L2_MEMORY_MMAP)
+                device->munmap(slot.start, slot.length);
+            slot.start = nullptr;
+        }
+        outputs.clear();
+        free_outputs.clear();
+        if (device)
+        {
+            // Request to free buffers before closing the device
+            struct v4l2_requestbuffers buf_req = {};
+            buf_req.count = 0;
+            buf_req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            buf_req.memory = output_memory;
+            device->ioctl(VIDIOC_REQBUFS, &buf_req);
+            buf_req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            buf_req.memory = V4L2_MEMORY_MMAP;
+            device->ioctl(VIDIOC_REQBUFS, &buf_req);
+        }
+    }
+
+    void stream_off()
+    {
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        device->ioctl(VIDIOC_STREAMOFF, &type);
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        device->ioctl(VIDIOC_STREAMOFF, &type);
+    }
+
+    // What this session adds to its node's load.
+    uint64_t pixel_rate() const
+    {
+        // an unknown framerate counts as 30 fps
+        return (uint64_t)config.width * config.height * (config.framerate ? config.framerate : 30);
+    }
+
+    // Records a framerate the device accepted: the node's load and the fMP4 sample duration follow it.
+    // Must be called with operation_mutex held.
+    void set_framerate_setting(uint32_t framerate)
+    {
+        uint64_t previous_rate = pixel_rate();
+        config.framerate = framerate;
+        if (placed && pixel_rate() != previous_rate)
+        {
+            DeviceRegistry::shared().release(device_path, previous_rate);
+            DeviceRegistry::shared().acquire(device_path, pixel_rate());
+        }
+        if (muxer)
+            muxer->sample_duration = Fmp4Muxer::TIMESCALE / framerate;
+    }
+
+    // Takes this session's load off its node; safe to call more than once.
+    void unplace()
+    {
+        if (!placed)
+            return;
+        DeviceRegistry::shared().release(device_path, pixel_rate());
+        placed = false;
+    }
+
+    void configure_v4l2()
+    {
+        for (auto [id, value] : config.controllers)
+        {
+            v4l2_control ctrl = {};
+            ctrl.id = id;
+            ctrl.value = value;
+            if (device->ioctl(VIDIOC_S_CTRL, &ctrl) < 0)
+                throw std::runtime_error("Failed to set controller " + std::to_string(id) + ": " + strerror(errno));
+        }
+        // 设置码率
+        v4l2_control ctrl = {};
+        ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+        ctrl.value = config.bitrate_bps;
+        if (device->ioctl(VIDIOC_S_CTRL, &ctrl) < 0)
+            throw std::runtime_error("Failed to set bitrate: " + std::string(strerror(errno)));
+
+        ctrl.id = V4L2_CID_MPEG_VIDEO_H264_LEVEL;
+        ctrl.value = config.level;
+        if (device->ioctl(VIDIOC_S_CTRL, &ctrl) < 0)
+            throw std::runtime_error("Failed to set H.264 level: " + std::string(strerror(errno)));
+
+        struct v4l2_format fmt;
+        fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        if (device->ioctl(VIDIOC_G_FMT, &fmt) < 0)
+            throw std::runtime_error("Failed to get output format (VIDIOC_G_FMT): " + std::string(strerror(errno)));
+
+        fmt.fmt.pix_mp.width = config.width;
+        fmt.fmt.pix_mp.height = config.height;
+        fmt.fmt.pix_mp.pixelformat = config.pixel_format;
+        fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+        fmt.fmt.pix_mp.num_planes = config.num_planes;
+        if (config.bytesperline)
+            fmt.fmt.pix_mp.plane_fmt[0].bytesperline = config.bytesperline;
+        if (config.colorspace)
+            fmt.fmt.pix_mp.colorspace = config.colorspace;
+        if (device->ioctl(VIDIOC_S_FMT, &fmt) < 0)
+            throw std::runtime_error("Failed to set output format (VIDIOC_S_FMT): " + std::string(strerror(errno)));
+        describe_output(fmt.fmt.pix_mp);
+        if (!config.input_format.empty())
+            prepare_conversion();
+
+        fmt = {};
+        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if (device->ioctl(VIDIOC_G_FMT, &fmt) < 0)
+            throw std::runtime_error("Failed to get capture format (VIDIOC_G_FMT): " + std::string(strerror(errno)));
+
+        fmt.fmt.pix_mp.width = config.width;
+        fmt.fmt.pix_mp.height = config.height;
+        fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+        fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+        fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+        fmt.fmt.pix_mp.num_planes = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+        fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 1024 << 10;
+        if (device->ioctl(VIDIOC_S_FMT, &fmt) < 0)
+            throw std::runtime_error("Failed to set capture format (VIDIOC_S_FMT): " + std::string(strerror(errno)));
+
+        if (config.framerate)
+        {
+            auto framerate = config.framerate;
+            struct v4l2_streamparm params;
+            memset(&params, 0, sizeof(params));
+            params.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            params.parm.output.timeperframe.numerator = 1;
+            params.parm.output.timeperframe.denominator = framerate;
+            if (device->ioctl(VIDIOC_S_PARM, &params) < 0)
+                throw std::runtime_error("Failed to set framerate: " + std::string(strerror(errno)));
+        }
+
+        output_memory = config.output_mem_type();
+        // converted input is written by the converter anyway, so only raw frames are worth lending the OUTPUT memory for
+        bool lend_outputs = config.feed_type == 2 && config.input_format.empty();
+        bool native = false;
+        if (lend_outputs && (config.input_memory == "dmabuf" || config.input_memory == "auto"))
+            native = use_input_memory(input_memory_t::DMABUF);
+        if (lend_outputs && !native && (config.input_memory == "userptr" || config.input_memory == "auto"))
+            native = use_input_memory(input_memory_t::USERPTR);
+        struct v4l2_requestbuffers buf = {};
+        if (!native)
+        {
+            buf.count = config.output_buffer_count;
+            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            buf.memory = output_memory;
+            if (device->ioctl(VIDIOC_REQBUFS, &buf) < 0)
+                throw std::runtime_error("Failed to request output buffers: " + std::string(strerror(errno)));
+            // The driver may grant a different number of buffers than requested.
+            outputs.resize(buf.count);
+            for (uint32_t i = 0; i < buf.count; i++)
+            {
+                if (config.feed_type == 2)
+                    map(*device, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, i, &outputs[i], output_memory);
+            }
+        }
+        for (uint32_t i = 0; i < outputs.size(); i++)
+            free_outputs.push_back(outputs.size() - 1 - i);
+        // the fallback still lends native buffers, copied on feed, so JS is written the same way either way
+        if (config.feed_type == 2 && config.input_memory != "copy" && !native)
+        {
+            uint32_t src_stride = config.input_stride ? config.input_stride : config.width * bytes_per_pixel(convert_layout);
+            auto pool = std::make_shared<InputPool>();
+            std::string error;
+            if (!pool->allocate(input_memory_t::COPY, outputs.size(), converter ? src_stride * config.height : output_sizeimage, error))
+                throw std::runtime_error(error);
+            input_pool = std::move(pool);
+        }
+
+        buf = {};
+        buf.count = config.capture_buffer_count;
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (device->ioctl(VIDIOC_REQBUFS, &buf) < 0)
+            throw std::runtime_error("Failed to request capture buffers: " + std::string(strerror(errno)));
+        captures->resize(buf.count);
+        for (uint32_t i = 0; i < buf.count; i++)
+        {
+            map(*device, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, i, &captures->slots[i], V4L2_MEMORY_MMAP);
+            if (captures->queue(i) < 0)
+                throw std::runtime_error("Failed to queue initial capture buffer: " + std::string(strerror(errno)));
+        }
+        captures->streaming = true;
+
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        if (device->ioctl(VIDIOC_STREAMON, &type) < 0)
+            throw std::runtime_error("Failed to start output stream: " + std::string(strerror(errno)));
+
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if (device->ioctl(VIDIOC_STREAMON, &type) < 0)
+            throw std::runtime_error("Failed to start capture stream: " + std::string(strerror(errno)));
+    }
+
+    // Backs the OUTPUT queue with natively allocated buffers JS can fill in place. Returns false, leaving the
+    // queue unallocated, if udmabuf is missing or the driver refuses the memory type; the caller then falls back to MMAP.
+    bool use_input_memory(input_memory_t memory)
+    {
+        enum v4l2_memory type = memory == input_memory_t::DMABUF ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_USERPTR;
+        struct v4l2_requestbuffers buf = {};
+        buf.count = config.output_buffer_count;
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        buf.memory = type;
+        if (device->ioctl(VIDIOC_REQBUFS, &buf) < 0)
+            return false;
+        auto pool = std::make_shared<InputPool>();
+        std::string error;
+        bool ok = pool->allocate(memory, buf.count, output_sizeimage, error);
+        outputs.resize(ok ? buf.count : 0);
+        for (uint32_t i = 0; i < outputs.size(); i++)
+        {
+            struct buffer &output = outputs[i];
+            output.start = pool->slots[i].data;
+            output.length = pool->slots[i].length;
+            output.inner = {};
+            output.plane = {};
+            output.inner.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            output.inner.memory = type;
+            output.inner.index = i;
+            output.inner.length = 1;
+            output.inner.m.planes = &output.plane;
+            output.plane.length = output.length;
+            if (memory == input_memory_t::DMABUF)
+                output.plane.m.fd = pool->slots[i].dmabuf_fd;
+            else
+                output.plane.m.userptr = (unsigned long)output.start;
+        }
+        // Drivers that need physically contiguous memory only refuse it when the buffer is prepared, so queue one
+        // before streaming starts; STREAMOFF hands it back.
+        if (ok)
+        {
+            outputs[0].plane.bytesused = outputs[0].length;
+            ok = device->ioctl(VIDIOC_QBUF, &outputs[0].inner) == 0;
+            int stream = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            device->ioctl(VIDIOC_STREAMOFF, &stream);
+        }
+        if (!ok)
+        {
+            outputs.clear();
+            buf.count = 0;
+            device->ioctl(VIDIOC_REQBUFS, &buf);
+            return false;
+        }
+        output_memory = type;
+        input_pool = std::move(pool);
+        return true;
+    }
+
+    // Waits up to `timeout` ms for the device, then reclaims finished OUTPUT buffers and passes every
+    // encoded frame to `on_frame` as a std::shared_ptr<frame_data_t>. Returns false and sets `error` on a fatal error.
+    template <typename OnFrame>
+    bool wait(int timeout, OnFrame on_frame, std::string &error)
+    {
+        // while paused the device stays ready, so only wait for resume_captures()
+        int device_fd = captures_paused.load(std::memory_order_acquire) ? -1 : device->poll_fd();
+        pollfd p[2] = {{device_fd, device->poll_events(), 0}, {wake_fd, POLLIN, 0}};
+        int ret = poll(p, 2, timeout);
+        if (ret > 0)
+            stats.poll_wakeups.fetch_add(1, std::memory_order_relaxed);
+        if (ret == -1)
+        {
+            std::cerr << strerror(errno) << std::endl;
+            if (errno == EINTR)
+                return true;
+            error = "unexpected errno " + std::to_string(errno) + " from poll";
+            return false;
+        }
+        if (p[1].revents & POLLIN)
+            service_controls();
+        return service(p[0].revents, on_frame, error);
+    }
+
+    // The part of wait() after the device became ready, for callers that poll the fd themselves.
+    template <typename OnFrame>
+    bool service(short revents, OnFrame on_frame, std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (stopped)
+            return true;
+        // An emulated device only signals POLLIN, so always look at both queues.
+        if (revents & (POLLIN | POLLOUT))
+        {
+            uint32_t dequeued = reclaim_outputs();
+            bool ok = drain_captures(on_frame, dequeued, error);
+            if (dequeued)
+                stats.useful_wakeups.fetch_add(1, std::memory_order_relaxed);
+            // the rate controller may have asked for a new bitrate
+            apply_controls();
+            return ok;
+        }
+        return true;
+    }
+
+    // Applies pending control changes after wake_fd fired, for callers that poll the fd themselves.
+    void service_controls()
+    {
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0)
+            count = 0;
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (!stopped)
+            apply_controls();
+    }
+
+    // Called when the consumer took frames out of its full queue; wakes the encoder thread.
+    void resume_captures()
+    {
+        if (!captures_paused.exchange(false))
+            return;
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            return;
+    }
+
+    // Queues a control change for the encoder thread and wakes it.
+    template <typename Change>
+    void change_controls(Change change)
+    {
+        {
+            std::lock_guard<std::mutex> lock(controls_mutex);
+            change(pending_controls);
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            return;
+    }
+
+    void request_keyframe()
+    {
+        change_controls([](control_changes_t &c) { c.keyframe = true; });
+    }
+
+    // With rate control on, this moves the controller's target and starts the setting from there.
+    void set_bitrate(uint32_t bitrate)
+    {
+        change_controls([&](control_changes_t &c) {
+            c.bitrate = bitrate;
+            if (rate_controller)
+                rate_controller->target = bitrate;
+        });
+    }
+
+    void set_gop(int32_t frames)
+    {
+        change_controls([&](control_changes_t &c) { c.gop = frames; });
+    }
+
+    void set_framerate(uint32_t framerate)
+    {
+        change_controls([&](control_changes_t &c) { c.framerate = framerate; });
+    }
+
+    // Network throughput measured by the application, in bits/s; caps the rate controller's goal.
+    void report_throughput(uint32_t bps)
+    {
+        change_controls([&](control_changes_t &c) {
+            if (!rate_controller)
+                return;
+            uint32_t bitrate = rate_controller->report_throughput(bps);
+            if (bitrate)
+                c.bitrate = bitrate;
+        });
+    }
+
+    // Runs the pending control changes against the device. Must be called with operation_mutex held, between frames.
+    void apply_controls()
+    {
+        control_changes_t changes;
+        {
+            std::lock_guard<std::mutex> lock(controls_mutex);
+            if (pending_controls.empty())
+                return;
+            std::swap(changes, pending_controls);
+        }
+        auto set = [&](uint32_t id, int32_t value, const char *what) {
+            v4l2_control ctrl = {};
+            ctrl.id = id;
+            ctrl.value = value;
+            if (device->ioctl(VIDIOC_S_CTRL, &ctrl) == 0)
+                return true;
+            control_errors.push_back("Failed to set " + std::string(what) + ": " + strerror(errno));
+            return false;
+        };
+        if (changes.bitrate && set(V4L2_CID_MPEG_VIDEO_BITRATE, changes.bitrate, "bitrate"))
+        {
+            config.bitrate_bps = changes.bitrate;
+            std::lock_guard<std::mutex> lock(controls_mutex);
+            if (rate_controller)
+                rate_controller->setting = changes.bitrate;
+        }
+        if (changes.gop >= 0)
+            controls_dirty = set(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, changes.gop, "I-frame period") || controls_dirty;
+        if (changes.framerate)
+        {
+            struct v4l2_streamparm params = {};
+            params.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            params.parm.output.timeperframe.numerator = 1;
+            params.parm.output.timeperframe.denominator = changes.framerate;
+            if (device->ioctl(VIDIOC_S_PARM, &params) == 0)
+                set_framerate_setting(changes.framerate);
+            else
+                control_errors.push_back("Failed to set framerate: " + std::string(strerror(errno)));
+        }
+        // last, so the keyframe lands on the next frame with everything else in effect
+        if (changes.keyframe)
+            set(V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1, "keyframe request");
+    }
+
+    // The first control change that failed since the last call, if any.
+    bool take_control_error(std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (control_errors.empty())
+            return false;
+        message = control_errors.front();
+        control_errors.erase(control_errors.begin());
+        return true;
+    }
+
+    // Dequeues every OUTPUT buffer the driver has finished reading and returns it to the free list.
+    // Must be called with operation_mutex held. Returns the number of buffers reclaimed.
+    uint32_t reclaim_outputs()
+    {
+        uint32_t count = 0;
+        for (;;)
+        {
+            struct v4l2_buffer buf = {};
+            struct v4l2_plane out_planes = {};
+            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            buf.memory = output_memory;
+            buf.length = 1;
+            buf.m.planes = &out_planes;
+            if (device->ioctl(VIDIOC_DQBUF, &buf) < 0)
+                break;
+            free_outputs.push_back(buf.index);
+            count++;
+            frame_available.notify_one();
+        }
+        if (count && held.valid)
+            queue_held();
+        if (count && congested && !free_outputs.empty())
+        {
+            congested = false;
+            drained.store(true, std::memory_order_release);
+        }
+        stats.outputs_queued.store(outputs.size() - free_outputs.size(), std::memory_order_relaxed);
+        return count;
+    }
+
+    // Stamps an OUTPUT buffer with the next feed sequence number.
+    void stamp(struct v4l2_buffer &buf)
+    {
+        buf.timestamp.tv_sec = feed_sequence / 1000000;
+        buf.timestamp.tv_usec = feed_sequence % 1000000;
+    }
+
+    // Bookkeeping for a frame that has just been queued.
+    void fed(uint32_t size)
+    {
+        uint64_t now = monotonic_us();
+        fed_frames[feed_sequence % FEED_RING] = {now, feed_meta};
+        feed_sequence++;
+        stats.frames_fed.fetch_add(1, std::memory_order_relaxed);
+        stats.bytes_in.fetch_add(size, std::memory_order_relaxed);
+        stats.last_feed_us.store(now, std::memory_order_relaxed);
+        stats.outputs_queued.store(outputs.size() - free_outputs.size(), std::memory_order_relaxed);
+    }
+
+    // Dequeues every ready CAPTURE buffer, hands the encoded data to `on_frame` and re-queues the buffer.
+    // Must be called with operation_mutex held. Returns false on a fatal error.
+    template <typename OnFrame>
+    bool drain_captures(OnFrame &on_frame, uint32_t &dequeued, std::string &error)
+    {
+        for (;;)
+        {
+            if (captures_paused.load(std::memory_order_acquire))
+                return true;
+            struct v4l2_buffer buf = {};
+            struct v4l2_plane out_planes = {};
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.length = 1;
+            buf.m.planes = &out_planes;
+            if (device->ioctl(VIDIOC_DQBUF, &buf) < 0)
+                return true;
+            dequeued++;
+            struct buffer &capture = captures->slots[buf.index];
+            // 提取capture buffer里的编码数据，即H264数据
+            uint32_t encoded_len = buf.m.planes[0].bytesused;
+            // the end of a drain; the buffer may be empty or hold the last frame
+            bool last = buf.flags & V4L2_BUF_FLAG_LAST;
+            bool requeue = true;
+            if (encoded_len == 0 && !last)
+                stats.frames_dropped.fetch_add(1, std::memory_order_relaxed);
+            if (encoded_len > 0)
+            {
+                uint64_t now = monotonic_us();
+                uint64_t sequence = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+                bool matched = sequence < feed_sequence && feed_sequence - sequence <= FEED_RING;
+                uint32_t encode_us = matched ? now - fed_frames[sequence % FEED_RING].fed_us : 0;
+                if (matched)
+                    stats.encode_latency.record(encode_us);
+                stats.frames_encoded.fetch_add(1, std::memory_order_relaxed);
+                stats.bytes_out.fetch_add(encoded_len, std::memory_order_relaxed);
+                if (rate_controller)
+                {
+                    std::lock_guard<std::mutex> lock(controls_mutex);
+                    uint32_t bitrate = rate_controller->on_frame(encoded_len, now);
+                    if (bitrate)
+                        pending_controls.bitrate = bitrate;
+                }
+                stats.last_frame_us.store(now, std::memory_order_relaxed);
+                gop_cache.add_parameter_sets((const uint8_t *)capture.start, encoded_len);
+                if (muxer)
+                {
+                    size_t from = fragments.size();
+                    muxer->add((const uint8_t *)capture.start, encoded_len, buf.flags & V4L2_BUF_FLAG_KEYFRAME, fragments);
+                    stats.bytes_copied.fetch_add(encoded_len, std::memory_order_relaxed);
+                    dispatch_fragments(from);
+                }
+                if (rtp_sink)
+                {
+                    // timestamps follow the pts given to feed() or the time the raw frame was fed, per rtp_timestamp_source
+                    const auto *fed = matched ? &fed_frames[sequence % FEED_RING] : nullptr;
+                    uint32_t timestamp = rtp_sink->packetizer.frame_timestamp(fed && fed->meta.has_pts, fed ? fed->meta.pts : 0,
+                                                                              config.rtp_pts_rate ? config.rtp_pts_rate : config.rtp_clock_rate, fed ? fed->fed_us : now);
+                    std::shared_ptr<rtp_batch_t> batch = rtp_sink->add((const uint8_t *)capture.start, encoded_len, timestamp, buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+                    if (batch)
+                        rtp_batches.push_back(std::move(batch));
+                }
+                bool fan_out = hub.active();
+                if (deliver_frames || file_sink || gop_cache.max_bytes || fan_out)
+                {
+                    std::shared_ptr<frame_data_t> frame_data;
+                    uint32_t generation;
+                    // a slow hub subscriber could hold a lent slot for a whole GOP, so copy while there are any
+                    bool lent = config.lend_buffers && !fan_out && captures->try_lend(buf.index, generation);
+                    if (lent)
+                    {
+                        // The slot is re-queued by frame_data_t once every consumer is done with it.
+                        frame_data = std::make_shared<frame_data_t>(encoded_len, (uint8_t *)capture.start, captures, buf.index, generation);
+                    }
+                    else
+                    {
+                        // Copy out before re-queuing: the driver may overwrite the slot before the consumer runs.
+                        frame_data = std::make_shared<frame_data_t>(encoded_len, frame_pool);
+                        memcpy(frame_data->data, capture.start, encoded_len);
+                        stats.bytes_copied.fetch_add(encoded_len, std::memory_order_relaxed);
+                    }
+                    frame_data->keyframe = buf.flags & V4L2_BUF_FLAG_KEYFRAME;
+                    frame_data->dequeued_us = now;
+                    frame_data->sequence = sequence;
+                    frame_data->encode_us = encode_us;
+                    if (matched)
+                        frame_data->meta = fed_frames[sequence % FEED_RING].meta;
+                    gop_cache.add(frame_data);
+                    if (fan_out)
+                        hub.push(frame_data);
+                    if (file_sink)
+                        file_sink->push(frame_data);
+                    if (deliver_frames)
+                        on_frame(std::move(frame_data));
+                    requeue = !lent;
+                }
+                else
+                {
+                    stats.frames_dropped.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            if (last)
+                finish_drain();
+            if (!requeue)
+                continue;
+            // 将capture buffer入列
+            if (captures->queue(buf.index) < 0)
+            {
+                error = "failed to re-queue encoded buffer";
+                return false;
+            }
+        }
+    }
+
+    // Starts a drain (V4L2_ENC_CMD_STOP): the driver encodes every frame queued so far and flags the last
+    // CAPTURE buffer, after which encoding resumes. A flush() during a drain joins it. Returns the drain's
+    // number, which flushes_completed reaches once every frame fed before it was handed on; 0 with `error` set
+    // if the driver has no drain command.
+    uint64_t flush(std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (stopped)
+        {
+            error = "The encoder is stopped";
+            return 0;
+        }
+        if (draining)
+            return flushes_requested;
+        struct v4l2_encoder_cmd cmd = {};
+        cmd.cmd = V4L2_ENC_CMD_STOP;
+        if (device->ioctl(VIDIOC_ENCODER_CMD, &cmd) < 0)
+        {
+            error = "Failed to drain the encoder: " + std::string(strerror(errno));
+            return 0;
+        }
+        draining = true;
+        return ++flushes_requested;
+    }
+
+    // The last buffer of a drain came back. Must be called with operation_mutex held.
+    void finish_drain()
+    {
+        if (!draining)
+            return;
+        draining = false;
+        struct v4l2_encoder_cmd cmd = {};
+        cmd.cmd = V4L2_ENC_CMD_START;
+        if (device->ioctl(VIDIOC_ENCODER_CMD, &cmd) < 0)
+            control_errors.push_back("Failed to resume after a flush: " + std::string(strerror(errno)));
+        flushes_completed.store(flushes_requested, std::memory_order_release);
+    }
+
+    // A copy of the settings, which the encoder thread updates as controls are applied.
+    encoder_config_t current_config()
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        return config;
+    }
+
+    // Switches a running session to the picture size, pixel format, level, input conversion, bitrate and
+    // framerate of `next` on the same device fd; its other settings are ignored. A bitrate or framerate change
+    // alone goes through the controls. Anything else stops both queues, frees the buffers and negotiates again,
+    // so frames still queued are discarded (flush() first to keep them) and the stream restarts with an IDR.
+    // Returns an error; the session then runs with the old settings, or is stopped if they failed too.
+    std::string reconfigure(const encoder_config_t &next)
+    {
+        std::string error;
+        {
+            std::lock_guard<std::mutex> lock(operation_mutex);
+            if (stopped)
+                return "The encoder is stopped";
+            bool renegotiate = next.width != config.width || next.height != config.height || next.pixel_format != config.pixel_format ||
+                               next.num_planes != config.num_planes || next.bytesperline != config.bytesperline || next.colorspace != config.colorspace ||
+                               next.level != config.level || next.input_format != config.input_format || next.input_stride != config.input_stride;
+            if (!renegotiate)
+            {
+                if (next.bitrate_bps != config.bitrate_bps)
+                    set_bitrate(next.bitrate_bps);
+                if (next.framerate && next.framerate != config.framerate)
+                    set_framerate(next.framerate);
+                size_t reported = control_errors.size();
+                apply_controls();
+                if (control_errors.size() > reported)
+                {
+                    error = control_errors[reported];
+                    control_errors.resize(reported);
+                }
+                return error;
+            }
+            // the muxer wrote the picture size into the init segment
+            if (muxer && (next.width != config.width || next.height != config.height))
+                return "reconfigure() cannot change the picture size of an fMP4 stream";
+            {
+                std::lock_guard<std::mutex> ring_lock(captures->mutex);
+                if (captures->lent_count)
+                    return "Release the lent CAPTURE buffers before reconfigure()";
+            }
+            encoder_config_t previous = config;
+            uint64_t previous_rate = pixel_rate();
+            restart_streaming([&] {
+                config.width = next.width;
+                config.height = next.height;
+                config.pixel_format = next.pixel_format;
+                config.num_planes = next.num_planes;
+                config.bytesperline = next.bytesperline;
+                config.colorspace = next.colorspace;
+                config.level = next.level;
+                config.input_format = next.input_format;
+                config.input_stride = next.input_stride;
+                config.bitrate_bps = next.bitrate_bps;
+                if (next.framerate)
+                    config.framerate = next.framerate;
+            }, error);
+            if (error.empty() || restart_streaming([&] { config = previous; }, error))
+            {
+                if (placed && pixel_rate() != previous_rate)
+                {
+                    DeviceRegistry::shared().release(device_path, previous_rate);
+                    DeviceRegistry::shared().acquire(device_path, pixel_rate());
+                }
+                if (muxer && config.framerate)
+                    muxer->sample_duration = Fmp4Muxer::TIMESCALE / config.framerate;
+                std::lock_guard<std::mutex> controls_lock(controls_mutex);
+                if (rate_controller && config.bitrate_bps != rate_controller->setting)
+                    rate_controller->target = rate_controller->setting = config.bitrate_bps;
+                return error;
+            }
+        }
+        stop();
+        return error;
+    }
+
+    // Stops both queues, frees the buffers, lets `change` edit the config and sets the device up again.
+    // Must be called with operation_mutex held. Returns false, keeping the first error in `error`, if that failed.
+    template <typename Change>
+    bool restart_streaming(Change change, std::string &error)
+    {
+        stream_off();
+        release_held();
+        // dropped with the queues; a drain in progress ends with them
+        if (draining)
+        {
+            draining = false;
+            flushes_completed.store(flushes_requested, std::memory_order_release);
+        }
+        release_buffers();
+        // lent input buffers keep their pool alive until JS lets go of them
+        input_pool.reset();
+        converter = nullptr;
+        convert_pool.reset();
+        change();
+        try
+        {
+            configure_v4l2();
+        }
+        catch (const std::runtime_error &e)
+        {
+            if (error.empty())
+                error = e.what();
+            return false;
+        }
+        stats.outputs_queued.store(0, std::memory_order_relaxed);
+        frame_available.notify_all();
+        return true;
+    }
+
+    // Copies a raw frame into a free OUTPUT slot and queues it, or queues a lent input buffer without copying.
+    // `meta` comes back with the encoded frame.
+    int feed(uint8_t *plane_data, uint32_t size, const frame_meta_t &meta = {})
+    {
+        std::unique_lock<std::mutex> lock(operation_mutex);
+        if (stopped)
+            return FEED_ERROR;
+        feed_meta = meta;
+        int input = input_pool ? input_pool->find(plane_data) : -1;
+        if (input >= 0 && input_pool->memory != input_memory_t::COPY)
+            return feed_input(input, size);
+        int status = slot_available(lock) ? (queue_copy(plane_data, size) ? FEED_QUEUED : FEED_ERROR) : congestion(plane_data, -1, size);
+        // a copied input buffer is free again, unless the frame has to be fed once more
+        if (input >= 0 && status != FEED_BUSY && status != FEED_ERROR)
+            input_pool->slots[input].acquired = false;
+        return status;
+    }
+
+    // Lends an input buffer for JS to fill and feed(). Returns its index in input_pool, or -1 if there is no pool
+    // or every buffer is taken; with OUTPUT memory lent, a "drain" follows once one is back.
+    int acquire_input()
+    {
+        std::unique_lock<std::mutex> lock(operation_mutex);
+        if (stopped || !input_pool)
+            return -1;
+        if (input_pool->memory == input_memory_t::COPY)
+        {
+            for (uint32_t i = 0; i < input_pool->slots.size(); i++)
+            {
+                if (input_pool->slots[i].acquired)
+                    continue;
+                input_pool->slots[i].acquired = true;
+                input_pool->slots[i].lease++;
+                return i;
+            }
+            return -1;
+        }
+        // The buffer is the OUTPUT slot itself, so reserve the slot until the frame is fed.
+        if (!slot_available(lock))
+        {
+            congested = !stopped;
+            return -1;
+        }
+        uint32_t index = free_outputs.back();
+        free_outputs.pop_back();
+        input_pool->slots[index].acquired = true;
+        input_pool->slots[index].lease++;
+        input_pool->begin_write(index);
+        return index;
+    }
+
+    // Takes back an input buffer JS let go of without feeding it, with the OUTPUT slot it reserved. Does nothing
+    // if it was fed, lent again since (another `lease`), or belongs to a pool reconfigure() replaced.
+    void release_input(const InputPool *pool, uint32_t index, uint32_t lease)
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (!input_pool || input_pool.get() != pool || index >= input_pool->slots.size())
+            return;
+        input_slot_t &slot = input_pool->slots[index];
+        if (!slot.acquired || slot.lease != lease)
+            return;
+        slot.acquired = false;
+        if (input_pool->memory == input_memory_t::COPY)
+            return;
+        input_pool->end_write(index);
+        free_outputs.push_back(index);
+        frame_available.notify_one();
+    }
+
+    // Queues an input buffer JS filled in place. Its OUTPUT slot was reserved by acquire_input().
+    int feed_input(uint32_t index, uint32_t size)
+    {
+        input_slot_t &slot = input_pool->slots[index];
+        // fed twice: the driver may be reading it right now
+        if (!slot.acquired)
+            return FEED_ERROR;
+        size = std::min(size, (uint32_t)slot.length);
+        if (!queue_output(index, size))
+            return FEED_ERROR;
+        slot.acquired = false;
+        fed(size);
+        return FEED_QUEUED;
+    }
+
+    // Queues a dmabuf fd into a free OUTPUT slot.
+    int feed(int _fd, uint32_t size, const frame_meta_t &meta = {})
+    {
+        std::unique_lock<std::mutex> lock(operation_mutex);
+        if (stopped)
+            return FEED_ERROR;
+        feed_meta = meta;
+        if (!slot_available(lock))
+            return congestion(nullptr, _fd, size);
+        return queue_dmabuf(_fd, size) ? FEED_QUEUED : FEED_ERROR;
+    }
+
+    // Whether a free OUTPUT slot exists, after waiting for one under the block policy.
+    bool slot_available(std::unique_lock<std::mutex> &lock)
+    {
+        if (free_outputs.empty() && config.feed_policy == feed_policy_t::BLOCK)
+            frame_available.wait_for(lock, std::chrono::milliseconds(config.feed_timeout_ms), [&] { return !free_outputs.empty() || stopped; });
+        return !free_outputs.empty() && !stopped;
+    }
+
+    // Applies the feed policy to a frame that found every OUTPUT slot with the driver.
+    int congestion(uint8_t *plane_data, int fd, uint32_t size)
+    {
+        if (stopped)
+            return FEED_ERROR;
+        congested = true;
+        switch (config.feed_policy)
+        {
+        case feed_policy_t::DROP_NEWEST:
+            stats.feed_dropped.fetch_add(1, std::memory_order_relaxed);
+            return FEED_DROPPED;
+        case feed_policy_t::DROP_OLDEST:
+            if (held.valid)
+                stats.feed_dropped.fetch_add(1, std::memory_order_relaxed);
+            hold(plane_data, fd, size);
+            return FEED_HELD;
+        default:
+            stats.feed_rejected.fetch_add(1, std::memory_order_relaxed);
+            return FEED_BUSY;
+        }
+    }
+
+    void hold(uint8_t *plane_data, int fd, uint32_t size)
+    {
+        release_held();
+        if (plane_data)
+        {
+            held.data.assign(plane_data, plane_data + size);
+            stats.bytes_copied.fetch_add(size, std::memory_order_relaxed);
+        }
+        else
+        {
+            held.fd = dup(fd);
+        }
+        held.size = size;
+        held.meta = feed_meta;
+        held.valid = plane_data || held.fd >= 0;
+    }
+
+    // Queues the frame drop-oldest held back, now that a slot is free. A held frame the driver refuses is counted
+    // as dropped; queue_copy() and queue_dmabuf() only take the slot off free_outputs once QBUF succeeded.
+    void queue_held()
+    {
+        feed_meta = held.meta;
+        bool queued = held.fd >= 0 ? queue_dmabuf(held.fd, held.size) : queue_copy(held.data.data(), held.size);
+        if (!queued)
+            stats.feed_dropped.fetch_add(1, std::memory_order_relaxed);
+        release_held();
+    }
+
+    void release_held()
+    {
+        if (held.fd >= 0)
+            ::close(held.fd);
+        held.fd = -1;
+        held.valid = false;
+    }
+
+    // Remembers where the planes of a 4:2:0 picture go in the negotiated OUTPUT format.
+    void describe_output(const struct v4l2_pix_format_mplane &pix)
+    {
+        output_sizeimage = pix.plane_fmt[0].sizeimage;
+        output_yuv420 = pix.pixelformat == V4L2_PIX_FMT_NV12 || pix.pixelformat == V4L2_PIX_FMT_YUV420;
+        if (!output_yuv420)
+            return;
+        output_nv12 = pix.pixelformat == V4L2_PIX_FMT_NV12;
+        output_stride = pix.plane_fmt[0].bytesperline ? pix.plane_fmt[0].bytesperline : config.width;
+        // the driver may pad the luma plane to more rows than the picture has
+        output_luma_rows = std::max(config.height, (uint32_t)(pix.plane_fmt[0].sizeimage * 2 / 3 / output_stride));
+    }
+
+    // The 4:2:0 picture inside an OUTPUT slot. Only valid if output_yuv420.
+    yuv420_image_t output_image(struct buffer &output) const
+    {
+        yuv420_image_t image;
+        image.nv12 = output_nv12;
+        image.y = (uint8_t *)output.start;
+        image.y_stride = output_stride;
+        image.u = image.y + output_stride * output_luma_rows;
+        image.uv_stride = output_nv12 ? output_stride : output_stride / 2;
+        image.v = output_nv12 ? nullptr : image.u + image.uv_stride * output_luma_rows / 2;
+        return image;
+    }
+
+    // Bytes a 4:2:0 picture takes in an OUTPUT slot.
+    uint32_t output_image_size() const
+    {
+        return output_stride * output_luma_rows * 3 / 2;
+    }
+
+    // Checks that the OUTPUT format can take converted frames and picks the kernel.
+    void prepare_conversion()
+    {
+        if (!parse_pixel_layout(config.input_format, convert_layout))
+            throw std::runtime_error("Unknown inputFormat: " + config.input_format);
+        if (config.feed_type != 2)
+            throw std::runtime_error("inputFormat needs BUFFER input");
+        if (!output_yuv420)
+            throw std::runtime_error("inputFormat needs pixel_format NV12 or YUV420");
+        if (config.width % 2 || config.height % 2)
+            throw std::runtime_error("inputFormat needs an even width and height");
+        converter = select_converter(convert_layout);
+        uint32_t threads = config.convert_threads;
+        if (!threads)
+            threads = config.width * config.height >= 1280 * 720 ? std::min(4u, std::thread::hardware_concurrency()) : 1;
+        convert_pool = std::make_unique<RowPool>(std::max(threads, 1u));
+    }
+
+    // Converts a raw frame straight into an OUTPUT slot. Returns the bytes written, 0 if `size` is short of a whole picture.
+    uint32_t convert_into(struct buffer &output, uint8_t *plane_data, uint32_t size)
+    {
+        uint32_t src_stride = config.input_stride ? config.input_stride : config.width * bytes_per_pixel(convert_layout);
+        uint32_t written = output_image_size();
+        if ((uint64_t)src_stride * (config.height - 1) + config.width * bytes_per_pixel(convert_layout) > size || written > (uint32_t)output.length)
+            return 0;
+        yuv420_image_t dst = output_image(output);
+        convert_pool->run(config.height / 2, [&](uint32_t begin, uint32_t end) { convert_rows(converter, plane_data, src_stride, config.width, dst, begin, end); });
+        return written;
+    }
+
+    // Lets `fill(slot)` write a frame straight into a free OUTPUT slot and queues it. `fill` returns the bytes
+    // written, 0 to give up. The feed policy applies as for feed(), except that drop-oldest drops the new frame,
+    // as there is no raw frame to hold.
+    template <typename Fill>
+    int feed_into(Fill fill, const frame_meta_t &meta = {})
+    {
+        std::unique_lock<std::mutex> lock(operation_mutex);
+        if (stopped || config.feed_type != 2)
+            return FEED_ERROR;
+        feed_meta = meta;
+        if (!slot_available(lock))
+        {
+            if (config.feed_policy != feed_policy_t::DROP_OLDEST || stopped)
+                return congestion(nullptr, -1, 0);
+            congested = true;
+            stats.feed_dropped.fetch_add(1, std::memory_order_relaxed);
+            return FEED_DROPPED;
+        }
+        uint32_t index = free_outputs.back();
+        if (input_pool)
+            input_pool->begin_write(index);
+        uint32_t size = fill(outputs[index]);
+        if (size == 0)
+        {
+            if (input_pool)
+                input_pool->end_write(index);
+            return FEED_ERROR;
+        }
+        stats.bytes_copied.fetch_add(size, std::memory_order_relaxed);
+        if (!queue_output(index, size))
+            return FEED_ERROR;
+        free_outputs.pop_back();
+        fed(size);
+        return FEED_QUEUED;
+    }
+
+    // Copies (or converts) into the last free OUTPUT slot and queues it. Must be called with operation_mutex held and a slot free.
+    bool queue_copy(uint8_t *plane_data, uint32_t size)
+    {
+        uint32_t index = free_outputs.back();
+        struct buffer &output = outputs[index];
+        if (input_pool)
+            input_pool->begin_write(index);
+        if (converter)
+        {
+            size = convert_into(output, plane_data, size);
+            if (size == 0)
+            {
+                if (input_pool)
+                    input_pool->end_write(index);
+                return false;
+            }
+        }
+        else
+        {
+            size = std::min(size, (uint32_t)output.length);
+            memcpy(output.start, plane_data, size);
+        }
+        stats.bytes_copied.fetch_add(size, std::memory_order_relaxed);
+        if (!queue_output(index, size))
+            return false;
+        free_outputs.pop_back();
+        fed(size);
+        return true;
+    }
+
+    // Hands OUTPUT slot `index`, holding `size` bytes, to the driver, closing the CPU write bracket of an input
+    // buffer either way. Must be called with operation_mutex held.
+    bool queue_output(uint32_t index, uint32_t size)
+    {
+        struct buffer &output = outputs[index];
+        if (input_pool)
+            input_pool->end_write(index);
+        output.plane.bytesused = size;
+        output.inner.m.planes = &output.plane;
+        stamp(output.inner);
+        return device->ioctl(VIDIOC_QBUF, &output.inner) == 0;
+    }
+
+    // Queues a dmabuf into the last free OUTPUT slot. Must be called with operation_mutex held and a slot free.
+    bool queue_dmabuf(int _fd, uint32_t size)
+    {
+        v4l2_buffer buf = {};
+        v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        buf.index = free_outputs.back();
+        buf.field = V4L2_FIELD_NONE;
+        buf.memory = V4L2_MEMORY_DMABUF;
+        buf.length = 1;
+        buf.m.planes = planes;
+        buf.m.planes[0].m.fd = _fd;
+        buf.m.planes[0].bytesused = size;
+        buf.m.planes[0].length = size;
+        stamp(buf);
+        if (device->ioctl(VIDIOC_QBUF, &buf) < 0)
+            return false;
+        free_outputs.pop_back();
+        fed(size);
+        return true;
+    }
+
+    // Raised once when a slot frees up after a feed found none; cleared once taken.
+    bool take_drain()
+    {
+        return drained.load(std::memory_order_acquire) && drained.exchange(false);
+    }
+
+    // The file writer's first error, if it has one that was not reported yet.
+    bool take_file_error(std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        return (file_sink && file_sink->take_error(message)) || (mp4_sink && mp4_sink->take_error(message));
+    }
+
+    int set_control(uint32_t code, uint32_t id, int32_t value)
+    {
+        // stop() may hand the device to a pooled session once it judged the controls clean
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        if (stopped)
+            return -1;
+        controls_dirty = controls_dirty || code == VIDIOC_S_CTRL;
+        v4l2_control ctrl = {};
+        ctrl.id = id;
+        ctrl.value = value;
+        return device->ioctl(code, &ctrl);
+    }
+
+    void stop()
+    {
+        end(nullptr);
+    }
+
+    // Ends the stream like stop(), but `next` takes over the device, still configured, and streams again with
+    // nothing queued. Returns false without stopping if the device cannot be reused as it is: CAPTURE or input
+    // buffers are lent out, or controls were changed that begin() would not set again.
+    bool hand_over(EncoderSession &next)
+    {
+        return end(&next);
+    }
+
+    bool end(EncoderSession *next)
+    {
+        {
+            std::lock_guard<std::mutex> lock(operation_mutex);
+            if (!end_locked(next))
+                return false;
+        }
+        // native hub sinks may take a while to flush to a slow reader; nothing else waits on operation_mutex for that
+        hub.close();
+        return true;
+    }
+
+    // Must be called with operation_mutex held.
+    bool end_locked(EncoderSession *next)
+    {
+        if (stopped || (next && !reusable()))
+            return false;
+        stopped = true;
+        release_held();
+        frame_available.notify_all();
+
+        // the encoder thread may be blocked in poll(); it sees `stopped` as soon as it wakes
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0)
+            std::cerr << "failed to wake the encoder thread: " << strerror(errno) << std::endl;
+
+        if (device)
+            stream_off();
+        if (next)
+            move_device(*next);
+        else
+            release_device();
+
+        if (muxer)
+        {
+            size_t from = fragments.size();
+            muxer->flush(fragments);
+            dispatch_fragments(from);
+        }
+        // flushes what the writer has not written yet
+        file_sink.reset();
+        mp4_sink.reset();
+        rtp_sink.reset();
+        return true;
+    }
+
+    // Must be called with operation_mutex held.
+    bool reusable()
+    {
+        if (!device || controls_dirty || input_pool)
+            return false;
+        std::lock_guard<std::mutex> lock(captures->mutex);
+        return captures->lent_count == 0;
+    }
+
+    // Gives the device, its buffers and the negotiated layout to `next` and restarts streaming there; if that
+    // fails, `next` is left stopped. Must be called with operation_mutex held, after STREAMOFF.
+    void move_device(EncoderSession &next)
+    {
+        next.config = config;
+        next.device = device;
+        next.device_path = device_path;
+        next.placed = placed;
+        next.captures = std::move(captures);
+        next.outputs = std::move(outputs);
+        next.output_memory = output_memory;
+        next.output_sizeimage = output_sizeimage;
+        next.output_yuv420 = output_yuv420;
+        next.output_nv12 = output_nv12;
+        next.output_stride = output_stride;
+        next.output_luma_rows = output_luma_rows;
+        next.converter = converter;
+        next.convert_pool = std::move(convert_pool);
+        next.convert_layout = convert_layout;
+        handed_over = true;
+        placed = false;
+        captures = std::make_shared<capture_ring_t>();
+        captures->device = device;
+        outputs.clear();
+        free_outputs.clear();
+        std::string error = next.restart_queues();
+        if (!error.empty())
+        {
+            std::cerr << "failed to hand the encoder over: " << error << std::endl;
+            next.stop();
+        }
+    }
+
+    // Streams again after a STREAMOFF with every OUTPUT slot free and every CAPTURE slot queued. Returns an error.
+    std::string restart_queues()
+    {
+        std::lock_guard<std::mutex> lock(operation_mutex);
+        free_outputs.clear();
+        for (uint32_t i = 0; i < outputs.size(); i++)
+            free_outputs.push_back(outputs.size() - 1 - i);
+        {
+            std::lock_guard<std::mutex> ring_lock(captures->mutex);
+            for (uint32_t i = 0; i < captures->slots.size(); i++)
+            {
+                if (captures->queue(i) < 0)
+                    return "Failed to queue capture buffer: " + std::string(strerror(errno));
+            }
+            captures->streaming = true;
+        }
+        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        if (device->ioctl(VIDIOC_STREAMON, &type) < 0)
+            return "Failed to start output stream: " + std::string(strerror(errno));
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        if (device->ioctl(VIDIOC_STREAMON, &type) < 0)
+            return "Failed to start capture stream: " + std::string(strerror(errno));
+        return "";
+    }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __ENCODER_STATS_H__
+#define __ENCODER_STATS_H__
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// Latency histogram with power-of-two microsecond buckets: bucket i counts samples in [2^i, 2^(i+1)) us,
+// bucket 0 also takes 0. Written from one thread and read from another without locks.
+struct latency_histogram_t
+{
+    static constexpr int BUCKETS = 32;
+    std::atomic<uint64_t> buckets[BUCKETS] = {};
+    std::atomic<uint64_t> count = 0;
+    std::atomic<uint64_t> sum_us = 0;
+    std::atomic<uint64_t> max_us = 0;
+
+    static int bucket_of(uint64_t us)
+    {
+        int bucket = us ? 63 - __builtin_clzll(us) : 0;
+        return bucket < BUCKETS ? bucket : BUCKETS - 1;
+    }
+
+    void record(uint64_t us)
+    {
+        buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = max_us.load(std::memory_order_relaxed);
+        while (us > max && !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed))
+            ;
+    }
+
+    // Upper bound of the bucket holding the p-th quantile, so the estimate is never optimistic.
+    uint64_t percentile(double p) const
+    {
+        uint64_t total = 0;
+        uint64_t seen[BUCKETS];
+        for (int i = 0; i < BUCKETS; i++)
+            total += seen[i] = buckets[i].load(std::memory_order_relaxed);
+        if (total == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(p * total);
+        uint64_t cumulative = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            cumulative += seen[i];
+            if (cumulative > rank)
+                return std::min<uint64_t>((2ull << i) - 1, max_us.load(std::memory_order_relaxed));
+        }
+        return max_us.load(std::memory_order_relaxed);
+    }
+};
+
+// Counters of one encoder session. Every field is a relaxed atomic: the worker thread and feed() update
+// them on the hot path, stats() reads them from the JS thread at any time.
+struct encoder_stats_t
+{
+    std::atomic<uint64_t> frames_fed = 0;
+    // feed() calls refused because every OUTPUT buffer was owned by the driver
+    std::atomic<uint64_t> feed_rejected = 0;
+    // raw frames discarded by the drop-newest / drop-oldest feed policies
+    std::atomic<uint64_t> feed_dropped = 0;
+    std::atomic<uint64_t> frames_encoded = 0;
+    std::atomic<uint64_t> frames_delivered = 0;
+    // encoded frames nobody consumed (no callback) and CAPTURE buffers the driver returned empty
+    std::atomic<uint64_t> frames_dropped = 0;
+    // encoded frames discarded by the overflow policy of a full output queue
+    std::atomic<uint64_t> queue_dropped = 0;
+    std::atomic<uint64_t> bytes_in = 0;
+    std::atomic<uint64_t> bytes_out = 0;
+    // raw frames copied (or converted) into OUTPUT buffers plus encoded frames copied out of CAPTURE buffers
+    std::atomic<uint64_t> bytes_copied = 0;
+    std::atomic<uint64_t> poll_wakeups = 0;
+    // wakeups that dequeued at least one buffer
+    std::atomic<uint64_t> useful_wakeups = 0;
+    std::atomic<uint32_t> outputs_queued = 0;
+    std::atomic<uint32_t> pending_frames = 0;
+    std::atomic<uint64_t> last_feed_us = 0;
+    std::atomic<uint64_t> last_frame_us = 0;
+    // feed() to CAPTURE dequeue, matched through the buffer timestamp
+    latency_histogram_t encode_latency;
+    // CAPTURE dequeue to the JS callback
+    latency_histogram_t delivery_latency;
+};
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef __FILE_SINK_H__
+#define __FILE_SINK_H__
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "fmp4_muxer.hpp"
+#include "util.hpp"
+
+enum class file_sync_t
+{
+    // leave it to the kernel
+    NONE,
+    // fdatasync after every batch that contains a keyframe, so a crash loses at most one GOP
+    KEYFRAME,
+    // fdatasync at most every `sync_interval_ms`
+    INTERVAL,
+};
+
+// writev() until every byte is on its way, resuming after partial writes and EINTR. `iov` is consumed.
+// On a non-blocking fd that is full, `wait()` is called before retrying and the write gives up (with errno
+// EAGAIN) when it returns false. Returns false with errno set on failure.
+template <typename Wait>
+inline bool writev_all(int fd, std::vector<struct iovec> &iov, Wait wait)
+{
+    struct iovec *next = iov.data();
+    int left = iov.size();
+    while (left > 0)
+    {
+        ssize_t written = writev(fd, next, std::min(left, IOV_MAX));
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait())
+                continue;
+            return false;
+        }
+        while (left > 0 && (size_t)written >= next->iov_len)
+        {
+            written -= next->iov_len;
+            next++;
+            left--;
+        }
+        if (left > 0)
+        {
+            next->iov_base = (uint8_t *)next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+inline bool writev_all(int fd, std::vector<struct iovec> &iov)
+{
+    return writev_all(fd, iov, [] { return false; });
+}
+
+// Writes encoded frames to a file from its own thread, so a slow disk never stalls the encoder loop.
+// Frames are handed over through a bounded ring and written in batches with writev().
+// `Frame` needs `data` and `size` members and a `keyframe` flag. With `roll` set, a Frame with a `segment` member
+// is written to segment_path(path, segment), so each segment becomes a file of its own; other Frames ignore `roll`.
+template <typename Frame>
+class FileSink
+{
+  public:
+    file_sync_t sync = file_sync_t::NONE;
+    uint32_t sync_interval_ms = 1000;
+    // wait for room instead of dropping when the ring is full; this hands disk stalls back to the encoder
+    bool block = false;
+    bool roll = false;
+    // only frames that know their segment can be split into files
+    static constexpr bool SEGMENTED = requires(Frame &f) { f.segment; };
+
+    std::atomic<uint64_t> frames_written = 0;
+    std::atomic<uint64_t> bytes_written = 0;
+    std::atomic<uint64_t> frames_dropped = 0;
+
+    ~FileSink()
+    {
+        close();
+    }
+
+    // Opens (truncates) `path` and starts the writer thread. Returns false and sets `error` on failure.
+    bool open(const std::string &_path, uint32_t capacity, std::string &error)
+    {
+        path = _path;
+        fd = ::open((roll && SEGMENTED ? segment_path(path, 0) : path).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            error = "Failed to open output file: " + std::string(strerror(errno));
+            return false;
+        }
+        ring.resize(std::max(capacity, 1u));
+        writer = std::thread(&FileSink::run, this);
+        return true;
+    }
+
+    // Queues a frame for writing. Never blocks unless `block` is set; returns false if the frame was dropped.
+    bool push(std::shared_ptr<Frame> frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (count == ring.size())
+        {
+            if (!block || failed)
+            {
+                frames_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            space_available.wait(lock, [&] { return count < ring.size() || closing || failed; });
+            if (closing || failed)
+                return false;
+        }
+        ring[(head + count) % ring.size()] = std::move(frame);
+        count++;
+        frame_available.notify_one();
+        return true;
+    }
+
+    // The first write error, if any; cleared once taken. Writing stops after an error.
+    bool take_error(std::string &message)
+    {
+        if (!error_pending.load(std::memory_order_acquire))
+            return false;
+        std::lock_guard<std::mutex> lock(mutex);
+        message = error;
+        error_pending.store(false, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Writes whatever is still queued, syncs according to the policy and closes the file.
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        frame_available.notify_all();
+        space_available.notify_all();
+        if (writer.joinable())
+            writer.join();
+        if (fd >= 0)
+        {
+            if (sync != file_sync_t::NONE && !failed)
+                fdatasync(fd);
+            ::close(fd);
+        }
+        fd = -1;
+    }
+
+  private:
+    int fd = -1;
+    std::string path;
+    uint32_t segment = 0;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable frame_available;
+    std::condition_variable space_available;
+    std::vector<std::shared_ptr<Frame>> ring;
+    size_t head = 0;
+    size_t count = 0;
+    bool closing = false;
+    bool failed = false;
+    std::string error;
+    std::atomic<bool> error_pending = false;
+
+    void run()
+    {
+        std::vector<std::shared_ptr<Frame>> batch;
+        std::vector<struct iovec> iov;
+        uint64_t last_sync = monotonic_us();
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frame_available.wait(lock, [&] { return count > 0 || closing; });
+                if (count == 0)
+                    return;
+                // take everything that is queued, up to what one writev accepts
+                while (count > 0 && batch.size() < IOV_MAX)
+                {
+                    batch.push_back(std::move(ring[head]));
+                    head = (head + 1) % ring.size();
+                    count--;
+                }
+            }
+            space_available.notify_all();
+
+            // one writev per run of frames that go to the same file
+            for (size_t begin = 0, end; begin < batch.size(); begin = end)
+            {
+                end = begin + 1;
+                if constexpr (SEGMENTED)
+                {
+                    while (end < batch.size() && batch[end]->segment == batch[begin]->segment)
+                        end++;
+                    if (roll && batch[begin]->segment != segment && !failed)
+                        rotate(batch[begin]->segment);
+                }
+                else
+                {
+                    end = batch.size();
+                }
+                write_run(batch.data() + begin, end - begin, iov, last_sync);
+            }
+            // releasing the frames here frees the copies, or re-queues lent CAPTURE buffers
+            batch.clear();
+        }
+    }
+
+    void write_run(std::shared_ptr<Frame> *frames, size_t n, std::vector<struct iovec> &iov, uint64_t &last_sync)
+    {
+        bool keyframe = false;
+        size_t total = 0;
+        iov.clear();
+        for (size_t i = 0; i < n; i++)
+        {
+            iov.push_back({frames[i]->data, frames[i]->size});
+            total += frames[i]->size;
+            keyframe = keyframe || frames[i]->keyframe;
+        }
+        if (failed || !write_all(iov))
+        {
+            frames_dropped.fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+        frames_written.fetch_add(n, std::memory_order_relaxed);
+        bytes_written.fetch_add(total, std::memory_order_relaxed);
+        uint64_t now = monotonic_us();
+        bool due = sync == file_sync_t::KEYFRAME ? keyframe : sync == file_sync_t::INTERVAL && now - last_sync >= sync_interval_ms * 1000ull;
+        if (due)
+        {
+            if (fdatasync(fd) < 0)
+                fail("fdatasync failed: " + std::string(strerror(errno)));
+            last_sync = now;
+        }
+    }
+
+    // Closes the current segment file and starts the next one.
+    void rotate(uint32_t next)
+    {
+        if (sync != file_sync_t::NONE)
+            fdatasync(fd);
+        ::close(fd);
+        segment = next;
+        std::string name = segment_path(path, segment);
+        fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            fail("Failed to open " + name + ": " + std::string(strerror(errno)));
+    }
+
+    bool write_all(std::vector<struct iovec> &iov)
+    {
+        if (writev_all(fd, iov))
+            return true;
+        fail("write to output file failed: " + std::string(strerror(errno)));
+        return false;
+    }
+
+    void fail(const std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed)
+            return;
+        failed = true;
+        error = message;
+        error_pending.store(true, std::memory_order_release);
+        space_available.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,408 @@
+#ifndef __FMP4_MUXER_H__
+#define __FMP4_MUXER_H__
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nalu.hpp"
+
+// One piece of fragmented MP4 output: an init segment (ftyp + moov) or a media fragment (moof + mdat).
+// Concatenating everything of one `segment` in order gives a playable file.
+struct mp4_fragment_t
+{
+    std::vector<uint8_t> bytes;
+    uint8_t *data = nullptr;
+    uint32_t size = 0;
+    bool init = false;
+    // media fragments always start with a keyframe
+    bool keyframe = true;
+    uint32_t segment = 0;
+    // moof sequence number, 0 for init segments
+    uint32_t sequence = 0;
+    // in 90 kHz units
+    uint64_t decode_time = 0;
+    uint64_t duration = 0;
+};
+
+// Appends big-endian ISO BMFF fields to a byte vector; begin()/end() patch the box size afterwards.
+struct box_writer
+{
+    std::vector<uint8_t> &out;
+
+    void u8(uint8_t v)
+    {
+        out.push_back(v);
+    }
+    void u16(uint16_t v)
+    {
+        u8(v >> 8);
+        u8(v);
+    }
+    void u32(uint32_t v)
+    {
+        u16(v >> 16);
+        u16(v);
+    }
+    void u64(uint64_t v)
+    {
+        u32(v >> 32);
+        u32(v);
+    }
+    void zeros(size_t n)
+    {
+        out.insert(out.end(), n, 0);
+    }
+    void bytes(const uint8_t *data, size_t n)
+    {
+        out.insert(out.end(), data, data + n);
+    }
+    size_t begin(const char *type)
+    {
+        size_t at = out.size();
+        u32(0);
+        bytes((const uint8_t *)type, 4);
+        return at;
+    }
+    // full box: version and flags follow the type
+    size_t begin(const char *type, uint8_t version, uint32_t flags)
+    {
+        size_t at = begin(type);
+        u32((uint32_t)version << 24 | flags);
+        return at;
+    }
+    void end(size_t at)
+    {
+        uint32_t size = out.size() - at;
+        out[at] = size >> 24;
+        out[at + 1] = size >> 16;
+        out[at + 2] = size >> 8;
+        out[at + 3] = size;
+    }
+};
+
+// Turns the encoder's Annex B access units into fragmented MP4 with one video track: an init segment built
+// from the SPS/PPS in the stream, then one moof/mdat fragment per GOP, cut at every keyframe.
+class Fmp4Muxer
+{
+  public:
+    static constexpr uint32_t TIMESCALE = 90000;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t sample_duration = TIMESCALE / 30;
+    // start a new segment (with its own init segment) at the first keyframe after this many 90 kHz ticks, 0 never
+    uint64_t segment_duration = 0;
+
+    Fmp4Muxer(uint32_t width, uint32_t height, uint32_t framerate, uint64_t segment_duration_ms)
+        : width(width), height(height), sample_duration(TIMESCALE / (framerate ? framerate : 30)), segment_duration(segment_duration_ms * (TIMESCALE / 1000))
+    {
+    }
+
+    // Adds one access unit. Completed fragments (and init segments) are appended to `out`.
+    void add(const uint8_t *au, size_t size, bool keyframe, std::vector<std::shared_ptr<mp4_fragment_t>> &out)
+    {
+        size_t count = split_nalus(au, size, nalus.data(), nalus.size());
+        if (count > nalus.size())
+        {
+            nalus.resize(count);
+            split_nalus(au, size, nalus.data(), nalus.size());
+        }
+        bool parameters_changed = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            const nalu_t &nalu = nalus[i];
+            const uint8_t *payload = au + nalu.offset + nalu.start_code;
+            size_t length = nalu.size - nalu.start_code;
+            if (nalu.type == 7 || nalu.type == 8)
+            {
+                std::vector<uint8_t> &set = nalu.type == 7 ? sps : pps;
+                if (set.size() != length || memcmp(set.data(), payload, length) != 0)
+                {
+                    set.assign(payload, payload + length);
+                    parameters_changed = true;
+                }
+            }
+            keyframe = keyframe || nalu.type == 5;
+        }
+        if (keyframe)
+        {
+            flush(out);
+            bool roll = segment_duration && segment_started && decode_time - segment_start >= segment_duration;
+            if (roll)
+                segment++;
+            if ((parameters_changed || roll || !init_sent) && !sps.empty() && !pps.empty())
+            {
+                out.push_back(init_segment());
+                init_sent = true;
+                segment_started = true;
+                segment_start = decode_time;
+            }
+        }
+        // nothing can be decoded before the first init segment and keyframe
+        if (!init_sent || (samples.empty() && !keyframe))
+            return;
+
+        // AVCC samples: every NAL unit gets a 4-byte length instead of its start code; parameter sets and AUDs
+        // live in the init segment, not in the samples.
+        size_t begin = mdat.size();
+        for (size_t i = 0; i < count; i++)
+        {
+            const nalu_t &nalu = nalus[i];
+            if (nalu.type == 7 || nalu.type == 8 || nalu.type == 9)
+                continue;
+            uint32_t length = nalu.size - nalu.start_code;
+            box_writer{mdat}.u32(length);
+            mdat.insert(mdat.end(), au + nalu.offset + nalu.start_code, au + nalu.offset + nalu.size);
+        }
+        samples.push_back({(uint32_t)(mdat.size() - begin), keyframe});
+    }
+
+    // Emits the fragment being built, if any. Called at every keyframe and at the end of the stream.
+    void flush(std::vector<std::shared_ptr<mp4_fragment_t>> &out)
+    {
+        if (samples.empty())
+            return;
+        auto fragment = std::make_shared<mp4_fragment_t>();
+        std::vector<uint8_t> &buf = fragment->bytes;
+        buf.reserve(mdat.size() + 128 + samples.size() * 12);
+        box_writer w{buf};
+        size_t moof = w.begin("moof");
+        size_t mfhd = w.begin("mfhd", 0, 0);
+        w.u32(++sequence);
+        w.end(mfhd);
+        size_t traf = w.begin("traf");
+        // default-base-is-moof: data offsets are relative to the start of this moof
+        size_t tfhd = w.begin("tfhd", 0, 0x020000);
+        w.u32(1);
+        w.end(tfhd);
+        size_t tfdt = w.begin("tfdt", 1, 0);
+        w.u64(decode_time);
+        w.end(tfdt);
+        // data-offset, sample-duration, sample-size and sample-flags present
+        size_t trun = w.begin("trun", 0, 0x000001 | 0x000100 | 0x000200 | 0x000400);
+        w.u32(samples.size());
+        size_t data_offset = buf.size();
+        w.u32(0);
+        for (const sample_t &sample : samples)
+        {
+            w.u32(sample_duration);
+            w.u32(sample.size);
+            // sync samples depend on nothing; others depend on earlier samples and are not sync samples
+            w.u32(sample.keyframe ? 0x02000000 : 0x01010000);
+        }
+        w.end(trun);
+        w.end(traf);
+        w.end(moof);
+        uint32_t offset = buf.size() - moof + 8;
+        buf[data_offset] = offset >> 24;
+        buf[data_offset + 1] = offset >> 16;
+        buf[data_offset + 2] = offset >> 8;
+        buf[data_offset + 3] = offset;
+        w.u32(mdat.size() + 8);
+        w.bytes((const uint8_t *)"mdat", 4);
+        w.bytes(mdat.data(), mdat.size());
+
+        fragment->segment = segment;
+        fragment->sequence = sequence;
+        fragment->decode_time = decode_time;
+        fragment->duration = (uint64_t)samples.size() * sample_duration;
+        finish(*fragment);
+        out.push_back(fragment);
+
+        decode_time += fragment->duration;
+        samples.clear();
+        mdat.clear();
+    }
+
+  private:
+    struct sample_t
+    {
+        uint32_t size;
+        bool keyframe;
+    };
+
+    std::vector<nalu_t> nalus = std::vector<nalu_t>(16);
+    std::vector<uint8_t> sps;
+    std::vector<uint8_t> pps;
+    std::vector<sample_t> samples;
+    std::vector<uint8_t> mdat;
+    bool init_sent = false;
+    bool segment_started = false;
+    uint32_t segment = 0;
+    uint32_t sequence = 0;
+    uint64_t decode_time = 0;
+    uint64_t segment_start = 0;
+
+    static void finish(mp4_fragment_t &fragment)
+    {
+        fragment.data = fragment.bytes.data();
+        fragment.size = fragment.bytes.size();
+    }
+
+    std::shared_ptr<mp4_fragment_t> init_segment()
+    {
+        auto fragment = std::make_shared<mp4_fragment_t>();
+        fragment->init = true;
+        fragment->segment = segment;
+        fragment->decode_time = decode_time;
+        box_writer w{fragment->bytes};
+
+        size_t ftyp = w.begin("ftyp");
+        w.bytes((const uint8_t *)"iso5", 4);
+        w.u32(512);
+        w.bytes((const uint8_t *)"iso5iso6avc1mp41", 16);
+        w.end(ftyp);
+
+        size_t moov = w.begin("moov");
+        size_t mvhd = w.begin("mvhd", 0, 0);
+        w.u32(0); // creation time
+        w.u32(0); // modification time
+        w.u32(1000);
+        w.u32(0); // duration: unknown, it is in the fragments
+        w.u32(0x00010000); // rate 1.0
+        w.u16(0x0100);     // volume 1.0
+        w.zeros(10);
+        matrix(w);
+        w.zeros(24);
+        w.u32(2); // next track id
+        w.end(mvhd);
+
+        size_t trak = w.begin("trak");
+        size_t tkhd = w.begin("tkhd", 0, 0x000003); // enabled, in movie
+        w.u32(0);
+        w.u32(0);
+        w.u32(1); // track id
+        w.u32(0);
+        w.u32(0); // duration
+        w.zeros(8);
+        w.u16(0); // layer
+        w.u16(0); // alternate group
+        w.u16(0); // volume
+        w.u16(0);
+        matrix(w);
+        w.u32(width << 16);
+        w.u32(height << 16);
+        w.end(tkhd);
+
+        size_t mdia = w.begin("mdia");
+        size_t mdhd = w.begin("mdhd", 0, 0);
+        w.u32(0);
+        w.u32(0);
+        w.u32(TIMESCALE);
+        w.u32(0);
+        w.u16(0x55c4); // "und"
+        w.u16(0);
+        w.end(mdhd);
+        size_t hdlr = w.begin("hdlr", 0, 0);
+        w.u32(0);
+        w.bytes((const uint8_t *)"vide", 4);
+        w.zeros(12);
+        w.bytes((const uint8_t *)"VideoHandler", 13);
+        w.end(hdlr);
+
+        size_t minf = w.begin("minf");
+        size_t vmhd = w.begin("vmhd", 0, 1);
+        w.zeros(8);
+        w.end(vmhd);
+        size_t dinf = w.begin("dinf");
+        size_t dref = w.begin("dref", 0, 0);
+        w.u32(1);
+        size_t url = w.begin("url ", 0, 1); // media is in this file
+        w.end(url);
+        w.end(dref);
+        w.end(dinf);
+
+        size_t stbl = w.begin("stbl");
+        size_t stsd = w.begin("stsd", 0, 0);
+        w.u32(1);
+        size_t avc1 = w.begin("avc1");
+        w.zeros(6);
+        w.u16(1); // data reference index
+        w.zeros(16);
+        w.u16(width);
+        w.u16(height);
+        w.u32(0x00480000); // 72 dpi
+        w.u32(0x00480000);
+        w.u32(0);
+        w.u16(1); // frame count
+        w.zeros(32); // compressor name
+        w.u16(0x0018);
+        w.u16(0xffff);
+        size_t avcc = w.begin("avcC");
+        w.u8(1);
+        w.u8(sps.size() > 1 ? sps[1] : 0); // profile
+        w.u8(sps.size() > 2 ? sps[2] : 0); // constraint flags
+        w.u8(sps.size() > 3 ? sps[3] : 0); // level
+        w.u8(0xff);                        // 4-byte NAL lengths
+        w.u8(0xe1);                        // one SPS
+        w.u16(sps.size());
+        w.bytes(sps.data(), sps.size());
+        w.u8(1);
+        w.u16(pps.size());
+        w.bytes(pps.data(), pps.size());
+        uint8_t profile = sps.size() > 1 ? sps[1] : 0;
+        if (profile == 100 || profile == 110 || profile == 122 || profile == 144)
+        {
+            // High profiles carry the chroma format and bit depths; the encoder only produces 8-bit 4:2:0
+            w.u8(0xfc | 1);
+            w.u8(0xf8);
+            w.u8(0xf8);
+            w.u8(0);
+        }
+        w.end(avcc);
+        w.end(avc1);
+        w.end(stsd);
+        // the sample tables are empty; every sample is described by the fragments
+        for (const char *type : {"stts", "stsc", "stco"})
+        {
+            size_t box = w.begin(type, 0, 0);
+            w.u32(0);
+            w.end(box);
+        }
+        size_t stsz = w.begin("stsz", 0, 0);
+        w.u32(0);
+        w.u32(0);
+        w.end(stsz);
+        w.end(stbl);
+        w.end(minf);
+        w.end(mdia);
+        w.end(trak);
+
+        size_t mvex = w.begin("mvex");
+        size_t trex = w.begin("trex", 0, 0);
+        w.u32(1); // track id
+        w.u32(1); // sample description index
+        w.u32(0);
+        w.u32(0);
+        w.u32(0);
+        w.end(trex);
+        w.end(mvex);
+        w.end(moov);
+
+        finish(*fragment);
+        return fragment;
+    }
+
+    static void matrix(box_writer &w)
+    {
+        for (uint32_t v : {0x00010000u, 0u, 0u, 0u, 0x00010000u, 0u, 0u, 0u, 0x40000000u})
+            w.u32(v);
+    }
+};
+
+// File name of segment `index` when recordings are rolled: "%d" in `path` is replaced by the index,
+// otherwise it is inserted before the extension ("rec.mp4" -> "rec-3.mp4").
+std::string segment_path(const std::string &path, uint32_t index)
+{
+    size_t marker = path.find("%d");
+    if (marker != std::string::npos)
+        return path.substr(0, marker) + std::to_string(index) + path.substr(marker + 2);
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        dot = path.size();
+    return path.substr(0, dot) + "-" + std::to_string(index) + path.substr(dot);
+}
+
+#endif
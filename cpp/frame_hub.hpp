@@ -0,0 +1,375 @@
+#ifndef __FRAME_HUB_H__
+#define __FRAME_HUB_H__
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "file_sink.hpp"
+
+// One consumer of a FrameHub: a JS callback, or a file descriptor written by a thread of its own.
+struct hub_subscriber_t
+{
+    uint32_t id = 0;
+    // unread frames allowed before the subscriber skips to the next keyframe
+    uint32_t max_lag = 0;
+    // sequence number of the next frame to read
+    uint64_t cursor = 0;
+    // skipping frames until the next keyframe, after joining or after falling behind
+    bool waiting_keyframe = true;
+    // got its first keyframe; frames skipped before that are not counted as dropped
+    bool started = false;
+    // JS only: frames stay unread (up to max_lag) until resumed
+    bool paused = false;
+    // native sinks only
+    int fd = -1;
+    bool owns_fd = false;
+    std::thread writer;
+    // the writer stopped on an error; the subscriber no longer holds frames
+    bool failed = false;
+    std::string error;
+    bool removed = false;
+
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t bytes = 0;
+};
+
+// Fans the encoded frames of one session out to any number of subscribers. There is one ring of shared frames
+// and a read cursor per subscriber, so a frame is held once however many consumers read it. A subscriber that
+// falls more than its lag limit behind drops what it has not read and resumes at a keyframe (the newest one in
+// the ring if that is within the limit, else the next), without holding back the others. `Frame` is frame_data_t, or anything with `data`, `size` and `keyframe`.
+template <typename Frame>
+class FrameHub
+{
+  public:
+    // a native sink whose reader takes nothing for this long fails, so no one waits on it for ever
+    uint32_t stall_timeout_ms = 2000;
+
+    ~FrameHub()
+    {
+        close();
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : subscribers)
+            if (subscriber->owns_fd)
+                ::close(subscriber->fd);
+    }
+
+    // Sets what the encoder thread calls when a JS subscriber has frames to read. Returns false if another handler
+    // is set already. Once cleared, the old handler is not running and will not be called again.
+    bool set_ready_handler(std::function<void()> handler)
+    {
+        std::lock_guard<std::mutex> lock(handler_mutex);
+        if (handler && on_ready)
+            return false;
+        on_ready = std::move(handler);
+        return true;
+    }
+
+    // Frames kept at most, which bounds every lag limit. Applies to subscribers added afterwards.
+    void set_capacity(uint32_t frames)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = std::max(frames, 1u);
+    }
+
+    uint32_t get_capacity()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return capacity;
+    }
+
+    // Whether anyone subscribed; frames are worth pushing only then.
+    bool active() const
+    {
+        return subscriber_count.load(std::memory_order_relaxed) > 0;
+    }
+
+    // Adds a subscriber that starts at the next keyframe. With `fd` set, a writer thread writes its frames there
+    // as an Annex B stream (closing the fd on unsubscribe if it `owns_fd`); the fd is made non-blocking so the
+    // writer can give up on a reader that stalls. Returns the subscriber's id.
+    uint32_t subscribe(uint32_t max_lag, int fd = -1, bool owns_fd = false)
+    {
+        auto subscriber = std::make_shared<hub_subscriber_t>();
+        std::lock_guard<std::mutex> lock(mutex);
+        subscriber->id = next_id++;
+        subscriber->max_lag = std::clamp(max_lag, 1u, capacity);
+        subscriber->cursor = next_sequence;
+        subscriber->fd = fd;
+        subscriber->owns_fd = owns_fd;
+        if (fd >= 0)
+        {
+            int flags = fcntl(fd, F_GETFL);
+            if (flags >= 0 && !(flags & O_NONBLOCK))
+                fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        }
+        if (fd >= 0)
+            subscriber->writer = std::thread(&FrameHub::run_sink, this, subscriber);
+        subscribers.push_back(subscriber);
+        subscriber_count.store(subscribers.size(), std::memory_order_relaxed);
+        return subscriber->id;
+    }
+
+    // Removes a subscriber; a native sink stops within one poll interval. Without `wait`, its writer is joined by
+    // close() instead of here, for callers such as GC finalizers that must not block. Returns false for an unknown id.
+    bool unsubscribe(uint32_t id, bool wait = true)
+    {
+        std::shared_ptr<hub_subscriber_t> subscriber;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find_if(subscribers.begin(), subscribers.end(), [&](const std::shared_ptr<hub_subscriber_t> &s) { return s->id == id; });
+            if (it == subscribers.end())
+                return false;
+            subscriber = *it;
+            subscriber->removed = true;
+            subscribers.erase(it);
+            subscriber_count.store(subscribers.size(), std::memory_order_relaxed);
+            trim();
+        }
+        frame_available.notify_all();
+        if (!wait)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.push_back(subscriber);
+            return true;
+        }
+        if (subscriber->writer.joinable())
+            subscriber->writer.join();
+        if (subscriber->owns_fd)
+            ::close(subscriber->fd);
+        return true;
+    }
+
+    // Called by the encoder thread for every encoded frame, in order.
+    void push(std::shared_ptr<Frame> frame)
+    {
+        bool ready = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed || subscribers.empty())
+                return;
+            uint64_t sequence = next_sequence++;
+            bool keyframe = frame->keyframe;
+            if (keyframe)
+                last_keyframe = sequence;
+            ring.push_back(std::move(frame));
+            for (std::shared_ptr<hub_subscriber_t> &subscriber : subscribers)
+            {
+                if (subscriber->failed)
+                    continue;
+                if (!subscriber->waiting_keyframe && next_sequence - subscriber->cursor > subscriber->max_lag)
+                {
+                    // too far behind: skip to the newest keyframe if it is within the limit, else wait for the next one
+                    if (last_keyframe > subscriber->cursor && next_sequence - last_keyframe <= subscriber->max_lag)
+                    {
+                        subscriber->dropped += last_keyframe - subscriber->cursor;
+                        subscriber->cursor = last_keyframe;
+                    }
+                    else
+                    {
+                        subscriber->dropped += sequence - subscriber->cursor;
+                        subscriber->waiting_keyframe = true;
+                    }
+                }
+                if (subscriber->waiting_keyframe)
+                {
+                    if (keyframe)
+                    {
+                        subscriber->waiting_keyframe = false;
+                        subscriber->started = true;
+                    }
+                    else if (subscriber->started)
+                    {
+                        subscriber->dropped++;
+                    }
+                    subscriber->cursor = keyframe ? sequence : next_sequence;
+                }
+                ready = ready || (subscriber->fd < 0 && !subscriber->paused && subscriber->cursor < next_sequence);
+            }
+            trim();
+        }
+        frame_available.notify_all();
+        std::lock_guard<std::mutex> lock(handler_mutex);
+        if (ready && on_ready)
+            on_ready();
+    }
+
+    // Up to `max` frames for JS subscriber `id`, advancing its cursor. Paused subscribers read nothing.
+    std::vector<std::shared_ptr<Frame>> read(uint32_t id, size_t max)
+    {
+        std::vector<std::shared_ptr<Frame>> frames;
+        std::lock_guard<std::mutex> lock(mutex);
+        hub_subscriber_t *subscriber = find(id);
+        if (!subscriber || subscriber->paused || subscriber->fd >= 0)
+            return frames;
+        take(*subscriber, max, frames);
+        trim();
+        return frames;
+    }
+
+    // Returns false for an unknown id. A resumed subscriber may have frames to read right away.
+    bool set_paused(uint32_t id, bool paused)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        hub_subscriber_t *subscriber = find(id);
+        if (subscriber)
+            subscriber->paused = paused;
+        return subscriber != nullptr;
+    }
+
+    // Calls `visit(subscriber, lag)` for every subscriber, under the lock.
+    template <typename Visit>
+    void for_each(Visit visit)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : subscribers)
+            visit(*subscriber, next_sequence - subscriber->cursor);
+    }
+
+    // Frames in the ring.
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ring.size();
+    }
+
+    // No more frames: native sinks write what they have and stop, giving up after `stall_timeout_ms` on a reader
+    // that takes nothing. JS subscribers can still read what is left.
+    void close()
+    {
+        std::vector<std::shared_ptr<hub_subscriber_t>> sinks;
+        std::vector<std::shared_ptr<hub_subscriber_t>> removed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            sinks = subscribers;
+            removed.swap(retired);
+        }
+        frame_available.notify_all();
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : sinks)
+            if (subscriber->writer.joinable())
+                subscriber->writer.join();
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : removed)
+        {
+            if (subscriber->writer.joinable())
+                subscriber->writer.join();
+            if (subscriber->owns_fd)
+                ::close(subscriber->fd);
+        }
+    }
+
+  private:
+    std::mutex mutex;
+    // guards on_ready, which runs outside `mutex`
+    std::mutex handler_mutex;
+    std::function<void()> on_ready;
+    std::condition_variable frame_available;
+    uint32_t capacity = 256;
+    std::vector<std::shared_ptr<hub_subscriber_t>> subscribers;
+    // unsubscribed without waiting; their writers are joined by close()
+    std::vector<std::shared_ptr<hub_subscriber_t>> retired;
+    std::atomic<size_t> subscriber_count = 0;
+    // ring.front() has sequence number first_sequence
+    std::deque<std::shared_ptr<Frame>> ring;
+    uint64_t first_sequence = 0;
+    uint64_t next_sequence = 0;
+    // sequence number of the newest keyframe pushed
+    uint64_t last_keyframe = 0;
+    uint32_t next_id = 1;
+    bool closed = false;
+
+    hub_subscriber_t *find(uint32_t id)
+    {
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : subscribers)
+            if (subscriber->id == id)
+                return subscriber.get();
+        return nullptr;
+    }
+
+    void take(hub_subscriber_t &subscriber, size_t max, std::vector<std::shared_ptr<Frame>> &frames)
+    {
+        while (subscriber.cursor < next_sequence && frames.size() < max)
+        {
+            const std::shared_ptr<Frame> &frame = ring[subscriber.cursor++ - first_sequence];
+            subscriber.delivered++;
+            subscriber.bytes += frame->size;
+            frames.push_back(frame);
+        }
+    }
+
+    // Drops the frames every subscriber has read; lag limits keep the rest within capacity. Must be called with the lock held.
+    void trim()
+    {
+        uint64_t oldest = next_sequence;
+        for (std::shared_ptr<hub_subscriber_t> &subscriber : subscribers)
+            if (!subscriber->failed)
+                oldest = std::min(oldest, subscriber->cursor);
+        while (first_sequence < oldest)
+        {
+            ring.pop_front();
+            first_sequence++;
+        }
+    }
+
+    static constexpr int SINK_POLL_MS = 50;
+
+    void run_sink(std::shared_ptr<hub_subscriber_t> subscriber)
+    {
+        std::vector<std::shared_ptr<Frame>> batch;
+        std::vector<struct iovec> iov;
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                frame_available.wait(lock, [&] { return subscriber->cursor < next_sequence || subscriber->removed || closed; });
+                if (subscriber->removed)
+                    return;
+                take(*subscriber, IOV_MAX, batch);
+                trim();
+                if (batch.empty())
+                    return;
+            }
+            iov.clear();
+            for (const std::shared_ptr<Frame> &frame : batch)
+                iov.push_back({frame->data, frame->size});
+            // a full fd is polled in short slices, so an unsubscribe is seen and a stalled reader detected
+            uint32_t stalled_ms = 0;
+            bool stalled = false;
+            bool ok = writev_all(subscriber->fd, iov, [&] {
+                struct pollfd pfd = {subscriber->fd, POLLOUT, 0};
+                if (poll(&pfd, 1, SINK_POLL_MS) > 0)
+                    stalled_ms = 0;
+                else
+                    stalled_ms += SINK_POLL_MS;
+                std::lock_guard<std::mutex> lock(mutex);
+                stalled = stalled_ms >= stall_timeout_ms;
+                return !subscriber->removed && !stalled;
+            });
+            std::string error = ok ? "" : stalled ? "reader stalled for " + std::to_string(stall_timeout_ms) + " ms" : strerror(errno);
+            // releasing the frames may re-queue CAPTURE buffers, so not under the lock
+            batch.clear();
+            if (!ok)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                subscriber->failed = true;
+                subscriber->error = error;
+                trim();
+                return;
+            }
+        }
+    }
+};
+
+#endif
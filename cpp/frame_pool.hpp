@@ -0,0 +1,86 @@
+#ifndef __FRAME_POOL_H__
+#define __FRAME_POOL_H__
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Recycles the memory of encoded frames copied out of CAPTURE buffers, so steady-state streaming does not
+// allocate. Buffers come in power-of-two size classes from 4 KiB: the classes in use follow the observed frame
+// sizes (keyframes and P frames settle in different ones), and a byte budget bounds what is kept in between.
+class FramePool
+{
+  public:
+    static constexpr int MIN_SHIFT = 12;
+    static constexpr int CLASSES = 20;
+
+    // bytes kept for reuse at most; 0 turns the pool off
+    size_t max_bytes;
+
+    std::atomic<uint64_t> hits = 0;
+    std::atomic<uint64_t> misses = 0;
+    // bytes sitting in the free lists
+    std::atomic<uint64_t> pooled_bytes = 0;
+
+    explicit FramePool(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    ~FramePool()
+    {
+        for (std::vector<uint8_t *> &list : free)
+            for (uint8_t *data : list)
+                delete[] data;
+    }
+
+    // A buffer of at least `size` bytes; `capacity` is set to what it really holds, for give().
+    uint8_t *take(size_t size, size_t &capacity)
+    {
+        int index = size_class(size);
+        capacity = index < CLASSES ? (size_t)1 << (index + MIN_SHIFT) : size;
+        if (index < CLASSES && max_bytes)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free[index].empty())
+            {
+                uint8_t *data = free[index].back();
+                free[index].pop_back();
+                pooled_bytes.fetch_sub(capacity, std::memory_order_relaxed);
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return data;
+            }
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return new uint8_t[capacity];
+    }
+
+    // Returns a buffer from take(). It is freed instead when the budget is used up.
+    void give(uint8_t *data, size_t capacity)
+    {
+        int index = size_class(capacity);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (index < CLASSES && pooled_bytes.load(std::memory_order_relaxed) + capacity <= max_bytes)
+            {
+                free[index].push_back(data);
+                pooled_bytes.fetch_add(capacity, std::memory_order_relaxed);
+                return;
+            }
+        }
+        delete[] data;
+    }
+
+  private:
+    std::mutex mutex;
+    std::vector<uint8_t *> free[CLASSES];
+
+    // smallest class that fits `size`; CLASSES for frames too large to pool
+    static int size_class(size_t size)
+    {
+        int index = 0;
+        while (index < CLASSES && ((size_t)1 << (index + MIN_SHIFT)) < size)
+            index++;
+        return index;
+    }
+};
+
+#endif
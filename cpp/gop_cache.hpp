@@ -0,0 +1,118 @@
+#ifndef __GOP_CACHE_H__
+#define __GOP_CACHE_H__
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "frame_pool.hpp"
+#include "nalu.hpp"
+
+// The latest SPS/PPS and the frames since the last IDR, so a consumer that joins mid-stream can start right
+// away instead of waiting for (or forcing) the next keyframe. `Frame` is frame_data_t; frames are shared with
+// the other consumers, except lent CAPTURE slots, which are copied so the cache never holds the driver's buffers.
+template <typename Frame>
+class GopCache
+{
+  public:
+    // bytes of frames kept at most; a GOP that outgrows it is dropped until the next IDR. 0 keeps parameter sets only.
+    size_t max_bytes = 0;
+
+    explicit GopCache(std::shared_ptr<FramePool> pool) : pool(std::move(pool)) {}
+
+    // Called by the encoder thread for every encoded frame, with its Annex B data. Only frames that do not
+    // start with a slice are scanned; some encoders send the parameter sets in a buffer of their own.
+    void add_parameter_sets(const uint8_t *data, size_t size)
+    {
+        size_t header = size > 4 && data[2] == 0 ? 4 : 3;
+        uint8_t first = size > header ? data[header] & 0x1f : 0;
+        if (first >= 1 && first <= 5)
+            return;
+        nalu_t nalus[8];
+        size_t count = std::min(split_nalus(data, size, nalus, 8), (size_t)8);
+        for (size_t i = 0; i < count; i++)
+        {
+            const nalu_t &nalu = nalus[i];
+            if (nalu.type != 7 && nalu.type != 8)
+                continue;
+            const uint8_t *unit = data + nalu.offset + nalu.start_code;
+            uint32_t length = nalu.size - nalu.start_code;
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<Frame> &set = nalu.type == 7 ? sps : pps;
+            // views handed out earlier stay valid either way, but an unchanged set keeps its identity
+            if (set && set->size == length && memcmp(set->data, unit, length) == 0)
+                continue;
+            auto copy = std::make_shared<Frame>(length, pool);
+            memcpy(copy->data, unit, length);
+            set = std::move(copy);
+        }
+    }
+
+    // Called by the encoder thread for every encoded frame, in order.
+    void add(const std::shared_ptr<Frame> &frame)
+    {
+        if (!max_bytes)
+            return;
+        std::shared_ptr<Frame> kept = frame;
+        if (frame->ring)
+        {
+            kept = std::make_shared<Frame>(frame->size, pool);
+            memcpy(kept->data, frame->data, frame->size);
+            kept->inherit(*frame);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (kept->keyframe)
+        {
+            gop.clear();
+            gop_bytes = 0;
+            complete = true;
+        }
+        if (!complete)
+            return;
+        if (gop_bytes + kept->size > max_bytes)
+        {
+            gop.clear();
+            gop_bytes = 0;
+            complete = false;
+            return;
+        }
+        gop_bytes += kept->size;
+        gop.push_back(std::move(kept));
+    }
+
+    // False until both sets were seen.
+    bool parameter_sets(std::shared_ptr<Frame> &_sps, std::shared_ptr<Frame> &_pps)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        _sps = sps;
+        _pps = pps;
+        return sps && pps;
+    }
+
+    // The frames from the last IDR on; empty while no complete GOP is cached.
+    std::vector<std::shared_ptr<Frame>> snapshot()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return gop;
+    }
+
+    size_t bytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return gop_bytes;
+    }
+
+  private:
+    std::shared_ptr<FramePool> pool;
+    std::mutex mutex;
+    // NAL units without the start code
+    std::shared_ptr<Frame> sps;
+    std::shared_ptr<Frame> pps;
+    std::vector<std::shared_ptr<Frame>> gop;
+    size_t gop_bytes = 0;
+    // `gop` starts with an IDR
+    bool complete = false;
+};
+
+#endif
@@ -1,8 +1,12 @@
 #ifndef _H264_ENCODER_H_
 #define _H264_ENCODER_H_ 1
+#include <algorithm>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <iostream>
+#include <memory>
 #include <linux/videodev2.h>
 #include <mutex>
 #include <napi.h>
@@ -14,649 +18,1230 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <vector>
 
+#include "encoder_loop.hpp"
+#include "encoder_session.hpp"
+#include "nalu.hpp"
+#include "session_pool.hpp"
 #include "util.hpp"
 
 using namespace Napi;
 
-struct frame_data_t
-{
-    uint32_t size;
-    uint8_t *data;
-};
-
 using FrameType = frame_data_t *;
 
-struct buffer
+// Reads the device, buffer and file settings of the JS option object on top of `config`.
+encoder_config_t parse_config(const Napi::Object &option, encoder_config_t config = {})
 {
-    void *start;
-    int length;
-    struct v4l2_buffer inner;
-    struct v4l2_plane plane;
-};
-
-// static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
-// {
-//     if (cs == libcamera::ColorSpace::Rec709)
-//         return V4L2_COLORSPACE_REC709;
-//     else if (cs == libcamera::ColorSpace::Smpte170m)
-//         return V4L2_COLORSPACE_SMPTE170M;
-
-//     // LOG(1, "H264: surprising colour space: " << libcamera::ColorSpace::toString(cs));
-//     return V4L2_COLORSPACE_SMPTE170M;
-// }
+    if (option.Get("width").IsNumber())
+        config.width = option.Get("width").As<Napi::Number>().Uint32Value();
+    if (option.Get("height").IsNumber())
+        config.height = option.Get("height").As<Napi::Number>().Uint32Value();
+    if (option.Get("bitrate").IsNumber())
+        config.bitrate_bps = option.Get("bitrate").As<Napi::Number>().Uint32Value();
+    if (option.Get("level").IsNumber())
+        config.level = option.Get("level").As<Napi::Number>().Uint32Value();
+    if (option.Get("pixel_format").IsNumber())
+        config.pixel_format = option.Get("pixel_format").As<Napi::Number>().Uint32Value();
+    if (option.Get("num_planes").IsNumber())
+        config.num_planes = option.Get("num_planes").As<Napi::Number>().Uint32Value();
+    if (option.Get("bytesperline").IsNumber())
+        config.bytesperline = option.Get("bytesperline").As<Napi::Number>().Uint32Value();
+    if (option.Get("colorspace").IsNumber())
+        config.colorspace = option.Get("colorspace").As<Napi::Number>().Uint32Value();
+    if (option.Get("framerate").IsNumber())
+        config.framerate = option.Get("framerate").As<Napi::Number>().Uint32Value();
+    if (option.Get("controllers").IsArray())
+    {
+        Napi::Array controllers = option.Get("controllers").As<Napi::Array>();
+        for (uint32_t i = 0; i < controllers.Length(); i++)
+        {
+            Napi::Object ctrl_obj = controllers.Get(i).As<Napi::Object>();
+            config.controllers.emplace_back(ctrl_obj.Get("id").As<Napi::Number>().Uint32Value(), ctrl_obj.Get("value").As<Napi::Number>().Int32Value());
+        }
+    }
+    if (option.Get("outputBuffers").IsNumber())
+        config.output_buffer_count = std::clamp(option.Get("outputBuffers").As<Napi::Number>().Uint32Value(), 1u, (uint32_t)VIDEO_MAX_FRAME);
+    if (option.Get("captureBuffers").IsNumber())
+        config.capture_buffer_count = std::clamp(option.Get("captureBuffers").As<Napi::Number>().Uint32Value(), 1u, (uint32_t)VIDEO_MAX_FRAME);
+    if (option.Get("framePoolBytes").IsNumber())
+        config.frame_pool_bytes = option.Get("framePoolBytes").As<Napi::Number>().Uint32Value();
+    if (option.Get("gopCacheBytes").IsNumber())
+        config.gop_cache_bytes = option.Get("gopCacheBytes").As<Napi::Number>().Uint32Value();
+    if (option.Get("rateControl").IsObject())
+    {
+        Napi::Object rate = option.Get("rateControl").As<Napi::Object>();
+        config.rate_control = true;
+        if (rate.Get("target").IsNumber())
+            config.rate_target = rate.Get("target").As<Napi::Number>().Uint32Value();
+        if (rate.Get("min").IsNumber())
+            config.rate_min = rate.Get("min").As<Napi::Number>().Uint32Value();
+        if (rate.Get("max").IsNumber())
+            config.rate_max = rate.Get("max").As<Napi::Number>().Uint32Value();
+        if (rate.Get("window").IsNumber())
+            config.rate_window_ms = rate.Get("window").As<Napi::Number>().Uint32Value();
+    }
+    if (option.Get("lendBuffers").IsBoolean())
+        config.lend_buffers = option.Get("lendBuffers").As<Napi::Boolean>();
+    if (option.Get("feed_type").IsNumber())
+    {
+        auto _feed_type = option.Get("feed_type").As<Napi::Number>().Uint32Value();
+        if (_feed_type == 1 || _feed_type == 2)
+        {
+            config.feed_type = _feed_type;
+        }
+    }
+    if (option.Get("inputFormat").IsString())
+        config.input_format = option.Get("inputFormat").As<Napi::String>().Utf8Value();
+    if (option.Get("inputStride").IsNumber())
+        config.input_stride = option.Get("inputStride").As<Napi::Number>().Uint32Value();
+    if (option.Get("inputMemory").IsString())
+        config.input_memory = option.Get("inputMemory").As<Napi::String>().Utf8Value();
+    if (option.Get("convertThreads").IsNumber())
+        config.convert_threads = option.Get("convertThreads").As<Napi::Number>().Uint32Value();
+    if (option.Get("feedPolicy").IsString())
+    {
+        std::string policy = option.Get("feedPolicy").As<Napi::String>().Utf8Value();
+        if (policy == "block")
+            config.feed_policy = feed_policy_t::BLOCK;
+        else if (policy == "drop-newest")
+            config.feed_policy = feed_policy_t::DROP_NEWEST;
+        else if (policy == "drop-oldest")
+            config.feed_policy = feed_policy_t::DROP_OLDEST;
+    }
+    if (option.Get("feedTimeout").IsNumber())
+        config.feed_timeout_ms = option.Get("feedTimeout").As<Napi::Number>().Uint32Value();
+    if (option.Get("file").IsString())
+        config.file = option.Get("file").As<Napi::String>().Utf8Value();
+    if (option.Get("fileQueueFrames").IsNumber())
+        config.file_queue_frames = std::max(option.Get("fileQueueFrames").As<Napi::Number>().Uint32Value(), 1u);
+    if (option.Get("fileSync").IsString())
+    {
+        std::string sync = option.Get("fileSync").As<Napi::String>().Utf8Value();
+        if (sync == "keyframe")
+            config.file_sync = file_sync_t::KEYFRAME;
+        else if (sync == "interval")
+            config.file_sync = file_sync_t::INTERVAL;
+    }
+    if (option.Get("fileSyncInterval").IsNumber())
+        config.file_sync_interval_ms = option.Get("fileSyncInterval").As<Napi::Number>().Uint32Value();
+    if (option.Get("fileFormat").IsString())
+        config.file_fmp4 = option.Get("fileFormat").As<Napi::String>().Utf8Value() == "fmp4";
+    if (option.Get("segmentDuration").IsNumber())
+        config.segment_duration_ms = option.Get("segmentDuration").As<Napi::Number>().Uint32Value();
+    if (option.Get("fragments").IsBoolean())
+        config.deliver_fragments = option.Get("fragments").As<Napi::Boolean>();
+    if (option.Get("fileBackpressure").IsString())
+        config.file_block = option.Get("fileBackpressure").As<Napi::String>().Utf8Value() == "block";
+    if (option.Get("rtp").IsObject())
+    {
+        Napi::Object rtp = option.Get("rtp").As<Napi::Object>();
+        config.rtp = true;
+        if (rtp.Get("mtu").IsNumber())
+            config.rtp_mtu = rtp.Get("mtu").As<Napi::Number>().Uint32Value();
+        if (rtp.Get("payloadType").IsNumber())
+            config.rtp_payload_type = rtp.Get("payloadType").As<Napi::Number>().Uint32Value();
+        if (rtp.Get("ssrc").IsNumber())
+            config.rtp_ssrc = rtp.Get("ssrc").As<Napi::Number>().Uint32Value();
+        if (rtp.Get("clockRate").IsNumber())
+            config.rtp_clock_rate = rtp.Get("clockRate").As<Napi::Number>().Uint32Value();
+        if (rtp.Get("ptsRate").IsNumber())
+            config.rtp_pts_rate = rtp.Get("ptsRate").As<Napi::Number>().Uint32Value();
+        if (rtp.Get("timestampSource").IsString())
+        {
+            std::string source = rtp.Get("timestampSource").As<Napi::String>().Utf8Value();
+            if (source == "pts")
+                config.rtp_timestamp_source = rtp_timestamp_source_t::PTS;
+            else if (source == "clock")
+                config.rtp_timestamp_source = rtp_timestamp_source_t::CLOCK;
+        }
+        if (rtp.Get("host").IsString())
+            config.rtp_host = rtp.Get("host").As<Napi::String>().Utf8Value();
+        if (rtp.Get("port").IsNumber())
+            config.rtp_port = rtp.Get("port").As<Napi::Number>().Uint32Value();
+    }
+    if (option.Get("device").IsString())
+        config.device_path = option.Get("device").As<Napi::String>().Utf8Value();
+    if (option.Get("backend").IsString())
+        config.backend = option.Get("backend").As<Napi::String>().Utf8Value();
+    if (option.Get("emulatedLatency").IsNumber())
+        config.emulated_latency_ms = option.Get("emulatedLatency").As<Napi::Number>().DoubleValue();
+    if (option.Get("emulatedReplay").IsString())
+        config.emulated_replay = option.Get("emulatedReplay").As<Napi::String>().Utf8Value();
+    return config;
+}
 
-// mmaps the buffers for the given type of device (capture or output).
-void map(int fd, uint32_t type, struct buffer *buffer, enum v4l2_memory mem_type)
+// The optional (pts, tag) arguments of feed(). Throws a TypeError and returns false for a bigint pts that does
+// not fit 64 signed bits.
+bool parse_meta(const Napi::Value &pts, const Napi::Value &tag, frame_meta_t &meta)
 {
-    struct v4l2_buffer *inner = &buffer->inner;
-
-    memset(inner, 0, sizeof(*inner));
-    inner->type = type;
-    inner->memory = mem_type;
-
-    inner->index = 0;
-    inner->length = 1;
-    inner->m.planes = &buffer->plane;
-    ioctl(fd, VIDIOC_QUERYBUF, inner);
-    std::cout << "map plane length after query buffer: " << ((&(buffer->plane))[0]).length << std::endl;
-    buffer->length = inner->m.planes[0].length;
-    buffer->start = mmap(NULL, buffer->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, inner->m.planes[0].m.mem_offset);
-    if (buffer->start == (void *)-1)
+    if (pts.IsNumber())
+        meta.pts = pts.As<Napi::Number>().Int64Value();
+    else if (pts.IsBigInt())
     {
-        // std::cout << "mmap type: " << type << std::endl;
-        throw std::runtime_error("mmap failed: " + std::string(strerror(errno)));
+        bool lossless;
+        meta.pts = pts.As<Napi::BigInt>().Int64Value(&lossless);
+        if (!lossless)
+        {
+            Napi::TypeError::New(pts.Env(), "pts does not fit in 64 bits").ThrowAsJavaScriptException();
+            return false;
+        }
+        meta.pts_bigint = true;
     }
+    meta.has_pts = pts.IsNumber() || pts.IsBigInt();
+    if (tag.IsNumber())
+        meta.tag = tag.As<Napi::Number>().DoubleValue();
+    meta.has_tag = tag.IsNumber();
+    return true;
 }
 
-class EncoderWorker : public AsyncProgressWorker<FrameType>
+// What a bounded output queue does with a frame that finds it full.
+enum class queue_overflow_t
 {
-  public:
-    uint32_t width = 640;
-    uint32_t height = 480;
-    uint32_t bitrate_bps = 4 * 1024 * 1024;
-    int level = V4L2_MPEG_VIDEO_H264_LEVEL_4_2;
-    uint32_t pixel_format = V4L2_PIX_FMT_YUYV;
-    uint8_t num_planes = 1;
-    struct buffer output;
-    struct buffer capture;
-    int fd = -1;
-    FILE *file = NULL;
-    bool stopped = false;
-    std::mutex operation_mutex; // 互斥量，保护 feed 和 stop 操作
-    std::condition_variable frame_available;
+    // drop a frame nothing refers to (the new one, else the oldest queued); drop to the next IDR if there is none
+    DROP_NON_REFERENCE,
+    // drop everything queued and skip frames until the next IDR, which is requested right away
+    DROP_TO_IDR,
+    // keep the frame and leave the next ones with the driver until the consumer catches up, which stalls feed()
+    BLOCK,
+};
 
+// Encoded output on its way to JS: what the encoder thread has queued, and how it becomes callbacks.
+// Used by the per-encoder worker and by the shared event loop alike; only flush() touches JS.
+class EncoderOutput
+{
+  public:
+    std::shared_ptr<EncoderSession> session;
     bool invoke_callback = true;
-    uint32_t total_frame = 0;
-    uint32_t total_size = 0;
-    long long feed_time = 0;
-    uint32_t poll_num = 0;
-
-    enum v4l2_memory output_mem_type = V4L2_MEMORY_DMABUF;
-
-    std::string init_error_msg;
-
-    /**
-     * 1: feed fd;
-     * 2: feed buffer;
-     */
-    uint8_t feed_type = 1;
-
-    EncoderWorker(Napi::Object option, Napi::Function callback) : AsyncProgressWorker(callback)
-    {
-        if (option.Get("width").IsNumber())
-            width = option.Get("width").As<Napi::Number>().Uint32Value();
-        if (option.Get("height").IsNumber())
-            height = option.Get("height").As<Napi::Number>().Uint32Value();
-        if (option.Get("bitrate").IsNumber())
-            bitrate_bps = option.Get("bitrate").As<Napi::Number>().Uint32Value();
-        if (option.Get("level").IsNumber())
-            level = option.Get("level").As<Napi::Number>().Uint32Value();
-        if (option.Get("pixel_format").IsNumber())
-            pixel_format = option.Get("pixel_format").As<Napi::Number>().Uint32Value();
-        if (option.Get("num_planes").IsNumber())
-            num_planes = option.Get("num_planes").As<Napi::Number>().Uint32Value();
+    // one callback per access unit (a buffer plus an [offset, size, type] table) instead of one per NALU
+    bool batch = false;
+    // in batch mode, how many queued access units one callback may carry when JS falls behind
+    uint32_t max_batch_frames = 1;
+    nalu_format_t output_format = nalu_format_t::ANNEXB;
+    // call back with "drain" once the encoder has room again after a feed found none
+    bool drain_event = false;
+    // simulcast layer this output belongs to, added to every payload; -1 for a plain encoder
+    int32_t layer = -1;
+    // a "drain" waiting for the JS thread, guarded by pending_mutex
+    bool drain_pending = false;
+    // encoded frames waiting for the JS thread, guarded by pending_mutex
+    std::mutex pending_mutex;
+    std::deque<std::shared_ptr<frame_data_t>> pending;
+    // errors that do not end the stream (file writes), reported through the callback; guarded by pending_mutex
+    std::deque<std::string> pending_errors;
+    // fMP4 fragments for JS when the `fragments` option is set; guarded by pending_mutex
+    std::deque<std::shared_ptr<mp4_fragment_t>> pending_fragments;
+    // RTP packet batches for JS when the `rtp` option has no destination; guarded by pending_mutex
+    std::deque<std::shared_ptr<rtp_batch_t>> pending_rtp;
+    // NALU table reused across flushes, grown when an access unit has more units
+    std::vector<nalu_t> nalus = std::vector<nalu_t>(16);
+    // the session's flushes_completed as last seen by collect(), guarded by pending_mutex
+    uint64_t flushes_seen = 0;
+    // JS thread only: flush() promises and the drain each one waits for
+    std::deque<std::pair<uint64_t, Napi::Promise::Deferred>> flushes;
+    // frames are handed out by pull() instead of the callback
+    bool pull = false;
+    // JS thread only: pull() promises waiting for a frame
+    std::deque<Napi::Promise::Deferred> pulls;
+    // encoded frames queued at most, 0 for no limit; read by the encoder thread under pending_mutex
+    uint32_t queue_capacity = 0;
+    queue_overflow_t queue_overflow = queue_overflow_t::DROP_NON_REFERENCE;
+    // DROP_TO_IDR emptied the queue and frames are skipped until a keyframe, guarded by pending_mutex
+    bool skipping_to_idr = false;
+
+    EncoderOutput(std::shared_ptr<EncoderSession> session, const Napi::Object &option) : session(std::move(session))
+    {
         if (option.Get("invokeCallback").IsBoolean())
             invoke_callback = option.Get("invokeCallback").As<Napi::Boolean>();
-        if (option.Get("feed_type").IsNumber())
+        if (option.Get("batch").IsBoolean())
+            batch = option.Get("batch").As<Napi::Boolean>();
+        if (option.Get("outputFormat").IsString())
         {
-            auto _feed_type = option.Get("feed_type").As<Napi::Number>().Uint32Value();
-            if (_feed_type == 1 || _feed_type == 2)
-            {
-                feed_type = _feed_type;
-            }
-            if (feed_type == 1)
-            {
-                output_mem_type = V4L2_MEMORY_DMABUF;
-            }
-            if (feed_type == 2)
-            {
-                output_mem_type = V4L2_MEMORY_MMAP;
-            }
+            std::string format = option.Get("outputFormat").As<Napi::String>().Utf8Value();
+            if (format == "avcc")
+                output_format = nalu_format_t::AVCC;
+            else if (format == "raw-nalu")
+                output_format = nalu_format_t::RAW;
         }
+        if (option.Get("maxBatchFrames").IsNumber())
+            max_batch_frames = std::max(option.Get("maxBatchFrames").As<Napi::Number>().Uint32Value(), 1u);
+        if (option.Get("drainEvent").IsBoolean())
+            drain_event = option.Get("drainEvent").As<Napi::Boolean>();
+        set_queue(option.Get("queueFrames"), option.Get("queueOverflow"));
+    }
 
-        // Defer all fallible initialization to a separate method.
-        // This allows us to handle errors gracefully and report them back to JS.
-        initialize(option);
+    // Bounds the queue of encoded frames; `overflow` is 'drop-non-reference', 'drop-to-idr' or 'block'.
+    void set_queue(const Napi::Value &capacity, const Napi::Value &overflow)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        if (capacity.IsNumber())
+            queue_capacity = capacity.As<Napi::Number>().Uint32Value();
+        if (!overflow.IsString())
+            return;
+        std::string policy = overflow.As<Napi::String>().Utf8Value();
+        if (policy == "drop-to-idr")
+            queue_overflow = queue_overflow_t::DROP_TO_IDR;
+        else if (policy == "block")
+            queue_overflow = queue_overflow_t::BLOCK;
+        else
+            queue_overflow = queue_overflow_t::DROP_NON_REFERENCE;
     }
 
-    // All initialization that can fail is performed here.
-    // On failure, it sets `init_error_msg` and cleans up any partially acquired resources.
-    void initialize(const Napi::Object &option)
+    // Parks an encoded frame for the JS thread. Frames are queued natively rather than sent one by one,
+    // so that a late flush can pick up several of them at once in batch mode.
+    void push(std::shared_ptr<frame_data_t> frame_data)
     {
-        // 1. Open device
-        fd = open("/dev/video11", O_RDWR);
-        if (fd < 0)
+        bool accepted = true;
+        size_t removed = 0;
+        bool keyframe_needed = false;
         {
-            init_error_msg = "Failed to open /dev/video11: " + std::string(strerror(errno));
-            return;
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            if (skipping_to_idr && !frame_data->keyframe)
+                accepted = false;
+            else if (queue_capacity && pending.size() >= queue_capacity)
+                accepted = overflow(*frame_data, removed, keyframe_needed);
+            if (frame_data->keyframe)
+                skipping_to_idr = false;
+            if (accepted)
+                pending.emplace_back(std::move(frame_data));
         }
+        if (accepted)
+            session->stats.pending_frames.fetch_add(1, std::memory_order_relaxed);
+        if (removed)
+            session->stats.pending_frames.fetch_sub(removed, std::memory_order_relaxed);
+        if (removed || !accepted)
+            session->stats.queue_dropped.fetch_add(removed + !accepted, std::memory_order_relaxed);
+        if (keyframe_needed)
+            session->request_keyframe();
+    }
 
-        // 2. Open output file if specified
-        if (option.Get("file").IsString())
+    // Makes room for `frame` in the full queue as `queue_overflow` says. Returns whether to queue it; `removed`
+    // counts the queued frames dropped. Must be called with pending_mutex held.
+    bool overflow(const frame_data_t &frame, size_t &removed, bool &keyframe_needed)
+    {
+        if (queue_overflow == queue_overflow_t::BLOCK)
         {
-            file = fopen(option.Get("file").As<Napi::String>().Utf8Value().c_str(), "w");
-            if (!file)
+            session->captures_paused.store(true, std::memory_order_release);
+            return true;
+        }
+        if (queue_overflow == queue_overflow_t::DROP_NON_REFERENCE)
+        {
+            if (!frame.keyframe && !is_reference_picture(frame.data, frame.size))
+                return false;
+            for (auto it = pending.begin(); it != pending.end(); ++it)
             {
-                init_error_msg = "Failed to open output file: " + std::string(strerror(errno));
-                close(fd);
-                fd = -1;
-                return;
+                if ((*it)->keyframe || is_reference_picture((*it)->data, (*it)->size))
+                    continue;
+                pending.erase(it);
+                removed = 1;
+                return true;
             }
         }
+        // the frames left would not decode without the ones dropped
+        removed = pending.size();
+        pending.clear();
+        if (frame.keyframe)
+            return true;
+        skipping_to_idr = true;
+        keyframe_needed = true;
+        return false;
+    }
+
+    void push_error(const std::string &error)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending_errors.push_back(error);
+    }
 
-        // 3. Configure V4L2 device. Wrap in try-catch to handle errors from ioctl/mmap.
-        try
+    // Picks up file errors, the drain event, completed flushes, RTP batches and fMP4 fragments from the session. Returns true if JS has something new.
+    bool collect()
+    {
+        bool found = false;
+        if (session->take_drain() && drain_event)
         {
-            configure_v4l2(option);
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            drain_pending = found = true;
         }
-        catch (const std::runtime_error &e)
+        uint64_t flushed = session->flushes_completed.load(std::memory_order_acquire);
         {
-            init_error_msg = e.what();
-            // Cleanup all resources acquired so far
-            if (file)
-            {
-                fclose(file);
-                file = nullptr;
-            }
-            if (output.start)
-            {
-                munmap(output.start, output.length);
-                output.start = nullptr;
-            }
-            if (capture.start)
-            {
-                munmap(capture.start, capture.length);
-                capture.start = nullptr;
-            }
-            if (fd >= 0)
-            {
-                // Request to free buffers before closing fd
-                struct v4l2_requestbuffers buf_req = {};
-                buf_req.count = 0;
-                buf_req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-                buf_req.memory = output_mem_type;
-                ioctl(fd, VIDIOC_REQBUFS, &buf_req);
-                buf_req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-                buf_req.memory = V4L2_MEMORY_MMAP;
-                ioctl(fd, VIDIOC_REQBUFS, &buf_req);
-
-                close(fd);
-                fd = -1;
-            }
-            return;
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            found = found || flushed != flushes_seen;
+            flushes_seen = flushed;
         }
+        std::string file_error;
+        if (session->take_file_error(file_error))
+        {
+            push_error(file_error);
+            found = true;
+        }
+        std::string control_error;
+        while (session->take_control_error(control_error))
+        {
+            push_error(control_error);
+            found = true;
+        }
+        if (session->config.rtp && session->config.rtp_host.empty())
+        {
+            std::vector<std::shared_ptr<rtp_batch_t>> batches = session->take_rtp_batches();
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            pending_rtp.insert(pending_rtp.end(), batches.begin(), batches.end());
+            found = found || !batches.empty();
+        }
+        if (!session->config.deliver_fragments)
+            return found;
+        std::vector<std::shared_ptr<mp4_fragment_t>> fragments = session->take_fragments();
+        if (fragments.empty())
+            return found;
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending_fragments.insert(pending_fragments.end(), fragments.begin(), fragments.end());
+        return true;
     }
 
-    void configure_v4l2(const Napi::Object &option)
+    // Pops up to `max` encoded frames queued by the encoder thread.
+    std::vector<std::shared_ptr<frame_data_t>> take_pending(uint32_t max)
     {
-        if (option.Get("controllers").IsArray())
+        std::vector<std::shared_ptr<frame_data_t>> frames;
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        while (!pending.empty() && frames.size() < max)
         {
-            Napi::Array controllers = option.Get("controllers").As<Napi::Array>();
-            for (int i = 0; i < controllers.Length(); i++)
-            {
-                Napi::Object ctrl_obj = controllers.Get(i).As<Napi::Object>();
-                uint32_t id = ctrl_obj.Get('id').As<Napi::Number>().Uint32Value();
-                int32_t value = ctrl_obj.Get('value').As<Napi::Number>().Int32Value();
-                v4l2_control ctrl = {};
-                ctrl.id = id;
-                ctrl.value = value;
-                if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
-                    throw std::runtime_error("Failed to set controller " + std::to_string(id) + ": " + strerror(errno));
-            }
+            frames.emplace_back(std::move(pending.front()));
+            pending.pop_front();
         }
-        // 设置码率
-        v4l2_control ctrl = {};
-        ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
-        ctrl.value = bitrate_bps;
-        if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
-            throw std::runtime_error("Failed to set bitrate: " + std::string(strerror(errno)));
-
-        ctrl.id = V4L2_CID_MPEG_VIDEO_H264_LEVEL;
-        ctrl.value = level;
-        if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
-            throw std::runtime_error("Failed to set H.264 level: " + std::string(strerror(errno)));
-
-        struct v4l2_format fmt;
-        fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        if (ioctl(fd, VIDIOC_G_FMT, &fmt) < 0)
-            throw std::runtime_error("Failed to get output format (VIDIOC_G_FMT): " + std::string(strerror(errno)));
-
-        fmt.fmt.pix_mp.width = width;
-        fmt.fmt.pix_mp.height = height;
-        fmt.fmt.pix_mp.pixelformat = pixel_format;
-        fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
-        fmt.fmt.pix_mp.num_planes = num_planes;
-        if (option.Get("bytesperline").IsNumber())
-            fmt.fmt.pix_mp.plane_fmt[0].bytesperline = option.Get("bytesperline").As<Napi::Number>().Uint32Value();
-        if (option.Get("colorspace").IsNumber())
-            fmt.fmt.pix_mp.colorspace = option.Get("colorspace").As<Napi::Number>().Uint32Value();
-        if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
-            throw std::runtime_error("Failed to set output format (VIDIOC_S_FMT): " + std::string(strerror(errno)));
-
-        fmt = {};
-        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        if (ioctl(fd, VIDIOC_G_FMT, &fmt) < 0)
-            throw std::runtime_error("Failed to get capture format (VIDIOC_G_FMT): " + std::string(strerror(errno)));
-
-        fmt.fmt.pix_mp.width = width;
-        fmt.fmt.pix_mp.height = height;
-        fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
-        fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
-        fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
-        fmt.fmt.pix_mp.num_planes = 1;
-        fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
-        fmt.fmt.pix_mp.plane_fmt[0].sizeimage = 1024 << 10;
-        if (ioctl(fd, VIDIOC_S_FMT, &fmt) < 0)
-            throw std::runtime_error("Failed to set capture format (VIDIOC_S_FMT): " + std::string(strerror(errno)));
-
-        if (option.Get("framerate").IsNumber())
-        {
-            auto framerate = option.Get("framerate").As<Napi::Number>().Uint32Value();
-            struct v4l2_streamparm params;
-            memset(&params, 0, sizeof(params));
-            params.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-            params.parm.output.timeperframe.numerator = 1;
-            params.parm.output.timeperframe.denominator = framerate;
-            if (ioctl(fd, VIDIOC_S_PARM, &params) < 0)
-                throw std::runtime_error("Failed to set framerate: " + std::string(strerror(errno)));
-        }
-
-        struct v4l2_requestbuffers buf;
-        buf.count = 1;
-        // struct buffer output;
-        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        buf.memory = output_mem_type;
-        if (ioctl(fd, VIDIOC_REQBUFS, &buf) < 0)
-            throw std::runtime_error("Failed to request output buffers: " + std::string(strerror(errno)));
-
-        if (feed_type == 2)
-        {
-            map(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &output, output_mem_type);
-        }
-
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        if (ioctl(fd, VIDIOC_REQBUFS, &buf) < 0)
-            throw std::runtime_error("Failed to request capture buffers: " + std::string(strerror(errno)));
-
-        map(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, &capture, V4L2_MEMORY_MMAP);
-
-        if (ioctl(fd, VIDIOC_QBUF, &capture.inner) < 0)
-            throw std::runtime_error("Failed to queue initial capture buffer: " + std::string(strerror(errno)));
-
-        int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
-            throw std::runtime_error("Failed to start output stream: " + std::string(strerror(errno)));
-
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        if (ioctl(fd, VIDIOC_STREAMON, &type) < 0)
-            throw std::runtime_error("Failed to start capture stream: " + std::string(strerror(errno)));
+        session->stats.pending_frames.fetch_sub(frames.size(), std::memory_order_relaxed);
+        // a blocked encoder goes on once there is room again
+        if (!frames.empty() && (!queue_capacity || pending.size() < queue_capacity))
+            session->resume_captures();
+        return frames;
     }
 
-    void Execute(const ExecutionProgress &progress)
+    // Records the dequeue->callback latency of frames about to be handed to JS.
+    void delivered(const std::vector<std::shared_ptr<frame_data_t>> &frames)
+    {
+        uint64_t now = monotonic_us();
+        for (const std::shared_ptr<frame_data_t> &frame : frames)
+            session->stats.delivery_latency.record(now - frame->dequeued_us);
+        session->stats.frames_delivered.fetch_add(frames.size(), std::memory_order_relaxed);
+    }
+
+    // Splits `frame` into the reusable NALU table and returns the number of units.
+    // The table describes the units in `output_format`. For AVCC the start codes are overwritten in place;
+    // only 3-byte start codes, or a file writer, GOP cache or hub still reading the Annex B data, force a converted copy.
+    size_t split(std::shared_ptr<frame_data_t> &frame)
+    {
+        size_t count = split_nalus(frame->data, frame->size, nalus.data(), nalus.size());
+        if (count > nalus.size())
+        {
+            nalus.resize(count);
+            split_nalus(frame->data, frame->size, nalus.data(), nalus.size());
+        }
+        if (output_format == nalu_format_t::RAW)
+            strip_start_codes(nalus.data(), count);
+        if (output_format != nalu_format_t::AVCC)
+            return count;
+        if (!session->file_sink && !session->gop_cache.max_bytes && !session->hub.active() && annexb_to_avcc_in_place(frame->data, nalus.data(), count))
+            return count;
+        size_t size = avcc_size(nalus.data(), count);
+        auto converted = std::make_shared<frame_data_t>(size, session->frame_pool);
+        annexb_to_avcc(frame->data, nalus.data(), count, converted->data);
+        session->stats.bytes_copied.fetch_add(size, std::memory_order_relaxed);
+        converted->inherit(*frame);
+        frame = std::move(converted);
+        return count;
+    }
+
+    // Wraps `size` bytes of `frame` in a Buffer that shares ownership of the frame; the copy is freed,
+    // or the lent CAPTURE slot re-queued, when the last such buffer is garbage collected.
+    template <typename Frame>
+    static Napi::Buffer<uint8_t> wrap(Napi::Env env, const std::shared_ptr<Frame> &frame, uint8_t *data, size_t size)
     {
-        // If initialization failed, report the error and exit the worker thread.
-        if (!init_error_msg.empty())
+        return Napi::Buffer<uint8_t>::New(env, data, size, [](Napi::Env, uint8_t *, std::shared_ptr<Frame> *owner) { delete owner; }, new std::shared_ptr<Frame>(frame));
+    }
+
+    // { data, nalus: Uint32Array of [offset, size, type] triples, keyframe } for one access unit.
+    Napi::Object frame_payload(Napi::Env env, std::shared_ptr<frame_data_t> frame)
+    {
+        size_t count = split(frame);
+        Napi::Uint32Array table = Napi::Uint32Array::New(env, count * 3);
+        bool keyframe = frame->keyframe;
+        for (size_t i = 0; i < count; i++)
         {
-            SetError(init_error_msg);
+            table[i * 3] = nalus[i].offset;
+            table[i * 3 + 1] = nalus[i].size;
+            table[i * 3 + 2] = nalus[i].type;
+            keyframe = keyframe || nalus[i].type == 5;
+        }
+        Napi::Object payload = Napi::Object::New(env);
+        payload.Set("data", wrap(env, frame, frame->data, frame->size));
+        payload.Set("nalus", table);
+        payload.Set("keyframe", keyframe);
+        describe(payload, *frame);
+        return payload;
+    }
+
+    void tag(Napi::Object &payload)
+    {
+        if (layer >= 0)
+            payload.Set("layer", layer);
+    }
+
+    // Ties an encoded payload back to the raw frame: feed sequence number, encode time and what feed() was given.
+    void describe(Napi::Object &payload, const frame_data_t &frame)
+    {
+        payload.Set("sequence", (double)frame.sequence);
+        payload.Set("encodeTime", frame.encode_us / 1000.0);
+        if (frame.meta.has_pts && frame.meta.pts_bigint)
+            payload.Set("pts", Napi::BigInt::New(payload.Env(), frame.meta.pts));
+        else if (frame.meta.has_pts)
+            payload.Set("pts", (double)frame.meta.pts);
+        if (frame.meta.has_tag)
+            payload.Set("tag", frame.meta.tag);
+        tag(payload);
+    }
+
+    // Resolves the flush() promises whose drain completed once the frames before it were handed to JS, and
+    // rejects the rest if the session stopped.
+    void settle_flushes(Napi::Env env)
+    {
+        if (flushes.empty())
             return;
+        uint64_t completed = session->flushes_completed.load(std::memory_order_acquire);
+        bool delivered;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            delivered = pending.empty();
+        }
+        Napi::HandleScope scope(env);
+        while (!flushes.empty() && delivered && flushes.front().first <= completed)
+        {
+            flushes.front().second.Resolve(env.Undefined());
+            flushes.pop_front();
         }
+        if (!session->stopped)
+            return;
+        for (auto &[drain, deferred] : flushes)
+            deferred.Reject(Napi::Error::New(env, "The encoder stopped before the flush completed").Value());
+        flushes.clear();
+    }
 
-        while (true)
+    // Resolves waiting pull() promises with queued frames, or with null once the session stopped and the queue is empty.
+    void settle_pulls(Napi::Env env)
+    {
+        if (pulls.empty())
+            return;
+        // read first: a frame queued after this is seen by the next call
+        bool stopped = session->stopped;
+        Napi::HandleScope scope(env);
+        while (!pulls.empty())
         {
-            if (stopped)
+            std::vector<std::shared_ptr<frame_data_t>> frames = take_pending(1);
+            if (frames.empty() && !stopped)
+                return;
+            Napi::Promise::Deferred deferred = pulls.front();
+            pulls.pop_front();
+            if (frames.empty())
             {
-                break;
+                deferred.Resolve(env.Null());
+                continue;
             }
-            // usleep(8 * 1000);
+            delivered(frames);
+            deferred.Resolve(frame_payload(env, frames[0]));
+        }
+    }
 
-            pollfd p = {fd, POLLIN, 0};
-            int ret = poll(&p, 1, 200);
-            poll_num++;
-            if (ret == -1)
+    // Turns queued output into callbacks. The worker flushes once per signal (one batch or one frame);
+    // the shared loop coalesces wakeups and passes `all` to empty the queue.
+    void flush(Napi::Env env, Napi::Function callback, bool all)
+    {
+        deliver(env, callback, all);
+        settle_pulls(env);
+        settle_flushes(env);
+    }
+
+    // The callbacks part of flush().
+    void deliver(Napi::Env env, Napi::Function callback, bool all)
+    {
+        if (!callback.IsEmpty())
+        {
+            std::deque<std::string> errors;
+            std::deque<std::shared_ptr<mp4_fragment_t>> fragments;
+            std::deque<std::shared_ptr<rtp_batch_t>> batches;
+            bool drain = false;
             {
-                std::cerr << std::strerror(errno) << std::endl;
-                if (errno == EINTR)
-                    continue;
-                SetError("unexpected errno " + std::to_string(errno) + " from poll");
-                break;
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                errors.swap(pending_errors);
+                fragments.swap(pending_fragments);
+                batches.swap(pending_rtp);
+                std::swap(drain, drain_pending);
             }
-            // std::cout << "poll result: " << ret << std::endl;
-            if (p.revents & POLLIN)
+            Napi::HandleScope scope(env);
+            for (const std::string &error : errors)
+                callback.Call({Napi::String::New(env, error)});
+            for (const std::shared_ptr<mp4_fragment_t> &fragment : fragments)
             {
-                struct v4l2_buffer buf;
-                struct v4l2_plane out_planes;
-                buf.memory = output_mem_type;
-                buf.length = 1;
-                memset(&out_planes, 0, sizeof(out_planes));
-                buf.m.planes = &out_planes;
-                // 将output buffer出列
-                buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-                ioctl(fd, VIDIOC_DQBUF, &buf);
-                // 将capture buffer出列
-                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-                buf.memory = V4L2_MEMORY_MMAP;
-                buf.length = 1;
-                memset(&out_planes, 0, sizeof(out_planes));
-                buf.m.planes = &out_planes;
-                ioctl(fd, VIDIOC_DQBUF, &buf);
-                // 提取capture buffer里的编码数据，即H264数据
-                uint32_t encoded_len = buf.m.planes[0].bytesused;
-                if (encoded_len > 0)
-                {
-                    long long current = millis();
-                    // std::cout << fd << "--encoded frame: " << total_frame << " cost: " << current - feed_time << ", size: " << encoded_len / 1024.0 << std::endl;
-                    total_frame++;
-                    total_size += encoded_len;
-                    if (file != NULL)
-                    {
-                        size_t ret = fwrite(capture.start, sizeof(uint8_t), encoded_len, file);
-                        if (ret < 0)
-                        {
-                            printf("write file error: %s \n", strerror(errno));
-                        }
-                    }
-                    if (invoke_callback && !Callback().IsEmpty())
-                    {
-                        FrameType frame_data = new frame_data_t{encoded_len, (uint8_t *)capture.start};
-                        progress.Send(&frame_data, sizeof(frame_data_t));
-                    }
-                    else
-                    {
-                        // std::cout << "encoded size: " << encoded_len << std::endl;
-                    }
-                }
-                // 将capture buffer入列
-                if (ioctl(fd, VIDIOC_QBUF, capture.inner) < 0)
+                Napi::Object payload = Napi::Object::New(env);
+                payload.Set("fragment", fragment->init ? "init" : "media");
+                payload.Set("data", wrap(env, fragment, fragment->data, fragment->size));
+                payload.Set("segment", fragment->segment);
+                payload.Set("sequence", fragment->sequence);
+                payload.Set("decodeTime", (double)fragment->decode_time);
+                payload.Set("duration", (double)fragment->duration);
+                tag(payload);
+                callback.Call({env.Null(), env.Null(), payload});
+            }
+            for (const std::shared_ptr<rtp_batch_t> &batch : batches)
+            {
+                Napi::Uint32Array packets = Napi::Uint32Array::New(env, batch->packets.size());
+                memcpy(packets.Data(), batch->packets.data(), batch->packets.size() * sizeof(uint32_t));
+                Napi::Object payload = Napi::Object::New(env);
+                payload.Set("rtp", wrap(env, batch, batch->data.data(), batch->data.size()));
+                payload.Set("packets", packets);
+                payload.Set("timestamp", batch->timestamp);
+                payload.Set("keyframe", batch->keyframe);
+                tag(payload);
+                callback.Call({env.Null(), env.Null(), payload});
+            }
+            if (drain)
+                callback.Call({env.Null(), Napi::String::New(env, "drain")});
+        }
+        // frames wait for pull()
+        if (pull)
+            return;
+        if (callback.IsEmpty() || !invoke_callback)
+        {
+            // IMPORTANT: Free the data even if we don't call back to JS.
+            session->stats.frames_dropped.fetch_add(take_pending(UINT32_MAX).size(), std::memory_order_relaxed);
+            return;
+        }
+        Napi::HandleScope scope(env);
+        do
+        {
+            if (batch)
+            {
+                // Every queued frame signals once; whatever an earlier call already took is simply gone.
+                std::vector<std::shared_ptr<frame_data_t>> frames = take_pending(max_batch_frames);
+                if (frames.empty())
+                    return;
+                delivered(frames);
+                Napi::Array payload = Napi::Array::New(env, frames.size());
+                for (uint32_t i = 0; i < frames.size(); i++)
+                    payload.Set(i, frame_payload(env, frames[i]));
+                callback.Call({env.Null(), env.Null(), payload});
+                continue;
+            }
+            std::vector<std::shared_ptr<frame_data_t>> frames = take_pending(1);
+            if (frames.empty())
+                return;
+            delivered(frames);
+            for (std::shared_ptr<frame_data_t> &frame : frames)
+            {
+                size_t count = split(frame);
+                for (size_t i = 0; i < count; i++)
                 {
-                    SetError("failed to re-queue encoded buffer");
-                    break;
+                    const nalu_t &nalu = nalus[i];
+                    Napi::Object payload = Napi::Object::New(env);
+                    payload.Set("nalu", nalu.type);
+                    payload.Set("data", wrap(env, frame, frame->data + nalu.offset, nalu.size));
+                    payload.Set("keyframe", frame->keyframe);
+                    describe(payload, *frame);
+                    callback.Call({env.Null(), env.Null(), payload});
                 }
             }
+        } while (all);
+    }
+};
+
+// Runs one encoder's poll loop on a libuv threadpool thread, for the default (non-shared) mode.
+class EncoderWorker : public AsyncProgressQueueWorker<FrameType>
+{
+  public:
+    std::shared_ptr<EncoderSession> session;
+    std::shared_ptr<EncoderOutput> output;
+
+    EncoderWorker(Napi::Function callback, std::shared_ptr<EncoderSession> session, std::shared_ptr<EncoderOutput> output)
+        : AsyncProgressQueueWorker(callback), session(std::move(session)), output(std::move(output))
+    {
+    }
+
+    void Execute(const ExecutionProgress &progress)
+    {
+        std::string error;
+        while (!session->stopped)
+        {
+            bool ok = session->wait(
+                200,
+                [&](std::shared_ptr<frame_data_t> frame_data) {
+                    output->push(std::move(frame_data));
+                    progress.Signal();
+                },
+                error);
+            if (!ok)
+            {
+                SetError(error);
+                break;
+            }
+            if (output->collect())
+                progress.Signal();
         }
+        // stop() flushed the last, partial GOP
+        if (output->collect())
+            progress.Signal();
     }
 
-    void feed(uint8_t *plane_data, uint32_t size)
+    void OnError(const Error &e)
     {
-        std::lock_guard<std::mutex> lock(operation_mutex);
-        if (stopped)
-            return;
-        // uint32_t size = data.Get("size").As<Napi::Number>().Uint32Value();
-        // uint8_t *plane_data = (uint8_t *)data.Get("data").As<Napi::ArrayBuffer>().Data();
-        memcpy(output.start, plane_data, size);
-        ioctl(fd, VIDIOC_QBUF, output.inner);
+        HandleScope scope(Env());
+        output->settle_pulls(Env());
+        output->settle_flushes(Env());
+        Callback().Call({String::New(Env(), e.Message())});
+    }
+    void OnOK()
+    {
+        HandleScope scope(Env());
+        output->settle_pulls(Env());
+        output->settle_flushes(Env());
+        Callback().Call({Env().Null(), String::New(Env(), "Ok")});
     }
 
-    void feed(int _fd, uint32_t size)
+    void OnProgress(const FrameType *, size_t)
     {
-        std::lock_guard<std::mutex> lock(operation_mutex);
+        output->flush(Env(), Callback().Value(), false);
+    }
+};
 
-        if (stopped)
-            return;
-        v4l2_buffer buf = {};
-        v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-        buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        buf.index = 0;
-        buf.field = V4L2_FIELD_NONE;
-        buf.memory = V4L2_MEMORY_DMABUF;
-        buf.length = 1;
-        buf.m.planes = planes;
-        buf.m.planes[0].m.fd = _fd;
-        buf.m.planes[0].bytesused = size;
-        buf.m.planes[0].length = size;
-        ioctl(fd, VIDIOC_QBUF, &buf);
-        feed_time = millis();
-        // std::cout << fd << "--feed frame: " << total_frame << " at: " << feed_time << std::endl;
-    }
-
-    int setController(Napi::Object ctrl_obj)
-    {
-        auto id = ctrl_obj.Get("id").As<Napi::Number>().Uint32Value();
-        auto value = ctrl_obj.Get("value").As<Napi::Number>().Int32Value();
-        auto code = ctrl_obj.Get("code").As<Napi::Number>().Uint32Value();
-        v4l2_control ctrl = {};
-        ctrl.id = id;
-        ctrl.value = value;
-        return ioctl(fd, code, &ctrl);
-    }
-
-    void stop()
-    {
-        std::lock_guard<std::mutex> lock(operation_mutex);
-
-        if (stopped)
-            return;
-        stopped = true;
+class SharedDispatcher;
 
-        // usleep(2000 * 1000);
-        if (fd >= 0)
-        {
-            int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-            ioctl(fd, VIDIOC_STREAMOFF, &type);
-            type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-            ioctl(fd, VIDIOC_STREAMOFF, &type);
+// An encoder in shared mode: served by the process-wide EncoderLoop instead of a worker of its own.
+class SharedEncoder : public std::enable_shared_from_this<SharedEncoder>
+{
+  public:
+    std::shared_ptr<EncoderSession> session;
+    std::shared_ptr<EncoderOutput> output;
+    Napi::FunctionReference callback;
+    SharedDispatcher *dispatcher = nullptr;
+    std::shared_ptr<EncoderLoop> loop = EncoderLoop::shared();
+    uint64_t loop_id = 0;
+    // the session's wake_fd, for control changes
+    uint64_t wake_id = 0;
+    // loop thread only: the device is unwatched while a full 'block' queue holds the encoder
+    bool loop_paused = false;
+    // set once the stream ended; the next dispatch reports it like the worker's OnOK/OnError
+    std::atomic<bool> finished = false;
+    std::string fatal_error;
+    // JS thread only: the end was reported, or the encoder was collected first
+    bool reported = false;
+
+    static std::shared_ptr<SharedEncoder> start(Napi::Env env, Napi::Function callback, std::shared_ptr<EncoderSession> session, std::shared_ptr<EncoderOutput> output,
+                                                std::string &error);
+    void stop();
+    void detach(Napi::Env env);
+};
 
-            // Unmap buffers
-            if (capture.start)
-                munmap(capture.start, capture.length);
-            if (output.start)
-                munmap(output.start, output.length);
+// Runs the callbacks of every shared encoder of one JS environment through a single threadsafe function.
+class SharedDispatcher
+{
+  public:
+    Napi::ThreadSafeFunction tsfn;
+    std::mutex mutex;
+    // encoders with output for JS, in the order they became ready
+    std::vector<std::shared_ptr<SharedEncoder>> ready;
+    // JS thread only: running shared encoders; the tsfn keeps the event loop alive while there are any
+    uint32_t active = 0;
 
-            struct v4l2_requestbuffers buf = {};
-            buf.count = 0; // Request to free buffers
-            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-            buf.memory = output_mem_type;
-            ioctl(fd, VIDIOC_REQBUFS, &buf);
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-            ioctl(fd, VIDIOC_REQBUFS, &buf);
+    static SharedDispatcher *of(Napi::Env env)
+    {
+        SharedDispatcher *dispatcher = env.GetInstanceData<SharedDispatcher>();
+        if (dispatcher)
+            return dispatcher;
+        dispatcher = new SharedDispatcher();
+        // The environment closes the tsfn on teardown.
+        dispatcher->tsfn = Napi::ThreadSafeFunction::New(env, Napi::Function::New(env, [](const Napi::CallbackInfo &) {}), "H264EncoderLoop", 0, 1);
+        dispatcher->tsfn.Unref(env);
+        env.SetInstanceData(dispatcher);
+        return dispatcher;
+    }
 
-            close(fd);
-            fd = -1;
+    // Called from the loop thread. A single call into JS covers every encoder that gets ready before it runs.
+    void schedule(std::shared_ptr<SharedEncoder> encoder)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(std::move(encoder));
+            if (ready.size() > 1)
+                return;
         }
+        tsfn.NonBlockingCall([this](Napi::Env env, Napi::Function) { dispatch(env); });
+    }
 
-        if (file)
+    void dispatch(Napi::Env env)
+    {
+        std::vector<std::shared_ptr<SharedEncoder>> encoders;
         {
-            fclose(file);
+            std::lock_guard<std::mutex> lock(mutex);
+            encoders.swap(ready);
         }
-        if (1)
+        for (std::shared_ptr<SharedEncoder> &encoder : encoders)
         {
-            std::cout << "total frame: " << total_frame << ", total size: " << total_size / 1024.0 / 1024.0 << ", poll num: " << poll_num << std::endl;
+            if (encoder->reported)
+                continue;
+            Napi::Function callback = encoder->callback.IsEmpty() ? Napi::Function() : encoder->callback.Value();
+            encoder->output->flush(env, callback, true);
+            if (!encoder->finished)
+                continue;
+            encoder->loop->remove(encoder->loop_id);
+            encoder->loop->remove(encoder->wake_id);
+            encoder->reported = true;
+            retire(env);
+            if (callback.IsEmpty())
+                continue;
+            Napi::HandleScope scope(env);
+            if (encoder->fatal_error.empty())
+                callback.Call({env.Null(), Napi::String::New(env, "Ok")});
+            else
+                callback.Call({Napi::String::New(env, encoder->fatal_error)});
         }
     }
-    void OnError(const Error &e)
+
+    void enlist(Napi::Env env)
     {
-        HandleScope scope(Env());
-        Callback().Call({String::New(Env(), e.Message())});
+        if (active++ == 0)
+            tsfn.Ref(env);
     }
-    void OnOK()
+
+    void retire(Napi::Env env)
     {
-        HandleScope scope(Env());
-        Callback().Call({Env().Null(), String::New(Env(), "Ok")});
+        if (active > 0 && --active == 0)
+            tsfn.Unref(env);
     }
-    void OnProgress(const FrameType *data, size_t t)
+};
+
+Napi::Object histogram(Napi::Env env, const latency_histogram_t &h)
+{
+    Napi::Object result = Napi::Object::New(env);
+    uint64_t count = h.count.load(std::memory_order_relaxed);
+    result.Set("count", (double)count);
+    result.Set("meanUs", count ? (double)h.sum_us.load(std::memory_order_relaxed) / count : 0.0);
+    result.Set("p50Us", (double)h.percentile(0.50));
+    result.Set("p90Us", (double)h.percentile(0.90));
+    result.Set("p99Us", (double)h.percentile(0.99));
+    result.Set("maxUs", (double)h.max_us.load(std::memory_order_relaxed));
+    // buckets[i] counts samples in [2^i, 2^(i+1)) us
+    Napi::Array buckets = Napi::Array::New(env, latency_histogram_t::BUCKETS);
+    for (int i = 0; i < latency_histogram_t::BUCKETS; i++)
+        buckets.Set(i, (double)h.buckets[i].load(std::memory_order_relaxed));
+    result.Set("buckets", buckets);
+    return result;
+}
+
+// Counters and latency histograms of one session, for stats().
+Napi::Object session_stats(Napi::Env env, EncoderSession &session)
+{
+    const encoder_stats_t &s = session.stats;
+    auto load = [](const std::atomic<uint64_t> &counter) { return (double)counter.load(std::memory_order_relaxed); };
+    // time since the last event, -1 if it never happened
+    uint64_t now = monotonic_us();
+    auto age = [&](const std::atomic<uint64_t> &at) {
+        uint64_t us = at.load(std::memory_order_relaxed);
+        return us ? (double)(now - us) / 1000 : -1.0;
+    };
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("device", session.device_path);
+    result.Set("inputMemory", session.input_pool ? input_memory_name(session.input_pool->memory) : "copy");
+    result.Set("framesFed", load(s.frames_fed));
+    result.Set("feedRejected", load(s.feed_rejected));
+    result.Set("feedDropped", load(s.feed_dropped));
+    result.Set("framesEncoded", load(s.frames_encoded));
+    result.Set("framesDelivered", load(s.frames_delivered));
+    result.Set("framesDropped", load(s.frames_dropped));
+    result.Set("queueDropped", load(s.queue_dropped));
+    result.Set("bytesIn", load(s.bytes_in));
+    result.Set("bytesOut", load(s.bytes_out));
+    result.Set("bytesCopied", load(s.bytes_copied));
+    result.Set("pollWakeups", load(s.poll_wakeups));
+    result.Set("usefulWakeups", load(s.useful_wakeups));
+    result.Set("outputsQueued", s.outputs_queued.load(std::memory_order_relaxed));
+    result.Set("outputBuffers", (uint32_t)session.config.output_buffer_count);
+    {
+        std::lock_guard<std::mutex> lock(session.captures->mutex);
+        result.Set("capturesLent", session.captures->lent_count);
+    }
+    result.Set("pendingFrames", s.pending_frames.load(std::memory_order_relaxed));
+    uint32_t bitrate;
+    uint32_t framerate;
+    {
+        // the encoder thread applies control changes under this lock
+        std::lock_guard<std::mutex> lock(session.operation_mutex);
+        bitrate = session.config.bitrate_bps;
+        framerate = session.config.framerate;
+    }
+    result.Set("bitrate", bitrate);
+    result.Set("framerate", framerate);
     {
-        if (Callback().IsEmpty() || !invoke_callback)
+        std::lock_guard<std::mutex> lock(session.controls_mutex);
+        if (session.rate_controller)
         {
-            // IMPORTANT: Free the data even if we don't call back to JS.
-            delete *data;
+            Napi::Object rate = Napi::Object::New(env);
+            rate.Set("target", session.rate_controller->target);
+            rate.Set("measured", session.rate_controller->measured);
+            rate.Set("limit", session.rate_controller->limit);
+            result.Set("rateControl", rate);
+        }
+    }
+    result.Set("framePoolHits", load(session.frame_pool->hits));
+    result.Set("framePoolMisses", load(session.frame_pool->misses));
+    result.Set("framePoolBytes", load(session.frame_pool->pooled_bytes));
+    result.Set("gopCacheBytes", (double)session.gop_cache.bytes());
+    if (session.file_sink)
+    {
+        result.Set("fileFramesWritten", load(session.file_sink->frames_written));
+        result.Set("fileBytesWritten", load(session.file_sink->bytes_written));
+        result.Set("fileFramesDropped", load(session.file_sink->frames_dropped));
+    }
+    if (session.rtp_sink)
+    {
+        result.Set("rtpSsrc", session.rtp_sink->packetizer.ssrc);
+        result.Set("rtpPacketsSent", load(session.rtp_sink->packets_sent));
+        result.Set("rtpBytesSent", load(session.rtp_sink->bytes_sent));
+        result.Set("rtpPacketsDropped", load(session.rtp_sink->packets_dropped));
+    }
+    result.Set("msSinceLastFeed", age(s.last_feed_us));
+    result.Set("msSinceLastFrame", age(s.last_frame_us));
+    result.Set("encodeLatency", histogram(env, s.encode_latency));
+    result.Set("deliveryLatency", histogram(env, s.delivery_latency));
+    return result;
+}
+
+// Registers `session` with the shared loop. The handler runs on the loop thread and wakes JS only when there is
+// output, through the environment's dispatcher. Returns null and sets `error` if the loop refuses the fd.
+std::shared_ptr<SharedEncoder> SharedEncoder::start(Napi::Env env, Napi::Function callback, std::shared_ptr<EncoderSession> session, std::shared_ptr<EncoderOutput> output,
+                                                    std::string &error)
+{
+    auto shared = std::make_shared<SharedEncoder>();
+    shared->session = session;
+    shared->output = output;
+    if (!callback.IsEmpty())
+        shared->callback = Napi::Persistent(callback);
+    shared->dispatcher = SharedDispatcher::of(env);
+    std::weak_ptr<SharedEncoder> weak = shared;
+    shared->loop_id = shared->loop->add(session->device->poll_fd(), (uint16_t)session->device->poll_events(), [weak](uint32_t events) {
+        std::shared_ptr<SharedEncoder> encoder = weak.lock();
+        // after a fatal error the fd stays ready until the JS thread unregisters it
+        if (!encoder || encoder->finished)
             return;
+        encoder->session->stats.poll_wakeups.fetch_add(1, std::memory_order_relaxed);
+        bool ready = false;
+        std::string error;
+        bool ok = encoder->session->service(
+            events,
+            [&](std::shared_ptr<frame_data_t> frame_data) {
+                encoder->output->push(std::move(frame_data));
+                ready = true;
+            },
+            error);
+        ready = encoder->output->collect() || ready;
+        if (!ok)
+        {
+            encoder->fatal_error = error;
+            encoder->finished = true;
         }
-        HandleScope scope(Env());
-        uint8_t *buf = (*data)->data;
-        uint32_t size = (*data)->size;
-        uint32_t start_post = 0;
-        uint32_t len = size;
-        int nal_type = -1;
-        uint32_t last_pos = 0;
-        if (size > 4)
-        {
-            uint8_t prefix[4] = {0x00, 0x00, 0x00, 0x01};
-            uint32_t k = 0;
-            std::vector<uint8_t *> pos_vec;
-            for (;;)
-            {
-                uint8_t *pos = (uint8_t *)memmem(buf + k, size - k, prefix, 4);
-                if (pos == NULL)
-                    break;
-                pos_vec.push_back((uint8_t *)(pos));
-                k = pos - buf + 4;
-            }
-            for (int i = 0; i < pos_vec.size(); i++)
+        // the device stays ready while captures are held back; resume_captures() wakes the handler below
+        else if (encoder->session->captures_paused.load(std::memory_order_acquire) && !encoder->loop_paused)
+        {
+            encoder->loop_paused = encoder->loop->set_events(encoder->loop_id, 0);
+        }
+        if (ready || !ok)
+            encoder->dispatcher->schedule(encoder);
+    });
+    if (shared->loop_id)
+    {
+        shared->wake_id = shared->loop->add(session->wake_fd, EPOLLIN, [weak](uint32_t) {
+            std::shared_ptr<SharedEncoder> encoder = weak.lock();
+            if (!encoder || encoder->finished)
+                return;
+            encoder->session->service_controls();
+            if (encoder->loop_paused && !encoder->session->captures_paused.load(std::memory_order_acquire))
             {
-                size_t len = i == pos_vec.size() - 1 ? size - (pos_vec[i] - buf) : pos_vec[i + 1] - pos_vec[i];
-                Napi::Buffer<uint8_t> buffer = Napi::Buffer<uint8_t>::Copy(Env(), pos_vec[i], len);
-                Napi::Object payload = Napi::Object::New(Env());
-                nal_type = (int)(pos_vec[i][4]) & 0x1f;
-                payload.Set("nalu", nal_type);
-                payload.Set("data", buffer);
-                std::cout << "nalu type: " << nal_type << ", size:  " << len << std::endl;
-                Callback().Call({Env().Null(), Env().Null(), payload});
+                encoder->loop->set_events(encoder->loop_id, (uint16_t)encoder->session->device->poll_events());
+                encoder->loop_paused = false;
             }
-
-            // uint32_t i = 0;
-            // for (;;)
-            // {
-            //     int current_type = -1;
-            //     uint8_t skip_len = 1;
-            //     if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 0 && buf[i + 3] == 1)
-            //     {
-            //         current_type = (int)(buf[i + 4]) & 0x1f;
-            //         skip_len = 4;
-            //     }
-            //     if (buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1)
-            //     {
-            //         current_type = (int)(buf[i + 3] & 0x1f);
-            //         skip_len = 3;
-            //     }
-            //     if (current_type < 0 && buf[i + 1] != 0)
-            //     {
-            //         skip_len++;
-            //     }
-            //     if (current_type < 0 && buf[i + 2] != 0)
-            //     {
-            //         skip_len++;
-            //     }
-            //     // find a new nalu or at end
-            //     if (current_type >= 0 || (size - i) <= 4)
-            //     {
-            //         // end previous nalu data or last nalu data
-            //         if (nal_type >= 0)
-            //         {
-            //             auto len = (size - i) <= 4 ? size - last_pos : i - last_pos;
-            //             uint8_t *seg_buf = new uint8_t[len];
-            //             memcpy(seg_buf, buf + last_pos, len);
-            //             Napi::ArrayBuffer buffer = Napi::ArrayBuffer::New(Env(), seg_buf, len, [](Napi::Env env, void *arg) { delete[] arg; });
-            //             Napi::Object payload = Napi::Object::New(Env());
-            //             payload.Set("nalu", nal_type);
-            //             payload.Set("data", buffer);
-            //             Callback().Call({Env().Null(), Env().Null(), payload});
-            //         }
-            //         // find new nalu
-            //         if (current_type >= 0)
-            //         {
-            //             nal_type = current_type;
-            //             last_pos = i;
-            //         }
-            //         else
-            //         {
-            //             // at end
-            //             break;
-            //         }
-            //     }
-            //     i += skip_len;
-            // }
-        }
-        // Free the frame_data_t object allocated in Execute().
-        // The data pointer inside frame_data_t points to mmap'd memory and must not be freed.
-        // Only the container struct itself, which was allocated with `new`, should be deleted.
-        delete *data;
+            if (encoder->output->collect())
+                encoder->dispatcher->schedule(encoder);
+        });
     }
+    if (shared->loop_id == 0 || shared->wake_id == 0)
+    {
+        error = "Failed to add encoder to the shared loop: " + std::string(strerror(errno));
+        shared->loop->remove(shared->loop_id);
+        return nullptr;
+    }
+    shared->dispatcher->enlist(env);
+    return shared;
+}
+
+// Unregisters from the loop, stops the session and lets the dispatcher deliver the rest
+// (the fragments of the last GOP) followed by the final "Ok".
+void SharedEncoder::stop()
+{
+    if (finished.exchange(true))
+        return;
+    loop->remove(loop_id);
+    loop->remove(wake_id);
+    SessionPool::shared()->stop(session);
+    output->collect();
+    dispatcher->schedule(shared_from_this());
+}
+
+// The JS object is being collected: no more callbacks, whatever is still queued.
+void SharedEncoder::detach(Napi::Env env)
+{
+    loop->remove(loop_id);
+    loop->remove(wake_id);
+    if (reported)
+        return;
+    reported = true;
+    dispatcher->retire(env);
+}
+
+// What an ArrayBuffer from acquireInput() holds: the pool behind its memory, and where to give its slot back.
+struct input_lease_t
+{
+    std::shared_ptr<InputPool> pool;
+    std::weak_ptr<EncoderSession> session;
+    uint32_t index;
+    uint32_t lease;
 };
 
 class H264Encoder : public Napi::ObjectWrap<H264Encoder>
 {
   public:
     static Napi::FunctionReference *constructor;
-    EncoderWorker *worker;
+    // The worker deletes itself once it completes, so the encoder only keeps the session.
+    std::shared_ptr<EncoderSession> session;
+    // set in shared mode (the `sharedLoop` option) instead of running a worker
+    std::shared_ptr<SharedEncoder> shared;
+    // JS thread only, for getGopSnapshot(): shares the NALU table with the callbacks
+    std::shared_ptr<EncoderOutput> output;
 
     H264Encoder(const Napi::CallbackInfo &info) : Napi::ObjectWrap<H264Encoder>(info)
     {
         Napi::Object option = info[0].As<Napi::Object>();
         Napi::Function callback = info[1].As<Napi::Function>();
         Napi::HandleScope scope(info.Env());
-        worker = new EncoderWorker(option, callback);
-        // Check if initialization failed inside the worker's constructor
-        if (!worker->init_error_msg.empty())
-        {
-            std::string errMsg = worker->init_error_msg;
-            // The worker itself will be cleaned up by the ObjectWrap finalizer,
-            // but we must not queue it.
-            delete worker; // Clean up the partially constructed worker
-            worker = nullptr;
-            Napi::Error::New(info.Env(), errMsg).ThrowAsJavaScriptException();
+        // a session warmed by warmSessions() if one matches, else the device is set up right here
+        std::string error;
+        session = SessionPool::shared()->open(parse_config(option), error);
+        if (!session)
+        {
+            Napi::Error::New(info.Env(), error).ThrowAsJavaScriptException();
             return;
         }
-        worker->Queue();
+        output = std::make_shared<EncoderOutput>(session, option);
+        // Without a callback there is nobody to hand frames to; only the file writer needs them then.
+        session->deliver_frames = output->invoke_callback && !callback.IsEmpty();
+        if (!option.Get("sharedLoop").IsBoolean() || !option.Get("sharedLoop").As<Napi::Boolean>())
+        {
+            (new EncoderWorker(callback, session, output))->Queue();
+            return;
+        }
+        shared = SharedEncoder::start(info.Env(), callback, session, output, error);
+        if (!shared)
+        {
+            session->stop();
+            Napi::Error::New(info.Env(), error).ThrowAsJavaScriptException();
+        }
     }
 
     ~H264Encoder()
     {
-        if (worker)
-        {
-            // The worker is an AsyncWorker, N-API will delete it.
-            // However, we must ensure stop() is called to release V4L2 resources.
-            worker->stop();
-        }
+        // The worker is an AsyncWorker, N-API will delete it.
+        // However, we must ensure stop() is called to release V4L2 resources.
+        if (shared)
+            shared->detach(Env());
+        if (session)
+            SessionPool::shared()->stop(session);
     }
     Napi::Value feed(const Napi::CallbackInfo &info)
     {
         Napi::Value param = info[0].As<Napi::Value>();
+        int ret = -1;
+        frame_meta_t meta;
+        if (!parse_meta(info[2], info[3], meta))
+            return info.Env().Undefined();
         if (param.IsArrayBuffer())
         {
             uint8_t *plane_data = (uint8_t *)param.As<Napi::ArrayBuffer>().Data();
-            worker->feed(plane_data, info[1].As<Napi::Number>().Uint32Value());
+            ret = session->feed(plane_data, info[1].As<Napi::Number>().Uint32Value(), meta);
         }
         else if (param.IsNumber())
         {
-            worker->feed(param.As<Napi::Number>().Int32Value(), info[1].As<Napi::Number>().Uint32Value());
+            ret = session->feed(param.As<Napi::Number>().Int32Value(), info[1].As<Napi::Number>().Uint32Value(), meta);
         }
 
-        return Napi::Number::New(info.Env(), 0);
+        return Napi::Number::New(info.Env(), ret);
+    }
+
+    // acquireInput(): an ArrayBuffer to write the next frame into and pass to feed(), or null if none is free.
+    // It stays valid (the pool alive) until collected, even after stop(); collected unfed, it gives its slot back.
+    Napi::Value acquireInput(const Napi::CallbackInfo &info)
+    {
+        int index = session->acquire_input();
+        if (index < 0)
+            return info.Env().Null();
+        input_slot_t &slot = session->input_pool->slots[index];
+        return Napi::ArrayBuffer::New(
+            info.Env(), slot.data, slot.length,
+            [](Napi::Env, void *, input_lease_t *lease) {
+                if (std::shared_ptr<EncoderSession> owner = lease->session.lock())
+                    owner->release_input(lease->pool.get(), lease->index, lease->lease);
+                delete lease;
+            },
+            new input_lease_t{session->input_pool, session, (uint32_t)index, slot.lease});
+    }
+
+    // getParameterSets(): { sps, pps } as NAL units without start codes, or null before the first keyframe.
+    Napi::Value getParameterSets(const Napi::CallbackInfo &info)
+    {
+        std::shared_ptr<frame_data_t> sps, pps;
+        if (!session->gop_cache.parameter_sets(sps, pps))
+            return info.Env().Null();
+        Napi::Object result = Napi::Object::New(info.Env());
+        result.Set("sps", EncoderOutput::wrap(info.Env(), sps, sps->data, sps->size));
+        result.Set("pps", EncoderOutput::wrap(info.Env(), pps, pps->data, pps->size));
+        return result;
+    }
+
+    // getGopSnapshot(): the frames from the last IDR on, like batch callbacks deliver them; views of the cached
+    // frames, not copies. Empty without the `gopCacheBytes` option or while the current GOP does not fit.
+    Napi::Value getGopSnapshot(const Napi::CallbackInfo &info)
+    {
+        std::vector<std::shared_ptr<frame_data_t>> frames = session->gop_cache.snapshot();
+        Napi::Array result = Napi::Array::New(info.Env(), frames.size());
+        for (uint32_t i = 0; i < frames.size(); i++)
+            result.Set(i, output->frame_payload(info.Env(), frames[i]));
+        return result;
+    }
+
+    // Raw frames queued to the driver and not yet encoded.
+    Napi::Value inFlight(const Napi::CallbackInfo &info)
+    {
+        return Napi::Number::New(info.Env(), session->stats.outputs_queued.load(std::memory_order_relaxed));
+    }
+
+    Napi::Value release(const Napi::CallbackInfo &info)
+    {
+        bool released = false;
+        if (info[0].IsTypedArray())
+        {
+            Napi::TypedArray view = info[0].As<Napi::TypedArray>();
+            Napi::ArrayBuffer array_buffer = view.ArrayBuffer();
+            released = session->captures->give_back((uint8_t *)array_buffer.Data() + view.ByteOffset());
+            // The slot belongs to the driver again; make sure this view can no longer read it.
+            if (released)
+                array_buffer.Detach();
+        }
+        return Napi::Boolean::New(info.Env(), released);
     }
 
+    Napi::Value stats(const Napi::CallbackInfo &info)
+    {
+        return session_stats(info.Env(), *session);
+    }
+
+    // Stops the stream; the device goes back to the session pool if its profile was warmed and is short of idle sessions.
     Napi::Value stop(const Napi::CallbackInfo &info)
     {
-        worker->stop();
+        if (shared)
+            shared->stop();
+        else
+            SessionPool::shared()->stop(session);
         return Napi::Number::New(info.Env(), 0);
     }
 
+    // flush(): a Promise that resolves once every frame fed so far was encoded and handed to the callback, or
+    // rejects if the encoder stops first. Encoding goes on meanwhile.
+    Napi::Value flush(const Napi::CallbackInfo &info)
+    {
+        Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(info.Env());
+        std::string error;
+        uint64_t drain = session->flush(error);
+        if (drain == 0)
+            deferred.Reject(Napi::Error::New(info.Env(), error).Value());
+        else
+            output->flushes.emplace_back(drain, deferred);
+        return deferred.Promise();
+    }
+
+    // startPull({ capacity, overflow }?): from now on frames are handed out by pull() instead of the callback,
+    // from a queue of `capacity` frames (0 for no limit) that applies `overflow` when full.
+    Napi::Value startPull(const Napi::CallbackInfo &info)
+    {
+        Napi::Object option = info[0].IsObject() ? info[0].As<Napi::Object>() : Napi::Object::New(info.Env());
+        output->set_queue(option.Get("capacity"), option.Get("overflow"));
+        output->pull = true;
+        session->deliver_frames = true;
+        return info.Env().Undefined();
+    }
+
+    // pull(): a Promise of the next EncodedFrame (as batch callbacks deliver them), or of null once the encoder
+    // stopped and every frame was pulled.
+    Napi::Value pull(const Napi::CallbackInfo &info)
+    {
+        Napi::Promise::Deferred deferred = Napi::Promise::Deferred::New(info.Env());
+        output->pulls.push_back(deferred);
+        output->settle_pulls(info.Env());
+        return deferred.Promise();
+    }
+
+    // reconfigure(option): new width, height, pixel_format, bytesperline, level, inputFormat, inputStride, bitrate
+    // or framerate on the same device; throws if the encoder refused them.
+    Napi::Value reconfigure(const Napi::CallbackInfo &info)
+    {
+        std::string error = session->reconfigure(parse_config(info[0].As<Napi::Object>(), session->current_config()));
+        if (!error.empty())
+            Napi::Error::New(info.Env(), error).ThrowAsJavaScriptException();
+        return info.Env().Undefined();
+    }
+
+    // The typed controls below are queued and applied by the encoder thread between frames; a failure is
+    // reported through the callback.
+    Napi::Value requestKeyframe(const Napi::CallbackInfo &info)
+    {
+        session->request_keyframe();
+        return info.Env().Undefined();
+    }
+
+    Napi::Value setBitrate(const Napi::CallbackInfo &info)
+    {
+        session->set_bitrate(info[0].As<Napi::Number>().Uint32Value());
+        return info.Env().Undefined();
+    }
+
+    Napi::Value setGop(const Napi::CallbackInfo &info)
+    {
+        session->set_gop(info[0].As<Napi::Number>().Int32Value());
+        return info.Env().Undefined();
+    }
+
+    Napi::Value setFramerate(const Napi::CallbackInfo &info)
+    {
+        session->set_framerate(info[0].As<Napi::Number>().Uint32Value());
+        return info.Env().Undefined();
+    }
+
+    // reportThroughput(bps): what the network currently carries; caps the rate controller's goal.
+    Napi::Value reportThroughput(const Napi::CallbackInfo &info)
+    {
+        session->report_throughput(info[0].As<Napi::Number>().Uint32Value());
+        return info.Env().Undefined();
+    }
+
     Napi::Value setController(const Napi::CallbackInfo &info)
     {
         Napi::Object data = info[0].As<Napi::Object>();
         Napi::HandleScope scope(info.Env());
-        int ret = worker->setController(data);
+        auto id = data.Get("id").As<Napi::Number>().Uint32Value();
+        auto value = data.Get("value").As<Napi::Number>().Int32Value();
+        auto code = data.Get("code").As<Napi::Number>().Uint32Value();
+        int ret = session->set_control(code, id, value);
         return Napi::Number::New(info.Env(), Napi::Number::New(info.Env(), ret));
     }
     static Napi::Object Init(Napi::Env env, Napi::Object exports)
@@ -664,7 +1249,22 @@ class H264Encoder : public Napi::ObjectWrap<H264Encoder>
         Napi::Function func = DefineClass(env, "H264Encoder",
                                           {
                                               InstanceMethod<&H264Encoder::feed>("feed", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::acquireInput>("acquireInput", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::getParameterSets>("getParameterSets", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::getGopSnapshot>("getGopSnapshot", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::inFlight>("inFlight", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::release>("release", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::stats>("stats", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
                                               InstanceMethod<&H264Encoder::stop>("stop", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::flush>("flush", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::reconfigure>("reconfigure", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::startPull>("startPull", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::pull>("pull", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::requestKeyframe>("requestKeyframe", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::setBitrate>("setBitrate", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::setGop>("setGop", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::setFramerate>("setFramerate", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&H264Encoder::reportThroughput>("reportThroughput", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
                                               InstanceMethod<&H264Encoder::setController>("setController", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
 
                                           });
@@ -673,5 +1273,61 @@ class H264Encoder : public Napi::ObjectWrap<H264Encoder>
         return exports;
     }
 };
+// listDevices(refresh?): the H.264 encoder nodes found on this host and the load this process placed on each.
+Napi::Value list_devices(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    bool refresh = info[0].IsBoolean() && info[0].As<Napi::Boolean>();
+    std::vector<encoder_device_t> devices = refresh ? DeviceRegistry::shared().refresh() : DeviceRegistry::shared().list();
+    Napi::Array result = Napi::Array::New(env, devices.size());
+    for (uint32_t i = 0; i < devices.size(); i++)
+    {
+        Napi::Object device = Napi::Object::New(env);
+        device.Set("path", devices[i].path);
+        device.Set("card", devices[i].card);
+        device.Set("driver", devices[i].driver);
+        device.Set("busInfo", devices[i].bus_info);
+        device.Set("sessions", devices[i].sessions);
+        device.Set("pixelRate", (double)devices[i].pixel_rate);
+        result.Set(i, device);
+    }
+    return result;
+}
+
+// warmSessions(option, count): keeps `count` sessions with the device settings of `option` opened and configured
+// in the background; an H264Encoder with the same settings starts on one of them.
+Napi::Value warm_sessions(const Napi::CallbackInfo &info)
+{
+    SessionPool::shared()->warm(parse_config(info[0].As<Napi::Object>()), info[1].As<Napi::Number>().Uint32Value());
+    return info.Env().Undefined();
+}
+
+// sessionPoolStats(): per warmed profile, the idle sessions and how long encoders took to start with and without one.
+Napi::Value session_pool_stats(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+    Napi::Array result = Napi::Array::New(env);
+    SessionPool::shared()->for_each([&](const SessionPool::profile_t &profile) {
+        Napi::Object entry = Napi::Object::New(env);
+        entry.Set("width", profile.config.width);
+        entry.Set("height", profile.config.height);
+        entry.Set("pixelFormat", profile.config.pixel_format);
+        entry.Set("backend", profile.config.backend);
+        entry.Set("target", profile.target);
+        entry.Set("idle", (uint32_t)profile.idle.size());
+        entry.Set("warming", profile.warming);
+        entry.Set("hits", (double)profile.hits);
+        entry.Set("misses", (double)profile.misses);
+        entry.Set("recycled", (double)profile.recycled);
+        if (!profile.error.empty())
+            entry.Set("error", profile.error);
+        entry.Set("prepareTime", histogram(env, profile.prepare_time));
+        entry.Set("warmStart", histogram(env, profile.warm_start));
+        entry.Set("coldStart", histogram(env, profile.cold_start));
+        result.Set(result.Length(), entry);
+    });
+    return result;
+}
+
 Napi::FunctionReference *H264Encoder::constructor = new Napi::FunctionReference();
 #endif
\ No newline at end of file
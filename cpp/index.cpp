@@ -10,13 +10,20 @@
 #include <thread>
 #include <unistd.h>
 
+#include "encoder_hub.hpp"
 #include "h264_encoder.hpp"
+#include "simulcast_encoder.hpp"
 
 // Initialize native add-on
 Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
 
     H264Encoder::Init(env, exports);
+    SimulcastEncoder::Init(env, exports);
+    EncoderHub::Init(env, exports);
+    exports.Set("listDevices", Napi::Function::New(env, list_devices, "listDevices"));
+    exports.Set("warmSessions", Napi::Function::New(env, warm_sessions, "warmSessions"));
+    exports.Set("sessionPoolStats", Napi::Function::New(env, session_pool_stats, "sessionPoolStats"));
 
     return exports;
 }
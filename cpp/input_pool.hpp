@@ -0,0 +1,154 @@
+#ifndef __INPUT_POOL_H__
+#define __INPUT_POOL_H__
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <linux/videodev2.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// Where the raw frames JS fills in place live.
+enum class input_memory_t
+{
+    // heap memory, copied into the driver's MMAP buffers on feed (the fallback)
+    COPY,
+    // page-aligned heap memory the driver reads directly (V4L2_MEMORY_USERPTR)
+    USERPTR,
+    // memfd pages exported as a dmabuf through /dev/udmabuf (V4L2_MEMORY_DMABUF)
+    DMABUF,
+};
+
+inline const char *input_memory_name(input_memory_t memory)
+{
+    return memory == input_memory_t::USERPTR ? "userptr" : memory == input_memory_t::DMABUF ? "dmabuf" : "copy";
+}
+
+// One natively allocated raw frame buffer.
+struct input_slot_t
+{
+    uint8_t *data = nullptr;
+    size_t length = 0;
+    // DMABUF only
+    int memfd = -1;
+    int dmabuf_fd = -1;
+    // handed to JS by acquire and not fed yet
+    bool acquired = false;
+    // counts acquires, so a collected ArrayBuffer cannot give back the slot of a later one
+    uint32_t lease = 0;
+};
+
+// Raw frame buffers allocated natively and lent to JS as ArrayBuffers, so a frame can be written where the
+// encoder reads it. The pool outlives the session for as long as JS holds one of its ArrayBuffers.
+class InputPool
+{
+  public:
+    input_memory_t memory = input_memory_t::COPY;
+    std::vector<input_slot_t> slots;
+
+    ~InputPool()
+    {
+        for (input_slot_t &slot : slots)
+            release(slot);
+    }
+
+    // Allocates `count` buffers of `length` bytes. Returns false and sets `error` if this kind of memory is unavailable.
+    bool allocate(input_memory_t _memory, uint32_t count, size_t length, std::string &error)
+    {
+        memory = _memory;
+        size_t page = sysconf(_SC_PAGESIZE);
+        length = (length + page - 1) / page * page;
+        slots.resize(count);
+        for (input_slot_t &slot : slots)
+        {
+            slot.length = length;
+            if (!(memory == input_memory_t::DMABUF ? export_memfd(slot, error) : (slot.data = (uint8_t *)aligned_alloc(page, length)) != nullptr))
+            {
+                if (error.empty())
+                    error = "Failed to allocate input buffer: " + std::string(strerror(errno));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Index of the slot starting at `address`, or -1.
+    int find(const uint8_t *address) const
+    {
+        for (uint32_t i = 0; i < slots.size(); i++)
+            if (slots[i].data == address)
+                return i;
+        return -1;
+    }
+
+    // Brackets CPU writes to a dmabuf slot, so the device sees them once the caches are cleaned.
+    void begin_write(uint32_t index)
+    {
+        sync(index, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    }
+    void end_write(uint32_t index)
+    {
+        sync(index, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    }
+
+  private:
+    bool export_memfd(input_slot_t &slot, std::string &error)
+    {
+        // udmabuf wants a sealed memfd, so the pages cannot go away under the device
+        slot.memfd = memfd_create("h264-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (slot.memfd < 0 || ftruncate(slot.memfd, slot.length) < 0 || fcntl(slot.memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+            return false;
+        int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+        if (dev < 0)
+        {
+            error = "Failed to open /dev/udmabuf: " + std::string(strerror(errno));
+            return false;
+        }
+        struct udmabuf_create create = {};
+        create.memfd = slot.memfd;
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.size = slot.length;
+        slot.dmabuf_fd = ioctl(dev, UDMABUF_CREATE, &create);
+        close(dev);
+        if (slot.dmabuf_fd < 0)
+            return false;
+        void *data = mmap(nullptr, slot.length, PROT_READ | PROT_WRITE, MAP_SHARED, slot.memfd, 0);
+        if (data == MAP_FAILED)
+            return false;
+        slot.data = (uint8_t *)data;
+        return true;
+    }
+
+    void sync(uint32_t index, uint64_t flags)
+    {
+        if (memory != input_memory_t::DMABUF || index >= slots.size())
+            return;
+        struct dma_buf_sync sync = {flags};
+        ioctl(slots[index].dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    void release(input_slot_t &slot)
+    {
+        if (slot.memfd >= 0)
+        {
+            if (slot.data)
+                munmap(slot.data, slot.length);
+            if (slot.dmabuf_fd >= 0)
+                close(slot.dmabuf_fd);
+            close(slot.memfd);
+        }
+        else
+        {
+            free(slot.data);
+        }
+        slot = {};
+    }
+};
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef __NALU_H__
+#define __NALU_H__
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NALU_NEON 1
+#endif
+
+// One NAL unit of an Annex B access unit. `offset`/`size` cover the start code as well,
+// so buf + offset is exactly what the encoder emitted for this unit.
+struct nalu_t
+{
+    uint32_t offset;
+    uint32_t size;
+    // 3 (00 00 01) or 4 (00 00 00 01)
+    uint8_t start_code;
+    // nal_unit_type, the low 5 bits of the NAL header
+    uint8_t type;
+    // nal_ref_idc, 0 for units no other picture refers to
+    uint8_t ref_idc;
+};
+
+// Returns the position of the next 00 00 01 at or after `from`, or `size` if there is none.
+using start_code_scanner = size_t (*)(const uint8_t *buf, size_t from, size_t size);
+
+size_t find_start_code_scalar(const uint8_t *buf, size_t from, size_t size)
+{
+    for (size_t i = from; i + 3 <= size; i++)
+    {
+        // buf[i + 2] > 1 lets us skip three bytes at once
+        if (buf[i + 2] > 1)
+        {
+            i += 2;
+            continue;
+        }
+        if (buf[i + 2] == 1 && buf[i + 1] == 0 && buf[i] == 0)
+            return i;
+    }
+    return size;
+}
+
+#if defined(__x86_64__)
+size_t find_start_code_sse2(const uint8_t *buf, size_t from, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = from;
+    for (; i + 18 <= size; i += 16)
+    {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(buf + i + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)), _mm_cmpeq_epi8(b2, one));
+        uint32_t mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return find_start_code_scalar(buf, i, size);
+}
+
+__attribute__((target("avx2"))) size_t find_start_code_avx2(const uint8_t *buf, size_t from, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = from;
+    for (; i + 34 <= size; i += 32)
+    {
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i *)(buf + i + 2));
+        __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)), _mm256_cmpeq_epi8(b2, one));
+        uint32_t mask = _mm256_movemask_epi8(hit);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return find_start_code_sse2(buf, i, size);
+}
+#endif
+
+#ifdef NALU_NEON
+size_t find_start_code_neon(const uint8_t *buf, size_t from, size_t size)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = from;
+    for (; i + 18 <= size; i += 16)
+    {
+        uint8x16_t b0 = vld1q_u8(buf + i);
+        uint8x16_t b1 = vld1q_u8(buf + i + 1);
+        uint8x16_t b2 = vld1q_u8(buf + i + 2);
+        uint8x16_t hit = vandq_u8(vandq_u8(vceqq_u8(b0, zero), vceqq_u8(b1, zero)), vceqq_u8(b2, one));
+        // NEON has no movemask: narrow every byte to a nibble, giving a 64-bit mask with 4 bits per lane.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask)
+            return i + (__builtin_ctzll(mask) >> 2);
+    }
+    return find_start_code_scalar(buf, i, size);
+}
+#endif
+
+// Picks the widest kernel the running CPU supports.
+start_code_scanner select_start_code_scanner()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_start_code_avx2;
+    return find_start_code_sse2;
+#elif defined(NALU_NEON)
+    return find_start_code_neon;
+#else
+    return find_start_code_scalar;
+#endif
+}
+
+// Splits an Annex B access unit into NAL units using `scan`. Writes at most `capacity` entries to `out`
+// and returns the total number of units found, so a caller can grow its table and retry when it was too small.
+size_t split_nalus(const uint8_t *buf, size_t size, nalu_t *out, size_t capacity, start_code_scanner scan)
+{
+    size_t count = 0;
+    size_t pos = scan(buf, 0, size);
+    while (pos < size)
+    {
+        size_t next = scan(buf, pos + 3, size);
+        if (count < capacity)
+        {
+            // A zero right before 00 00 01 makes it a 4-byte start code; the previous unit then ends one byte earlier.
+            bool long_code = pos > 0 && buf[pos - 1] == 0;
+            size_t start = long_code ? pos - 1 : pos;
+            size_t end = next < size && buf[next - 1] == 0 ? next - 1 : next;
+            uint8_t header = pos + 3 < size ? buf[pos + 3] : 0;
+            nalu_t &nalu = out[count];
+            nalu.offset = start;
+            nalu.size = end - start;
+            nalu.start_code = long_code ? 4 : 3;
+            nalu.type = header & 0x1f;
+            nalu.ref_idc = (header >> 5) & 0x03;
+        }
+        count++;
+        pos = next;
+    }
+    return count;
+}
+
+size_t split_nalus(const uint8_t *buf, size_t size, nalu_t *out, size_t capacity)
+{
+    static const start_code_scanner scan = select_start_code_scanner();
+    return split_nalus(buf, size, out, capacity, scan);
+}
+
+// Whether other pictures may refer to the picture of an Annex B access unit: the nal_ref_idc of its first slice.
+bool is_reference_picture(const uint8_t *buf, size_t size)
+{
+    nalu_t nalus[16];
+    size_t count = split_nalus(buf, size, nalus, 16);
+    for (size_t i = 0; i < count && i < 16; i++)
+    {
+        if (nalus[i].type >= 1 && nalus[i].type <= 5)
+            return nalus[i].ref_idc != 0;
+    }
+    return true;
+}
+
+// Groups the NAL units of a raw Annex B stream into access units, returned as (offset, size) pairs.
+// After a slice, an AUD/SEI/SPS/PPS or a slice with first_mb_in_slice == 0 begins the next access unit.
+// Meant for recorded streams, not for the per-frame path.
+std::vector<std::pair<size_t, size_t>> split_access_units(const uint8_t *buf, size_t size)
+{
+    std::vector<nalu_t> nalus(size / 4 + 1);
+    size_t count = split_nalus(buf, size, nalus.data(), nalus.size());
+    std::vector<std::pair<size_t, size_t>> units;
+    bool after_slice = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        const nalu_t &nalu = nalus[i];
+        bool is_slice = nalu.type >= 1 && nalu.type <= 5;
+        size_t payload = nalu.offset + nalu.start_code + 1;
+        // first_mb_in_slice is ue(v), so it is zero exactly when the first payload bit is set
+        bool first_slice = is_slice && payload < size && (buf[payload] & 0x80);
+        bool starts = units.empty() || nalu.type == 9;
+        if (after_slice && (is_slice ? first_slice : nalu.type >= 6 && nalu.type <= 8))
+            starts = true;
+        if (starts)
+            units.emplace_back(nalu.offset, 0);
+        units.back().second = nalu.offset + nalu.size - units.back().first;
+        after_slice = is_slice;
+    }
+    return units;
+}
+
+// How NAL units are framed when handed to a consumer.
+enum class nalu_format_t
+{
+    // 00 00 00 01 / 00 00 01 start codes, as the encoder emits them
+    ANNEXB,
+    // 4-byte big-endian length before every unit (MP4, WebRTC)
+    AVCC,
+    // bare units; the table alone says where each one starts
+    RAW,
+};
+
+// Rewrites every 4-byte start code of `buf` into the big-endian length of its unit, without moving any data.
+// Returns false (and leaves `buf` untouched) if a 3-byte start code makes that impossible.
+// On success the table describes the AVCC units: offsets/sizes include the length prefix.
+bool annexb_to_avcc_in_place(uint8_t *buf, nalu_t *nalus, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (nalus[i].start_code != 4)
+            return false;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t length = nalus[i].size - 4;
+        uint8_t *prefix = buf + nalus[i].offset;
+        prefix[0] = length >> 24;
+        prefix[1] = length >> 16;
+        prefix[2] = length >> 8;
+        prefix[3] = length;
+    }
+    return true;
+}
+
+// Size of the AVCC form of an access unit split into `nalus`.
+size_t avcc_size(const nalu_t *nalus, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+        size += nalus[i].size - nalus[i].start_code + 4;
+    return size;
+}
+
+// Writes the AVCC form of `buf` to `out` (avcc_size() bytes) and updates the table to describe it.
+void annexb_to_avcc(const uint8_t *buf, nalu_t *nalus, size_t count, uint8_t *out)
+{
+    uint32_t offset = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        nalu_t &nalu = nalus[i];
+        uint32_t length = nalu.size - nalu.start_code;
+        uint8_t *prefix = out + offset;
+        prefix[0] = length >> 24;
+        prefix[1] = length >> 16;
+        prefix[2] = length >> 8;
+        prefix[3] = length;
+        memcpy(prefix + 4, buf + nalu.offset + nalu.start_code, length);
+        nalu.offset = offset;
+        nalu.size = length + 4;
+        nalu.start_code = 4;
+        offset += nalu.size;
+    }
+}
+
+// Narrows the table to the bare units, leaving the buffer as it is.
+void strip_start_codes(nalu_t *nalus, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        nalus[i].offset += nalus[i].start_code;
+        nalus[i].size -= nalus[i].start_code;
+        nalus[i].start_code = 0;
+    }
+}
+
+#endif
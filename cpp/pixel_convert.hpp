@@ -0,0 +1,621 @@
+#ifndef __PIXEL_CONVERT_H__
+#define __PIXEL_CONVERT_H__
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONVERT_NEON 1
+#endif
+
+// Source layouts the feed path can convert to 4:2:0. Byte order as in memory, so RGBA is R first.
+enum class pixel_layout_t
+{
+    RGBA,
+    BGRA,
+    RGB24,
+    YUYV,
+    UYVY,
+};
+
+bool parse_pixel_layout(const std::string &name, pixel_layout_t &layout)
+{
+    static const std::pair<const char *, pixel_layout_t> names[] = {
+        {"rgba", pixel_layout_t::RGBA}, {"bgra", pixel_layout_t::BGRA}, {"rgb24", pixel_layout_t::RGB24}, {"yuyv", pixel_layout_t::YUYV}, {"uyvy", pixel_layout_t::UYVY},
+    };
+    for (auto &[n, l] : names)
+        if (name == n)
+        {
+            layout = l;
+            return true;
+        }
+    return false;
+}
+
+constexpr uint32_t bytes_per_pixel(pixel_layout_t layout)
+{
+    return layout == pixel_layout_t::RGB24 ? 3 : layout == pixel_layout_t::YUYV || layout == pixel_layout_t::UYVY ? 2 : 4;
+}
+
+// Converts two source rows into two luma rows and one chroma row, from pixel `from` (even) to `width` (even).
+// `u`/`v` point at the chroma rows of an I420 picture; for NV12 `u` is the interleaved row and `v` is unused.
+//
+// RGB is BT.601 limited range with 7-bit coefficients, the precision the SIMD multiply-add allows, and chroma
+// is the rounded average of each 2x2 block (vertical pairs first). Every kernel gives the same bytes as the scalar one.
+using row_pair_converter = void (*)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from, uint32_t width, bool nv12);
+
+constexpr bool is_packed_yuv(pixel_layout_t layout)
+{
+    return layout == pixel_layout_t::YUYV || layout == pixel_layout_t::UYVY;
+}
+
+// Byte offsets of R and B within an RGB pixel.
+constexpr int red_at(pixel_layout_t layout)
+{
+    return layout == pixel_layout_t::BGRA ? 2 : 0;
+}
+constexpr int blue_at(pixel_layout_t layout)
+{
+    return layout == pixel_layout_t::BGRA ? 0 : 2;
+}
+
+inline uint8_t average(int a, int b)
+{
+    return (a + b + 1) >> 1;
+}
+
+inline uint8_t rgb_to_y(int r, int g, int b)
+{
+    return ((33 * r + 65 * g + 13 * b + 64) >> 7) + 16;
+}
+inline uint8_t rgb_to_u(int r, int g, int b)
+{
+    return ((56 * b - 37 * g - 19 * r + 64) >> 7) + 128;
+}
+inline uint8_t rgb_to_v(int r, int g, int b)
+{
+    return ((56 * r - 47 * g - 9 * b + 64) >> 7) + 128;
+}
+
+template <pixel_layout_t L>
+void convert_row_pair_scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from, uint32_t width, bool nv12)
+{
+    for (uint32_t x = from; x + 2 <= width; x += 2)
+    {
+        uint8_t cu, cv;
+        if constexpr (is_packed_yuv(L))
+        {
+            // a macropixel is Y0 U Y1 V (YUYV) or U Y0 V Y1 (UYVY)
+            const uint8_t *a = src0 + x * 2, *b = src1 + x * 2;
+            constexpr int Y = L == pixel_layout_t::YUYV ? 0 : 1;
+            constexpr int C = 1 - Y;
+            y0[x] = a[Y];
+            y0[x + 1] = a[Y + 2];
+            y1[x] = b[Y];
+            y1[x + 1] = b[Y + 2];
+            cu = average(a[C], b[C]);
+            cv = average(a[C + 2], b[C + 2]);
+        }
+        else
+        {
+            constexpr int P = bytes_per_pixel(L), R = red_at(L), B = blue_at(L);
+            const uint8_t *a = src0 + x * P, *b = src1 + x * P;
+            y0[x] = rgb_to_y(a[R], a[1], a[B]);
+            y0[x + 1] = rgb_to_y(a[P + R], a[P + 1], a[P + B]);
+            y1[x] = rgb_to_y(b[R], b[1], b[B]);
+            y1[x + 1] = rgb_to_y(b[P + R], b[P + 1], b[P + B]);
+            int r = average(average(a[R], b[R]), average(a[P + R], b[P + R]));
+            int g = average(average(a[1], b[1]), average(a[P + 1], b[P + 1]));
+            int bl = average(average(a[B], b[B]), average(a[P + B], b[P + B]));
+            cu = rgb_to_u(r, g, bl);
+            cv = rgb_to_v(r, g, bl);
+        }
+        if (nv12)
+        {
+            u[x] = cu;
+            u[x + 1] = cv;
+        }
+        else
+        {
+            u[x / 2] = cu;
+            v[x / 2] = cv;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// Four source pixels as R G B x bytes (x ignored): the 4-byte layouts load as they are, RGB24 is spread with pshufb.
+template <pixel_layout_t L>
+__attribute__((target("ssse3"))) inline __m128i load4_ssse3(const uint8_t *p)
+{
+    if constexpr (L == pixel_layout_t::RGB24)
+        return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p), _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+    else
+        return _mm_loadu_si128((const __m128i *)p);
+}
+
+// Multiply-add coefficients for the byte order of L, repeated for four pixels.
+template <pixel_layout_t L>
+__attribute__((target("ssse3"))) inline __m128i coefficients_ssse3(int8_t r, int8_t g, int8_t b)
+{
+    int8_t c[4] = {};
+    c[red_at(L)] = r;
+    c[1] = g;
+    c[blue_at(L)] = b;
+    return _mm_set1_epi32(*(int32_t *)c);
+}
+
+// RGB kernel, 16 pixels per step. maddubs sums R,G and B,x per pixel, hadd finishes the dot product.
+template <pixel_layout_t L>
+__attribute__((target("ssse3"))) void convert_row_pair_ssse3(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from,
+                                                               uint32_t width, bool nv12)
+{
+    constexpr uint32_t P = bytes_per_pixel(L);
+    // RGB24 loads read 4 bytes past the 16 pixels
+    constexpr uint32_t SLACK = P == 3 ? 2 : 0;
+    const __m128i yc = coefficients_ssse3<L>(33, 65, 13);
+    const __m128i uc = coefficients_ssse3<L>(-19, -37, 56);
+    const __m128i vc = coefficients_ssse3<L>(56, -47, -9);
+    const __m128i round = _mm_set1_epi16(64);
+    const __m128i y_offset = _mm_set1_epi16(16);
+    const __m128i uv_offset = _mm_set1_epi16(128);
+    uint32_t x = from;
+    for (; x + 16 + SLACK <= width; x += 16)
+    {
+        __m128i a[4], b[4];
+        for (int k = 0; k < 4; k++)
+        {
+            a[k] = load4_ssse3<L>(src0 + (x + k * 4) * P);
+            b[k] = load4_ssse3<L>(src1 + (x + k * 4) * P);
+        }
+        for (int row = 0; row < 2; row++)
+        {
+            __m128i *p = row ? b : a;
+            __m128i lo = _mm_hadd_epi16(_mm_maddubs_epi16(p[0], yc), _mm_maddubs_epi16(p[1], yc));
+            __m128i hi = _mm_hadd_epi16(_mm_maddubs_epi16(p[2], yc), _mm_maddubs_epi16(p[3], yc));
+            lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(lo, round), 7), y_offset);
+            hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(hi, round), 7), y_offset);
+            _mm_storeu_si128((__m128i *)((row ? y1 : y0) + x), _mm_packus_epi16(lo, hi));
+        }
+        // 2x2 averages: rows first, then even/odd pixels
+        __m128i c[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m128 m0 = _mm_castsi128_ps(_mm_avg_epu8(a[k * 2], b[k * 2]));
+            __m128 m1 = _mm_castsi128_ps(_mm_avg_epu8(a[k * 2 + 1], b[k * 2 + 1]));
+            c[k] = _mm_avg_epu8(_mm_castps_si128(_mm_shuffle_ps(m0, m1, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(m0, m1, _MM_SHUFFLE(3, 1, 3, 1))));
+        }
+        __m128i cu = _mm_hadd_epi16(_mm_maddubs_epi16(c[0], uc), _mm_maddubs_epi16(c[1], uc));
+        __m128i cv = _mm_hadd_epi16(_mm_maddubs_epi16(c[0], vc), _mm_maddubs_epi16(c[1], vc));
+        cu = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cu, round), 7), uv_offset);
+        cv = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(cv, round), 7), uv_offset);
+        __m128i uv = _mm_packus_epi16(cu, cv);
+        if (nv12)
+        {
+            _mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+        }
+        else
+        {
+            _mm_storel_epi64((__m128i *)(u + x / 2), uv);
+            _mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+        }
+    }
+    convert_row_pair_scalar<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+
+// Eight source pixels as R G B x, four per 128-bit lane.
+template <pixel_layout_t L>
+__attribute__((target("avx2"))) inline __m256i load8_avx2(const uint8_t *p)
+{
+    if constexpr (L == pixel_layout_t::RGB24)
+    {
+        __m256i raw = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)), _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        return _mm256_shuffle_epi8(raw, _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+    }
+    else
+    {
+        return _mm256_loadu_si256((const __m256i *)p);
+    }
+}
+
+// RGB kernel, 32 pixels per step. Same arithmetic as SSSE3; the in-lane hadd/packus results are put back in order with permutes.
+template <pixel_layout_t L>
+__attribute__((target("avx2"))) void convert_row_pair_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from,
+                                                             uint32_t width, bool nv12)
+{
+    constexpr uint32_t P = bytes_per_pixel(L);
+    constexpr uint32_t SLACK = P == 3 ? 2 : 0;
+    const __m256i yc = _mm256_broadcastsi128_si256(coefficients_ssse3<L>(33, 65, 13));
+    const __m256i uc = _mm256_broadcastsi128_si256(coefficients_ssse3<L>(-19, -37, 56));
+    const __m256i vc = _mm256_broadcastsi128_si256(coefficients_ssse3<L>(56, -47, -9));
+    const __m256i round = _mm256_set1_epi16(64);
+    const __m256i y_offset = _mm256_set1_epi16(16);
+    const __m256i uv_offset = _mm256_set1_epi16(128);
+    const __m256i chroma_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    uint32_t x = from;
+    for (; x + 32 + SLACK <= width; x += 32)
+    {
+        __m256i a[4], b[4];
+        for (int k = 0; k < 4; k++)
+        {
+            a[k] = load8_avx2<L>(src0 + (x + k * 8) * P);
+            b[k] = load8_avx2<L>(src1 + (x + k * 8) * P);
+        }
+        for (int row = 0; row < 2; row++)
+        {
+            __m256i *p = row ? b : a;
+            __m256i lo = _mm256_hadd_epi16(_mm256_maddubs_epi16(p[0], yc), _mm256_maddubs_epi16(p[1], yc));
+            __m256i hi = _mm256_hadd_epi16(_mm256_maddubs_epi16(p[2], yc), _mm256_maddubs_epi16(p[3], yc));
+            lo = _mm256_permute4x64_epi64(_mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(lo, round), 7), y_offset), 0xD8);
+            hi = _mm256_permute4x64_epi64(_mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(hi, round), 7), y_offset), 0xD8);
+            _mm256_storeu_si256((__m256i *)((row ? y1 : y0) + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+        }
+        __m256i c[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m256 m0 = _mm256_castsi256_ps(_mm256_avg_epu8(a[k * 2], b[k * 2]));
+            __m256 m1 = _mm256_castsi256_ps(_mm256_avg_epu8(a[k * 2 + 1], b[k * 2 + 1]));
+            c[k] = _mm256_avg_epu8(_mm256_castps_si256(_mm256_shuffle_ps(m0, m1, _MM_SHUFFLE(2, 0, 2, 0))), _mm256_castps_si256(_mm256_shuffle_ps(m0, m1, _MM_SHUFFLE(3, 1, 3, 1))));
+        }
+        __m256i cu = _mm256_hadd_epi16(_mm256_maddubs_epi16(c[0], uc), _mm256_maddubs_epi16(c[1], uc));
+        __m256i cv = _mm256_hadd_epi16(_mm256_maddubs_epi16(c[0], vc), _mm256_maddubs_epi16(c[1], vc));
+        cu = _mm256_permutevar8x32_epi32(_mm256_add_epi16(_mm256_srai_epi16(_mm256_add_epi16(cu, round), 7), uv_offset), chroma_order);
+        cv = _mm256_permutevar8x32_epi32(_mm256_add_epi16(_mm256_srai_epi16(_mm256_add_epi16(cv, round), 7), uv_offset), chroma_order);
+        // low half: 16 U, high half: 16 V
+        __m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(cu, cv), 0xD8);
+        __m128i cu8 = _mm256_castsi256_si128(uv);
+        __m128i cv8 = _mm256_extracti128_si256(uv, 1);
+        if (nv12)
+        {
+            _mm_storeu_si128((__m128i *)(u + x), _mm_unpacklo_epi8(cu8, cv8));
+            _mm_storeu_si128((__m128i *)(u + x + 16), _mm_unpackhi_epi8(cu8, cv8));
+        }
+        else
+        {
+            _mm_storeu_si128((__m128i *)(u + x / 2), cu8);
+            _mm_storeu_si128((__m128i *)(v + x / 2), cv8);
+        }
+    }
+    convert_row_pair_ssse3<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+
+// YUYV/UYVY kernel, 16 pixels per step: luma is every other byte, chroma is already in NV12 order once rows are averaged.
+template <pixel_layout_t L>
+void convert_packed_sse2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from, uint32_t width, bool nv12)
+{
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    auto luma = [&](__m128i p) { return L == pixel_layout_t::YUYV ? _mm_and_si128(p, low) : _mm_srli_epi16(p, 8); };
+    auto chroma = [&](__m128i p) { return L == pixel_layout_t::YUYV ? _mm_srli_epi16(p, 8) : _mm_and_si128(p, low); };
+    uint32_t x = from;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(src0 + x * 2));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(src0 + x * 2 + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(src1 + x * 2));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(src1 + x * 2 + 16));
+        _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(luma(a0), luma(a1)));
+        _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(luma(b0), luma(b1)));
+        __m128i uv = _mm_packus_epi16(chroma(_mm_avg_epu8(a0, b0)), chroma(_mm_avg_epu8(a1, b1)));
+        if (nv12)
+        {
+            _mm_storeu_si128((__m128i *)(u + x), uv);
+        }
+        else
+        {
+            _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(_mm_and_si128(uv, low), low));
+            _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(_mm_srli_epi16(uv, 8), low));
+        }
+    }
+    convert_row_pair_scalar<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+
+// The luma or chroma bytes of packed YUV, one per 16-bit lane.
+template <pixel_layout_t L>
+__attribute__((target("avx2"))) inline __m256i packed_luma_avx2(__m256i p)
+{
+    return L == pixel_layout_t::YUYV ? _mm256_and_si256(p, _mm256_set1_epi16(0x00FF)) : _mm256_srli_epi16(p, 8);
+}
+template <pixel_layout_t L>
+__attribute__((target("avx2"))) inline __m256i packed_chroma_avx2(__m256i p)
+{
+    return L == pixel_layout_t::YUYV ? _mm256_srli_epi16(p, 8) : _mm256_and_si256(p, _mm256_set1_epi16(0x00FF));
+}
+
+template <pixel_layout_t L>
+__attribute__((target("avx2"))) void convert_packed_avx2(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from,
+                                                           uint32_t width, bool nv12)
+{
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    uint32_t x = from;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(src0 + x * 2));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(src0 + x * 2 + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(src1 + x * 2));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(src1 + x * 2 + 32));
+        _mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(packed_luma_avx2<L>(a0), packed_luma_avx2<L>(a1)), 0xD8));
+        _mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(packed_luma_avx2<L>(b0), packed_luma_avx2<L>(b1)), 0xD8));
+        __m256i uv = _mm256_permute4x64_epi64(
+            _mm256_packus_epi16(packed_chroma_avx2<L>(_mm256_avg_epu8(a0, b0)), packed_chroma_avx2<L>(_mm256_avg_epu8(a1, b1))), 0xD8);
+        if (nv12)
+        {
+            _mm256_storeu_si256((__m256i *)(u + x), uv);
+        }
+        else
+        {
+            __m256i cu = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(uv, low), low), 0xD8);
+            __m256i cv = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(uv, 8), low), 0xD8);
+            _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(cu));
+            _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_castsi256_si128(cv));
+        }
+    }
+    convert_packed_sse2<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+#endif
+
+#ifdef CONVERT_NEON
+// RGB kernel, 16 pixels per step: vld3/vld4 de-interleave the channels, so every step is a plain widening multiply-add.
+template <pixel_layout_t L>
+void convert_row_pair_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from, uint32_t width, bool nv12)
+{
+    constexpr uint32_t P = bytes_per_pixel(L);
+    constexpr int R = red_at(L), B = blue_at(L);
+    auto load = [](const uint8_t *p, uint8x16_t &r, uint8x16_t &g, uint8x16_t &b) {
+        if constexpr (P == 3)
+        {
+            uint8x16x3_t px = vld3q_u8(p);
+            r = px.val[R], g = px.val[1], b = px.val[B];
+        }
+        else
+        {
+            uint8x16x4_t px = vld4q_u8(p);
+            r = px.val[R], g = px.val[1], b = px.val[B];
+        }
+    };
+    auto luma = [](uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+        uint16x8_t sum = vmull_u8(r, vdup_n_u8(33));
+        sum = vmlal_u8(sum, g, vdup_n_u8(65));
+        sum = vmlal_u8(sum, b, vdup_n_u8(13));
+        return vadd_u8(vrshrn_n_u16(sum, 7), vdup_n_u8(16));
+    };
+    // c0 * a - c1 * b - c2 * c, rounded and offset by 128
+    auto chroma = [](uint8x8_t a, uint8_t c0, uint8x8_t b, uint8_t c1, uint8x8_t c, uint8_t c2) {
+        int16x8_t sum = vreinterpretq_s16_u16(vmull_u8(a, vdup_n_u8(c0)));
+        sum = vsubq_s16(sum, vreinterpretq_s16_u16(vmull_u8(b, vdup_n_u8(c1))));
+        sum = vsubq_s16(sum, vreinterpretq_s16_u16(vmull_u8(c, vdup_n_u8(c2))));
+        return vqmovun_s16(vaddq_s16(vrshrq_n_s16(sum, 7), vdupq_n_s16(128)));
+    };
+    uint32_t x = from;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16_t ra, ga, ba, rb, gb, bb;
+        load(src0 + x * P, ra, ga, ba);
+        load(src1 + x * P, rb, gb, bb);
+        vst1q_u8(y0 + x, vcombine_u8(luma(vget_low_u8(ra), vget_low_u8(ga), vget_low_u8(ba)), luma(vget_high_u8(ra), vget_high_u8(ga), vget_high_u8(ba))));
+        vst1q_u8(y1 + x, vcombine_u8(luma(vget_low_u8(rb), vget_low_u8(gb), vget_low_u8(bb)), luma(vget_high_u8(rb), vget_high_u8(gb), vget_high_u8(bb))));
+        // rounded average of the rows, then of neighbouring pixels
+        uint8x8_t r = vrshrn_n_u16(vpaddlq_u8(vrhaddq_u8(ra, rb)), 1);
+        uint8x8_t g = vrshrn_n_u16(vpaddlq_u8(vrhaddq_u8(ga, gb)), 1);
+        uint8x8_t b = vrshrn_n_u16(vpaddlq_u8(vrhaddq_u8(ba, bb)), 1);
+        uint8x8_t cu = chroma(b, 56, g, 37, r, 19);
+        uint8x8_t cv = chroma(r, 56, g, 47, b, 9);
+        if (nv12)
+        {
+            vst2_u8(u + x, (uint8x8x2_t){{cu, cv}});
+        }
+        else
+        {
+            vst1_u8(u + x / 2, cu);
+            vst1_u8(v + x / 2, cv);
+        }
+    }
+    convert_row_pair_scalar<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+
+// YUYV/UYVY kernel, 32 pixels per step.
+template <pixel_layout_t L>
+void convert_packed_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t from, uint32_t width, bool nv12)
+{
+    constexpr int Y = L == pixel_layout_t::YUYV ? 0 : 1;
+    constexpr int C = 1 - Y;
+    uint32_t x = from;
+    for (; x + 32 <= width; x += 32)
+    {
+        uint8x16x4_t a = vld4q_u8(src0 + x * 2);
+        uint8x16x4_t b = vld4q_u8(src1 + x * 2);
+        vst2q_u8(y0 + x, (uint8x16x2_t){{a.val[Y], a.val[Y + 2]}});
+        vst2q_u8(y1 + x, (uint8x16x2_t){{b.val[Y], b.val[Y + 2]}});
+        uint8x16_t cu = vrhaddq_u8(a.val[C], b.val[C]);
+        uint8x16_t cv = vrhaddq_u8(a.val[C + 2], b.val[C + 2]);
+        if (nv12)
+        {
+            vst2q_u8(u + x, (uint8x16x2_t){{cu, cv}});
+        }
+        else
+        {
+            vst1q_u8(u + x / 2, cu);
+            vst1q_u8(v + x / 2, cv);
+        }
+    }
+    convert_row_pair_scalar<L>(src0, src1, y0, y1, u, v, x, width, nv12);
+}
+#endif
+
+template <pixel_layout_t L>
+row_pair_converter select_converter_for()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if constexpr (is_packed_yuv(L))
+        return __builtin_cpu_supports("avx2") ? convert_packed_avx2<L> : convert_packed_sse2<L>;
+    else if (__builtin_cpu_supports("avx2"))
+        return convert_row_pair_avx2<L>;
+    else if (__builtin_cpu_supports("ssse3"))
+        return convert_row_pair_ssse3<L>;
+    return convert_row_pair_scalar<L>;
+#elif defined(CONVERT_NEON)
+    if constexpr (is_packed_yuv(L))
+        return convert_packed_neon<L>;
+    else
+        return convert_row_pair_neon<L>;
+#else
+    return convert_row_pair_scalar<L>;
+#endif
+}
+
+// Picks the widest kernel the running CPU supports for `layout`.
+row_pair_converter select_converter(pixel_layout_t layout)
+{
+    switch (layout)
+    {
+    case pixel_layout_t::RGBA:
+        return select_converter_for<pixel_layout_t::RGBA>();
+    case pixel_layout_t::BGRA:
+        return select_converter_for<pixel_layout_t::BGRA>();
+    case pixel_layout_t::RGB24:
+        return select_converter_for<pixel_layout_t::RGB24>();
+    case pixel_layout_t::YUYV:
+        return select_converter_for<pixel_layout_t::YUYV>();
+    default:
+        return select_converter_for<pixel_layout_t::UYVY>();
+    }
+}
+
+row_pair_converter scalar_converter(pixel_layout_t layout)
+{
+    switch (layout)
+    {
+    case pixel_layout_t::RGBA:
+        return convert_row_pair_scalar<pixel_layout_t::RGBA>;
+    case pixel_layout_t::BGRA:
+        return convert_row_pair_scalar<pixel_layout_t::BGRA>;
+    case pixel_layout_t::RGB24:
+        return convert_row_pair_scalar<pixel_layout_t::RGB24>;
+    case pixel_layout_t::YUYV:
+        return convert_row_pair_scalar<pixel_layout_t::YUYV>;
+    default:
+        return convert_row_pair_scalar<pixel_layout_t::UYVY>;
+    }
+}
+
+// A 4:2:0 picture inside an OUTPUT buffer: I420 (three planes) or NV12 (`u` is the interleaved plane).
+struct yuv420_image_t
+{
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;
+    uint32_t y_stride;
+    uint32_t uv_stride;
+    bool nv12;
+};
+
+// Converts the row pairs [first, end) of a picture `width` pixels wide (even) from `src` into `dst`.
+void convert_rows(row_pair_converter convert, const uint8_t *src, uint32_t src_stride, uint32_t width, const yuv420_image_t &dst, uint32_t first, uint32_t end)
+{
+    for (uint32_t pair = first; pair < end; pair++)
+    {
+        const uint8_t *s0 = src + (size_t)pair * 2 * src_stride;
+        uint8_t *y0 = dst.y + (size_t)pair * 2 * dst.y_stride;
+        uint8_t *u = dst.u + (size_t)pair * dst.uv_stride;
+        uint8_t *v = dst.nv12 ? nullptr : dst.v + (size_t)pair * dst.uv_stride;
+        convert(s0, s0 + src_stride, y0, y0 + dst.y_stride, u, v, 0, width, dst.nv12);
+    }
+}
+
+// A few persistent threads that split one conversion by row ranges; the calling thread takes a share as well.
+class RowPool
+{
+  public:
+    explicit RowPool(uint32_t threads)
+    {
+        for (uint32_t i = 1; i < threads; i++)
+            workers.emplace_back(&RowPool::work, this, i);
+    }
+
+    ~RowPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers)
+            worker.join();
+    }
+
+    uint32_t threads() const
+    {
+        return workers.size() + 1;
+    }
+
+    // Runs job(begin, end) over [0, count), one contiguous range per thread, and returns when all are done.
+    void run(uint32_t count, const std::function<void(uint32_t, uint32_t)> &_job)
+    {
+        if (workers.empty())
+        {
+            _job(0, count);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &_job;
+            total = count;
+            busy = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        _job(0, range_end(0, count));
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return busy == 0; });
+        job = nullptr;
+    }
+
+  private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(uint32_t, uint32_t)> *job = nullptr;
+    uint32_t total = 0;
+    uint32_t busy = 0;
+    uint64_t generation = 0;
+    bool quit = false;
+
+    uint32_t range_end(uint32_t index, uint32_t count) const
+    {
+        return (uint64_t)count * (index + 1) / threads();
+    }
+
+    void work(uint32_t index)
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            const std::function<void(uint32_t, uint32_t)> *current;
+            uint32_t count;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return quit || generation != seen; });
+                if (quit)
+                    return;
+                seen = generation;
+                current = job;
+                count = total;
+            }
+            (*current)(range_end(index - 1, count), range_end(index, count));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--busy == 0)
+                done.notify_one();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef __PIXEL_SCALE_H__
+#define __PIXEL_SCALE_H__
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "pixel_convert.hpp"
+
+// Bilinear scaling of 4:2:0 pictures, so one input can be encoded at several resolutions.
+// Every output row is a vertical blend of two source rows (SIMD) followed by a horizontal pass over a table of
+// source positions. Weights are 7-bit, as in pixel_convert.hpp, and every kernel gives the same bytes as the scalar one.
+
+// Source position of every output sample along one axis: the sample at `index` weighted 128 - frac, the next one frac.
+struct scale_axis_t
+{
+    std::vector<uint32_t> index;
+    std::vector<uint8_t> frac;
+    // same length, so samples map 1:1
+    bool identity = false;
+};
+
+// Centre-aligned positions for scaling `from` samples to `to`, clamped to the edges.
+inline scale_axis_t make_scale_axis(uint32_t from, uint32_t to)
+{
+    scale_axis_t axis;
+    axis.identity = from == to;
+    axis.index.resize(to);
+    axis.frac.resize(to);
+    for (uint32_t i = 0; i < to; i++)
+    {
+        // ((i + 0.5) * from / to - 0.5) in 1/128 steps
+        int64_t pos = std::max<int64_t>((int64_t)(2 * i + 1) * from * 64 / to - 64, 0);
+        uint32_t index = pos >> 7;
+        axis.index[i] = std::min(index, from - 1);
+        axis.frac[i] = index >= from - 1 ? 0 : pos & 127;
+    }
+    return axis;
+}
+
+// out = (a * (128 - w) + b * w + 64) >> 7 over `n` bytes.
+inline void blend_rows_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out, uint32_t n, uint8_t w)
+{
+    for (uint32_t i = 0; i < n; i++)
+        out[i] = (a[i] * (128 - w) + b[i] * w + 64) >> 7;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, so this needs no runtime check.
+inline void blend_rows_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out, uint32_t n, uint8_t w)
+{
+    const __m128i wa = _mm_set1_epi16(128 - w);
+    const __m128i wb = _mm_set1_epi16(w);
+    const __m128i round = _mm_set1_epi16(64);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + i));
+        // 255 * 128 + 64 still fits a signed 16-bit lane
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(pb, zero), wb)), round);
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(pa, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(pb, zero), wb)), round);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(_mm_srli_epi16(lo, 7), _mm_srli_epi16(hi, 7)));
+    }
+    blend_rows_scalar(a + i, b + i, out + i, n - i, w);
+}
+#endif
+
+#ifdef CONVERT_NEON
+inline void blend_rows_neon(const uint8_t *a, const uint8_t *b, uint8_t *out, uint32_t n, uint8_t w)
+{
+    const uint8x8_t wa = vdup_n_u8(128 - w);
+    const uint8x8_t wb = vdup_n_u8(w);
+    uint32_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t pa = vld1q_u8(a + i);
+        uint8x16_t pb = vld1q_u8(b + i);
+        uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(pa), wa), vget_low_u8(pb), wb);
+        uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(pa), wa), vget_high_u8(pb), wb);
+        // vrshrn adds the 64 before shifting
+        vst1q_u8(out + i, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+    }
+    blend_rows_scalar(a + i, b + i, out + i, n - i, w);
+}
+#endif
+
+inline void blend_rows(const uint8_t *a, const uint8_t *b, uint8_t *out, uint32_t n, uint8_t w)
+{
+    if (w == 0)
+    {
+        memcpy(out, a, n);
+        return;
+    }
+#if defined(__x86_64__)
+    blend_rows_sse2(a, b, out, n, w);
+#elif defined(CONVERT_NEON)
+    blend_rows_neon(a, b, out, n, w);
+#else
+    blend_rows_scalar(a, b, out, n, w);
+#endif
+}
+
+// Horizontal pass over one row of `channels`-byte samples (2 for interleaved NV12 chroma). `row` must hold one
+// sample past the last source sample; it is read with weight 0 at the right edge.
+inline void scale_row(const uint8_t *row, uint8_t *out, const scale_axis_t &x, uint32_t channels)
+{
+    uint32_t width = x.index.size();
+    if (x.identity)
+    {
+        memcpy(out, row, width * channels);
+        return;
+    }
+    for (uint32_t i = 0; i < width; i++)
+    {
+        const uint8_t *p = row + x.index[i] * channels;
+        int w = x.frac[i];
+        for (uint32_t c = 0; c < channels; c++)
+            out[i * channels + c] = (p[c] * (128 - w) + p[c + channels] * w + 64) >> 7;
+    }
+}
+
+// Scales output rows [first, end) of one plane. `blended` is scratch for one source row plus one sample.
+inline void scale_plane_rows(const uint8_t *src, uint32_t src_stride, uint32_t src_width, uint8_t *dst, uint32_t dst_stride, const scale_axis_t &x, const scale_axis_t &y,
+                             uint32_t channels, uint32_t first, uint32_t end, std::vector<uint8_t> &blended)
+{
+    uint32_t row_bytes = src_width * channels;
+    blended.resize(row_bytes + channels);
+    for (uint32_t r = first; r < end; r++)
+    {
+        const uint8_t *top = src + (size_t)y.index[r] * src_stride;
+        uint8_t *out = dst + (size_t)r * dst_stride;
+        if (y.frac[r] == 0 && x.identity)
+        {
+            memcpy(out, top, row_bytes);
+            continue;
+        }
+        blend_rows(top, top + (y.frac[r] ? src_stride : 0), blended.data(), row_bytes, y.frac[r]);
+        scale_row(blended.data(), out, x, channels);
+    }
+}
+
+// Scales a 4:2:0 picture of one size to another, both in the same layout (NV12 or I420). Even sizes only.
+class Yuv420Scaler
+{
+  public:
+    uint32_t src_width, src_height, dst_width, dst_height;
+
+    Yuv420Scaler(uint32_t src_width, uint32_t src_height, uint32_t dst_width, uint32_t dst_height)
+        : src_width(src_width), src_height(src_height), dst_width(dst_width), dst_height(dst_height), luma_x(make_scale_axis(src_width, dst_width)),
+          luma_y(make_scale_axis(src_height, dst_height)), chroma_x(make_scale_axis(src_width / 2, dst_width / 2)), chroma_y(make_scale_axis(src_height / 2, dst_height / 2))
+    {
+    }
+
+    // Output row pairs [first, end): two luma rows and the chroma row(s) they share.
+    void scale_rows(const yuv420_image_t &src, const yuv420_image_t &dst, uint32_t first, uint32_t end) const
+    {
+        std::vector<uint8_t> blended;
+        scale_plane_rows(src.y, src.y_stride, src_width, dst.y, dst.y_stride, luma_x, luma_y, 1, first * 2, end * 2, blended);
+        if (src.nv12)
+        {
+            scale_plane_rows(src.u, src.uv_stride, src_width / 2, dst.u, dst.uv_stride, chroma_x, chroma_y, 2, first, end, blended);
+            return;
+        }
+        scale_plane_rows(src.u, src.uv_stride, src_width / 2, dst.u, dst.uv_stride, chroma_x, chroma_y, 1, first, end, blended);
+        scale_plane_rows(src.v, src.uv_stride, src_width / 2, dst.v, dst.uv_stride, chroma_x, chroma_y, 1, first, end, blended);
+    }
+
+    void scale(const yuv420_image_t &src, const yuv420_image_t &dst, RowPool &pool) const
+    {
+        pool.run(dst_height / 2, [&](uint32_t first, uint32_t end) { scale_rows(src, dst, first, end); });
+    }
+
+  private:
+    scale_axis_t luma_x, luma_y, chroma_x, chroma_y;
+};
+
+#endif
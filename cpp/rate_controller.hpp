@@ -0,0 +1,77 @@
+#ifndef __RATE_CONTROLLER_H__
+#define __RATE_CONTROLLER_H__
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// Steers the encoder's bitrate setting so the measured output follows a target rate, capped by the network
+// throughput JS reports. Plain arithmetic: the session feeds it frame sizes and applies what it proposes.
+class RateController
+{
+  public:
+    // output rate to aim for, bits/s
+    uint32_t target;
+    // bounds of the bitrate setting
+    uint32_t min_bitrate;
+    uint32_t max_bitrate;
+    uint32_t window_ms;
+    // share of the reported throughput the stream may take
+    double headroom = 0.85;
+    // the setting the encoder runs with
+    uint32_t setting;
+    // output rate over the last full window, 0 before the first one
+    uint32_t measured = 0;
+    // from report_throughput(), 0 for none
+    uint32_t limit = 0;
+
+    RateController(uint32_t target, uint32_t min_bitrate, uint32_t max_bitrate, uint32_t window_ms, uint32_t setting)
+        : target(target), min_bitrate(min_bitrate), max_bitrate(std::max(min_bitrate, max_bitrate)), window_ms(std::max(window_ms, 100u)), setting(setting)
+    {
+    }
+
+    // Accounts one encoded frame. Once per window, returns a new setting if the output strayed from the goal; 0 otherwise.
+    uint32_t on_frame(uint32_t bytes, uint64_t now_us)
+    {
+        if (window_start == 0)
+            window_start = now_us;
+        window_bytes += bytes;
+        uint64_t elapsed = now_us - window_start;
+        if (elapsed < window_ms * 1000ull)
+            return 0;
+        measured = window_bytes * 8 * 1000000 / elapsed;
+        window_start = now_us;
+        window_bytes = 0;
+        if (measured == 0)
+            return 0;
+        // close half the gap per window, and climb at most 10% at a time so a recovering link is probed gently
+        double ratio = std::clamp(goal() / measured, 0.5, 2.0);
+        double next = setting * (1 + (ratio - 1) / 2);
+        return propose(std::min(next, setting * 1.1));
+    }
+
+    // Caps the goal at `headroom` of the measured network rate. Returns the new setting right away if it has to
+    // come down; raising it is left to on_frame().
+    uint32_t report_throughput(uint32_t bps)
+    {
+        limit = bps * headroom;
+        return setting > limit ? propose(limit) : 0;
+    }
+
+    double goal() const
+    {
+        return limit ? std::min(target, limit) : target;
+    }
+
+  private:
+    uint64_t window_start = 0;
+    uint64_t window_bytes = 0;
+
+    // Clamps `next` to the bounds; changes under 3% are not worth an ioctl.
+    uint32_t propose(double next) const
+    {
+        uint32_t value = std::clamp<double>(next, min_bitrate, max_bitrate);
+        return std::abs((double)value - setting) < setting * 0.03 ? 0 : value;
+    }
+};
+
+#endif
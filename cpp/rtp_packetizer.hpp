@@ -0,0 +1,360 @@
+#ifndef __RTP_PACKETIZER_H__
+#define __RTP_PACKETIZER_H__
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <netdb.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "nalu.hpp"
+
+// RTP packets of one access unit for JS, back to back in one buffer.
+struct rtp_batch_t
+{
+    std::vector<uint8_t> data;
+    // [offset, size] of every packet in `data`
+    std::vector<uint32_t> packets;
+    uint32_t timestamp = 0;
+    bool keyframe = false;
+};
+
+// Where the RTP timestamps of a stream come from. Fixed for the whole stream so they never jump between timelines.
+enum class rtp_timestamp_source_t
+{
+    // the pts if the first frame has one, else the feed time
+    AUTO,
+    // the pts given to feed()
+    PTS,
+    // the time frames were fed
+    CLOCK,
+};
+
+// Turns Annex B access units into RTP packets as RFC 6184 packetization-mode 1 has them: a NAL unit that fits
+// goes in a packet of its own, runs of SPS/PPS are aggregated into one STAP-A, and larger units are split into FU-A
+// fragments. The payload of single and FU-A packets is never copied: `emit` gets the packet's header (the
+// RTP header plus the FU indicator and header, or the whole STAP-A) and a pointer into the access unit.
+class RtpPacketizer
+{
+  public:
+    // bytes of a packet at most, RTP header included: the UDP payload size
+    uint32_t mtu;
+    uint8_t payload_type;
+    uint32_t ssrc;
+    uint32_t clock_rate;
+    // sequence number of the next packet
+    uint16_t sequence;
+    // settles on PTS or CLOCK at the first frame_timestamp()
+    rtp_timestamp_source_t source = rtp_timestamp_source_t::AUTO;
+
+    static constexpr size_t HEADER_SIZE = 12;
+
+    // A random SSRC if `ssrc` is 0; the first sequence number and timestamp are random as RFC 3550 asks.
+    RtpPacketizer(uint32_t mtu, uint8_t payload_type, uint32_t ssrc, uint32_t clock_rate)
+        : mtu(std::max<uint32_t>(mtu, HEADER_SIZE + 64)), payload_type(payload_type & 0x7f), clock_rate(clock_rate)
+    {
+        std::random_device random;
+        this->ssrc = ssrc ? ssrc : random();
+        sequence = random();
+        timestamp_base = random();
+    }
+
+    // RTP timestamp of a frame captured at `us` on the monotonic clock.
+    uint32_t timestamp(uint64_t us) const
+    {
+        return timestamp_base + (uint32_t)(us * clock_rate / 1000000);
+    }
+
+    // RTP timestamp of a frame with presentation time `pts`, counted in `pts_rate` ticks per second. Split so
+    // nanosecond timestamps do not overflow.
+    uint32_t pts_timestamp(uint64_t pts, uint32_t pts_rate) const
+    {
+        if (pts_rate == clock_rate || pts_rate == 0)
+            return timestamp_base + (uint32_t)pts;
+        return timestamp_base + (uint32_t)(pts / pts_rate * clock_rate + pts % pts_rate * clock_rate / pts_rate);
+    }
+
+    // RTP timestamp of a frame fed at `us`, with a pts if `has_pts`, following `source`. On the pts timeline, a
+    // frame without a usable pts (none, or negative) carries on from the frame before by the feed time in between.
+    uint32_t frame_timestamp(bool has_pts, int64_t pts, uint32_t pts_rate, uint64_t us)
+    {
+        bool usable = has_pts && pts >= 0;
+        if (source == rtp_timestamp_source_t::AUTO)
+            source = usable ? rtp_timestamp_source_t::PTS : rtp_timestamp_source_t::CLOCK;
+        uint32_t value;
+        if (source == rtp_timestamp_source_t::CLOCK)
+            value = timestamp(us);
+        else if (usable)
+            value = pts_timestamp(pts, pts_rate);
+        else if (last_us)
+            value = last_timestamp + (uint32_t)((us > last_us ? us - last_us : 0) * clock_rate / 1000000);
+        else
+            value = timestamp_base;
+        last_timestamp = value;
+        last_us = us;
+        return value;
+    }
+
+    // Calls emit(header, header_size, payload, payload_size) for every packet of the access unit, in order;
+    // the header is only valid during the call. AUDs are left out. The last packet carries the marker bit.
+    template <typename Emit>
+    void packetize(const uint8_t *data, size_t size, uint32_t timestamp, Emit emit)
+    {
+        size_t count = split_nalus(data, size, nalus.data(), nalus.size());
+        if (count > nalus.size())
+        {
+            nalus.resize(count);
+            split_nalus(data, size, nalus.data(), nalus.size());
+        }
+        size_t end = count;
+        while (end > 0 && unit_type(data, nalus[end - 1]) == 9)
+            end--;
+        size_t max_payload = mtu - HEADER_SIZE;
+        for (size_t i = 0; i < end; i++)
+        {
+            const uint8_t *unit = data + nalus[i].offset + nalus[i].start_code;
+            size_t length = nalus[i].size - nalus[i].start_code;
+            uint8_t type = unit[0] & 0x1f;
+            if (length == 0 || type == 9)
+                continue;
+            // SPS and PPS that fit together go out as one STAP-A
+            size_t run = i;
+            size_t stap_size = 1;
+            while (run < end && is_parameter_set(data, nalus[run]) && stap_size + 2 + unit_size(nalus[run]) <= max_payload)
+                stap_size += 2 + unit_size(nalus[run++]);
+            if (run - i >= 2)
+            {
+                uint8_t *header = begin_packet(run == end, timestamp);
+                uint8_t *stap = header + HEADER_SIZE;
+                // F is set if any unit has it; NRI is the highest of them
+                uint8_t forbidden = 0;
+                uint8_t nri = 0;
+                size_t offset = 1;
+                for (size_t k = i; k < run; k++)
+                {
+                    const uint8_t *set = data + nalus[k].offset + nalus[k].start_code;
+                    size_t set_size = unit_size(nalus[k]);
+                    forbidden |= set[0] & 0x80;
+                    nri = std::max<uint8_t>(nri, set[0] & 0x60);
+                    stap[offset++] = set_size >> 8;
+                    stap[offset++] = set_size & 0xff;
+                    memcpy(stap + offset, set, set_size);
+                    offset += set_size;
+                }
+                stap[0] = forbidden | nri | 24;
+                emit(header, HEADER_SIZE + offset, nullptr, 0);
+                i = run - 1;
+                continue;
+            }
+            bool last_unit = i + 1 == end;
+            if (length <= max_payload)
+            {
+                emit(begin_packet(last_unit, timestamp), HEADER_SIZE, unit, length);
+                continue;
+            }
+            // FU-A: the unit header becomes the FU indicator and header, the rest is split
+            size_t chunk = max_payload - 2;
+            for (size_t offset = 1; offset < length; offset += chunk)
+            {
+                size_t part = std::min(chunk, length - offset);
+                bool first = offset == 1;
+                bool last = offset + part == length;
+                uint8_t *header = begin_packet(last_unit && last, timestamp);
+                header[HEADER_SIZE] = (unit[0] & 0xe0) | 28;
+                header[HEADER_SIZE + 1] = (first ? 0x80 : 0) | (last ? 0x40 : 0) | type;
+                emit(header, HEADER_SIZE + 2, unit + offset, part);
+            }
+        }
+    }
+
+  private:
+    uint32_t timestamp_base;
+    // the previous frame_timestamp() and the feed time it was for
+    uint32_t last_timestamp = 0;
+    uint64_t last_us = 0;
+    std::vector<nalu_t> nalus = std::vector<nalu_t>(16);
+    // the packet header being emitted; a STAP-A is built here in full
+    std::vector<uint8_t> header = std::vector<uint8_t>(1500);
+
+    static uint8_t unit_type(const uint8_t *data, const nalu_t &nalu)
+    {
+        return nalu.size > nalu.start_code ? data[nalu.offset + nalu.start_code] & 0x1f : 0;
+    }
+
+    static size_t unit_size(const nalu_t &nalu)
+    {
+        return nalu.size - nalu.start_code;
+    }
+
+    static bool is_parameter_set(const uint8_t *data, const nalu_t &nalu)
+    {
+        uint8_t type = unit_type(data, nalu);
+        return type == 7 || type == 8;
+    }
+
+    uint8_t *begin_packet(bool marker, uint32_t timestamp)
+    {
+        if (header.size() < mtu)
+            header.resize(mtu);
+        uint8_t *h = header.data();
+        h[0] = 0x80;
+        h[1] = (marker ? 0x80 : 0) | payload_type;
+        h[2] = sequence >> 8;
+        h[3] = sequence & 0xff;
+        h[4] = timestamp >> 24;
+        h[5] = (timestamp >> 16) & 0xff;
+        h[6] = (timestamp >> 8) & 0xff;
+        h[7] = timestamp & 0xff;
+        h[8] = ssrc >> 24;
+        h[9] = (ssrc >> 16) & 0xff;
+        h[10] = (ssrc >> 8) & 0xff;
+        h[11] = ssrc & 0xff;
+        sequence++;
+        return h;
+    }
+};
+
+// Packetizes the encoded frames of a session on the encoder thread. With a destination, the packets of each
+// frame go out in one sendmmsg() call, straight from the CAPTURE buffer; without one, add() returns them as a
+// batch for the consumer.
+class RtpSink
+{
+  public:
+    RtpPacketizer packetizer;
+
+    std::atomic<uint64_t> packets_sent = 0;
+    std::atomic<uint64_t> bytes_sent = 0;
+    // packets the socket refused (a full send buffer, or nobody listening)
+    std::atomic<uint64_t> packets_dropped = 0;
+
+    RtpSink(uint32_t mtu, uint8_t payload_type, uint32_t ssrc, uint32_t clock_rate) : packetizer(mtu, payload_type, ssrc, clock_rate) {}
+
+    ~RtpSink()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    // Sends to `host`:`port` from now on, through a non-blocking connected UDP socket. Returns false and sets `error` on failure.
+    bool connect(const std::string &host, uint16_t port, std::string &error)
+    {
+        struct addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo *found = nullptr;
+        int ret = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found);
+        if (ret != 0)
+        {
+            error = "Failed to resolve RTP destination " + host + ": " + gai_strerror(ret);
+            return false;
+        }
+        for (struct addrinfo *address = found; address; address = address->ai_next)
+        {
+            fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+            if (fd < 0)
+                continue;
+            if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+                break;
+            ::close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(found);
+        if (fd < 0)
+            error = "Failed to connect to RTP destination " + host + ": " + strerror(errno);
+        return fd >= 0;
+    }
+
+    bool sending() const
+    {
+        return fd >= 0;
+    }
+
+    // Called by the encoder thread for every encoded frame while its CAPTURE buffer is still dequeued, with the
+    // frame's RTP timestamp. Sends the packets, or returns them as a batch when there is no destination.
+    std::shared_ptr<rtp_batch_t> add(const uint8_t *data, size_t size, uint32_t timestamp, bool keyframe)
+    {
+        headers.clear();
+        packets.clear();
+        packetizer.packetize(data, size, timestamp, [&](const uint8_t *header, size_t header_size, const uint8_t *payload, size_t payload_size) {
+            packets.push_back({headers.size(), header_size, payload, payload_size});
+            headers.insert(headers.end(), header, header + header_size);
+        });
+        if (fd >= 0)
+        {
+            send();
+            return nullptr;
+        }
+        auto batch = std::make_shared<rtp_batch_t>();
+        batch->timestamp = timestamp;
+        batch->keyframe = keyframe;
+        batch->packets.reserve(packets.size() * 2);
+        for (const packet_t &packet : packets)
+        {
+            batch->packets.push_back(batch->data.size());
+            batch->packets.push_back(packet.header_size + packet.payload_size);
+            batch->data.insert(batch->data.end(), headers.begin() + packet.header, headers.begin() + packet.header + packet.header_size);
+            batch->data.insert(batch->data.end(), packet.payload, packet.payload + packet.payload_size);
+        }
+        return batch;
+    }
+
+  private:
+    struct packet_t
+    {
+        // offset of the header in `headers`
+        size_t header;
+        size_t header_size;
+        const uint8_t *payload;
+        size_t payload_size;
+    };
+
+    int fd = -1;
+    // reused across frames
+    std::vector<uint8_t> headers;
+    std::vector<packet_t> packets;
+    std::vector<struct iovec> iov;
+    std::vector<struct mmsghdr> messages;
+
+    void send()
+    {
+        iov.resize(packets.size() * 2);
+        messages.assign(packets.size(), {});
+        for (size_t i = 0; i < packets.size(); i++)
+        {
+            iov[i * 2] = {headers.data() + packets[i].header, packets[i].header_size};
+            iov[i * 2 + 1] = {(void *)packets[i].payload, packets[i].payload_size};
+            messages[i].msg_hdr.msg_iov = &iov[i * 2];
+            messages[i].msg_hdr.msg_iovlen = packets[i].payload_size ? 2 : 1;
+        }
+        size_t next = 0;
+        while (next < messages.size())
+        {
+            int sent = sendmmsg(fd, messages.data() + next, std::min<size_t>(messages.size() - next, UIO_MAXIOV), 0);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0)
+            {
+                // the encoder never waits for the network: a full send buffer loses the rest of the frame, any
+                // other error (an ICMP unreachable from an earlier send) the packet at `next`
+                bool full = errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS;
+                size_t lost = full ? messages.size() - next : 1;
+                packets_dropped.fetch_add(lost, std::memory_order_relaxed);
+                next += lost;
+                continue;
+            }
+            for (int i = 0; i < sent; i++)
+                bytes_sent.fetch_add(messages[next + i].msg_len, std::memory_order_relaxed);
+            packets_sent.fetch_add(sent, std::memory_order_relaxed);
+            next += sent;
+        }
+    }
+};
+
+#endif
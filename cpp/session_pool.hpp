@@ -0,0 +1,248 @@
+#ifndef __SESSION_POOL_H__
+#define __SESSION_POOL_H__
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "encoder_session.hpp"
+#include "encoder_stats.hpp"
+#include "util.hpp"
+
+// Encoder sessions opened and configured ahead of time, so a new stream starts without the device setup (open,
+// S_FMT, REQBUFS, mmap) on the JS thread. A background thread keeps every warmed profile at its idle count, and
+// a stopped session of a warmed profile hands its device to a new idle session instead of closing it.
+class SessionPool
+{
+  public:
+    struct profile_t
+    {
+        // the device settings sessions are prepared with; per-stream settings are applied by EncoderSession::begin()
+        encoder_config_t config;
+        // idle sessions to keep
+        uint32_t target = 0;
+        std::vector<std::shared_ptr<EncoderSession>> idle;
+        // sessions being prepared by the background thread
+        uint32_t warming = 0;
+        // opens served from the pool, and opens that found it empty
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        // stopped sessions whose device went back to the pool
+        uint64_t recycled = 0;
+        // why the last background open failed; warming stops until warm() is called again
+        std::string error;
+        // background open and configure
+        latency_histogram_t prepare_time;
+        // open() served from the pool, and open() that set the device up itself
+        latency_histogram_t warm_start;
+        latency_histogram_t cold_start;
+    };
+
+    // The process-wide pool; its thread starts with the first warm().
+    static std::shared_ptr<SessionPool> shared()
+    {
+        static std::shared_ptr<SessionPool> pool = std::make_shared<SessionPool>();
+        return pool;
+    }
+
+    ~SessionPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wake.notify_all();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    // Keeps `count` idle sessions prepared with the device settings of `config`. 0 closes the idle ones.
+    void warm(const encoder_config_t &config, uint32_t count)
+    {
+        std::vector<std::shared_ptr<EncoderSession>> surplus;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            profile_t *profile = find(config);
+            if (!profile)
+            {
+                profiles.push_back(std::make_unique<profile_t>());
+                profile = profiles.back().get();
+                profile->config = config;
+            }
+            profile->target = count;
+            profile->error.clear();
+            while (profile->idle.size() > count)
+            {
+                surplus.push_back(std::move(profile->idle.back()));
+                profile->idle.pop_back();
+            }
+            if (!thread.joinable())
+                thread = std::thread(&SessionPool::run, this);
+        }
+        wake.notify_all();
+        for (std::shared_ptr<EncoderSession> &session : surplus)
+            session->stop();
+    }
+
+    // Opens a session for `config`: a prepared one if its profile has one idle, else a new one opened right
+    // here. Returns null and sets `error` on failure.
+    std::shared_ptr<EncoderSession> open(const encoder_config_t &config, std::string &error)
+    {
+        uint64_t started = monotonic_us();
+        std::shared_ptr<EncoderSession> session;
+        profile_t *profile;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            profile = find(config);
+            if (profile && !profile->idle.empty())
+            {
+                session = std::move(profile->idle.back());
+                profile->idle.pop_back();
+            }
+        }
+        bool warm = session != nullptr;
+        if (warm)
+        {
+            error = session->begin(config);
+            // time to refill
+            wake.notify_all();
+        }
+        else
+        {
+            session = std::make_shared<EncoderSession>();
+            error = session->open(config);
+        }
+        if (!error.empty())
+            return nullptr;
+        if (profile)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            (warm ? profile->hits : profile->misses)++;
+            (warm ? profile->warm_start : profile->cold_start).record(monotonic_us() - started);
+        }
+        return session;
+    }
+
+    // Stops `session`. If its profile is short of idle sessions, the device goes to a new idle session
+    // instead of being closed.
+    void stop(const std::shared_ptr<EncoderSession> &session)
+    {
+        encoder_config_t config = session->current_config();
+        profile_t *profile;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            profile = find(config);
+            if (profile && profile->idle.size() + profile->warming < profile->target)
+                profile->warming++;
+            else
+                profile = nullptr;
+        }
+        if (!profile)
+        {
+            session->stop();
+            return;
+        }
+        auto next = std::make_shared<EncoderSession>();
+        bool handed_over = session->hand_over(*next);
+        if (!handed_over)
+            session->stop();
+        handed_over = handed_over && !next->stopped;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            profile->warming--;
+            if (handed_over && profile->idle.size() < profile->target)
+            {
+                profile->idle.push_back(std::move(next));
+                profile->recycled++;
+                return;
+            }
+        }
+        // the target came down meanwhile; a refused hand-over is made up by the background thread
+        wake.notify_all();
+        if (handed_over)
+            next->stop();
+    }
+
+    // Calls `visit(profile)` for every warmed profile, under the lock.
+    template <typename Visit>
+    void for_each(Visit visit)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::unique_ptr<profile_t> &profile : profiles)
+            visit(*profile);
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+    std::vector<std::unique_ptr<profile_t>> profiles;
+    bool quit = false;
+
+    // Whether a session prepared for `a` serves `b`: everything prepare() sets up must be the same.
+    static bool same_device_settings(const encoder_config_t &a, const encoder_config_t &b)
+    {
+        return a.backend == b.backend && a.device_path == b.device_path && a.width == b.width && a.height == b.height && a.pixel_format == b.pixel_format &&
+               a.num_planes == b.num_planes && a.bytesperline == b.bytesperline && a.colorspace == b.colorspace && a.framerate == b.framerate && a.level == b.level &&
+               a.controllers == b.controllers && a.output_buffer_count == b.output_buffer_count && a.capture_buffer_count == b.capture_buffer_count &&
+               a.feed_type == b.feed_type && a.input_format == b.input_format && a.input_stride == b.input_stride && a.input_memory == b.input_memory &&
+               a.convert_threads == b.convert_threads && a.emulated_latency_ms == b.emulated_latency_ms && a.emulated_replay == b.emulated_replay;
+    }
+
+    // Must be called with the lock held.
+    profile_t *find(const encoder_config_t &config)
+    {
+        for (std::unique_ptr<profile_t> &profile : profiles)
+        {
+            if (same_device_settings(profile->config, config))
+                return profile.get();
+        }
+        return nullptr;
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!quit)
+        {
+            profile_t *profile = nullptr;
+            for (std::unique_ptr<profile_t> &candidate : profiles)
+            {
+                if (candidate->error.empty() && candidate->idle.size() + candidate->warming < candidate->target)
+                    profile = candidate.get();
+            }
+            if (!profile)
+            {
+                wake.wait(lock);
+                continue;
+            }
+            profile->warming++;
+            encoder_config_t config = profile->config;
+            lock.unlock();
+            uint64_t started = monotonic_us();
+            auto session = std::make_shared<EncoderSession>();
+            std::string error = session->prepare(config);
+            lock.lock();
+            profile->warming--;
+            if (!error.empty())
+            {
+                profile->error = error;
+                continue;
+            }
+            profile->prepare_time.record(monotonic_us() - started);
+            if (profile->idle.size() < profile->target)
+            {
+                profile->idle.push_back(std::move(session));
+                continue;
+            }
+            // the target came down meanwhile
+            lock.unlock();
+            session->stop();
+            lock.lock();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef _SIMULCAST_ENCODER_H_
+#define _SIMULCAST_ENCODER_H_ 1
+#include <linux/dma-buf.h>
+#include <memory>
+#include <napi.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "h264_encoder.hpp"
+#include "pixel_scale.hpp"
+
+// One session of a simulcast encoder and the scaler that fills its OUTPUT buffers from the shared input.
+struct simulcast_layer_t
+{
+    std::shared_ptr<EncoderSession> session;
+    std::shared_ptr<SharedEncoder> shared;
+    std::unique_ptr<Yuv420Scaler> scaler;
+};
+
+// Encodes one NV12/I420 input at several resolutions. Each feed() is scaled natively straight into a free
+// OUTPUT buffer of every layer's session, so the frame crosses from JS once; output carries a `layer` index.
+class SimulcastEncoder : public Napi::ObjectWrap<SimulcastEncoder>
+{
+  public:
+    static Napi::FunctionReference *constructor;
+    std::vector<simulcast_layer_t> layers;
+    // the input picture
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t stride = 0;
+    bool nv12 = false;
+    std::unique_ptr<RowPool> pool;
+
+    SimulcastEncoder(const Napi::CallbackInfo &info) : Napi::ObjectWrap<SimulcastEncoder>(info)
+    {
+        Napi::Env env = info.Env();
+        Napi::Object option = info[0].As<Napi::Object>();
+        Napi::Function callback = info[1].As<Napi::Function>();
+        Napi::HandleScope scope(env);
+        encoder_config_t base = parse_config(option);
+        if (!option.Get("layers").IsArray() || option.Get("layers").As<Napi::Array>().Length() == 0)
+        {
+            Napi::Error::New(env, "Simulcast needs at least one layer").ThrowAsJavaScriptException();
+            return;
+        }
+        if (base.pixel_format != V4L2_PIX_FMT_NV12 && base.pixel_format != V4L2_PIX_FMT_YUV420)
+        {
+            Napi::Error::New(env, "Simulcast needs pixel_format NV12 or YUV420").ThrowAsJavaScriptException();
+            return;
+        }
+        width = base.width;
+        height = base.height;
+        stride = base.bytesperline ? base.bytesperline : base.width;
+        nv12 = base.pixel_format == V4L2_PIX_FMT_NV12;
+        uint32_t threads = base.convert_threads;
+        if (!threads)
+            threads = width * height >= 1280 * 720 ? std::min(4u, std::thread::hardware_concurrency()) : 1;
+        pool = std::make_unique<RowPool>(std::max(threads, 1u));
+        bool shared_loop = option.Get("sharedLoop").IsBoolean() && option.Get("sharedLoop").As<Napi::Boolean>();
+
+        Napi::Array layer_options = option.Get("layers").As<Napi::Array>();
+        for (uint32_t i = 0; i < layer_options.Length(); i++)
+        {
+            Napi::Object layer_option = layer_options.Get(i).As<Napi::Object>();
+            Napi::Object merged = merge(env, option, layer_option);
+            encoder_config_t config = parse_config(merged);
+            // layers are always filled from memory, in the input's pixel format, at their own size
+            config.feed_type = 2;
+            config.pixel_format = base.pixel_format;
+            config.input_format.clear();
+            config.bytesperline = 0;
+            // layers writing one file would clobber each other
+            if (!layer_option.Has("file"))
+                config.file.clear();
+            std::string error;
+            if (width % 2 || height % 2 || config.width % 2 || config.height % 2)
+                error = "Simulcast needs even sizes";
+            simulcast_layer_t layer;
+            layer.session = std::make_shared<EncoderSession>();
+            auto output = std::make_shared<EncoderOutput>(layer.session, merged);
+            output->layer = i;
+            layer.session->deliver_frames = output->invoke_callback && !callback.IsEmpty();
+            if (error.empty())
+                error = layer.session->open(config);
+            if (error.empty() && shared_loop)
+                layer.shared = SharedEncoder::start(env, callback, layer.session, output, error);
+            else if (error.empty())
+                (new EncoderWorker(callback, layer.session, output))->Queue();
+            if (!error.empty())
+            {
+                layer.session->stop();
+                stop_layers();
+                Napi::Error::New(env, "layer " + std::to_string(i) + ": " + error).ThrowAsJavaScriptException();
+                return;
+            }
+            layer.scaler = std::make_unique<Yuv420Scaler>(width, height, config.width, config.height);
+            layers.push_back(std::move(layer));
+        }
+    }
+
+    ~SimulcastEncoder()
+    {
+        for (simulcast_layer_t &layer : layers)
+        {
+            if (layer.shared)
+                layer.shared->detach(Env());
+            layer.session->stop();
+        }
+    }
+
+    // feed(data, size, pts?, tag?): one input frame for every layer. Returns the FeedStatus of each layer; the feed policy
+    // applies per layer, except that drop-oldest drops the new frame as there is no per-layer copy to hold.
+    Napi::Value feed(const Napi::CallbackInfo &info)
+    {
+        Napi::Env env = info.Env();
+        Napi::Value param = info[0].As<Napi::Value>();
+        uint32_t size = info[1].As<Napi::Number>().Uint32Value();
+        frame_meta_t meta;
+        if (!parse_meta(info[2], info[3], meta))
+            return env.Undefined();
+        std::vector<int> statuses(layers.size(), FEED_ERROR);
+        if (param.IsArrayBuffer())
+        {
+            feed_layers((uint8_t *)param.As<Napi::ArrayBuffer>().Data(), std::min(size, (uint32_t)param.As<Napi::ArrayBuffer>().ByteLength()), meta, statuses);
+        }
+        else if (param.IsNumber())
+        {
+            // a dmabuf is read through the CPU, bracketed by sync calls so the exporter's caches are coherent
+            int fd = param.As<Napi::Number>().Int32Value();
+            void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED)
+            {
+                struct dma_buf_sync sync = {DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ};
+                ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+                feed_layers((uint8_t *)data, size, meta, statuses);
+                sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+                ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+                munmap(data, size);
+            }
+        }
+        Napi::Array result = Napi::Array::New(env, statuses.size());
+        for (uint32_t i = 0; i < statuses.size(); i++)
+            result.Set(i, statuses[i]);
+        return result;
+    }
+
+    // Raw frames queued to each layer's driver and not yet encoded.
+    Napi::Value inFlight(const Napi::CallbackInfo &info)
+    {
+        Napi::Array result = Napi::Array::New(info.Env(), layers.size());
+        for (uint32_t i = 0; i < layers.size(); i++)
+            result.Set(i, layers[i].session->stats.outputs_queued.load(std::memory_order_relaxed));
+        return result;
+    }
+
+    Napi::Value release(const Napi::CallbackInfo &info)
+    {
+        bool released = false;
+        if (info[0].IsTypedArray())
+        {
+            Napi::TypedArray view = info[0].As<Napi::TypedArray>();
+            Napi::ArrayBuffer array_buffer = view.ArrayBuffer();
+            uint8_t *data = (uint8_t *)array_buffer.Data() + view.ByteOffset();
+            for (simulcast_layer_t &layer : layers)
+                if ((released = layer.session->captures->give_back(data)))
+                    break;
+            if (released)
+                array_buffer.Detach();
+        }
+        return Napi::Boolean::New(info.Env(), released);
+    }
+
+    Napi::Value stats(const Napi::CallbackInfo &info)
+    {
+        Napi::Array result = Napi::Array::New(info.Env(), layers.size());
+        for (uint32_t i = 0; i < layers.size(); i++)
+            result.Set(i, session_stats(info.Env(), *layers[i].session));
+        return result;
+    }
+
+    // requestKeyframe(layer?): on one layer, or all of them so they stay aligned.
+    Napi::Value requestKeyframe(const Napi::CallbackInfo &info)
+    {
+        for (uint32_t i = 0; i < layers.size(); i++)
+            if (!info[0].IsNumber() || info[0].As<Napi::Number>().Uint32Value() == i)
+                layers[i].session->request_keyframe();
+        return info.Env().Undefined();
+    }
+
+    // setBitrate(layer, bps)
+    Napi::Value setBitrate(const Napi::CallbackInfo &info)
+    {
+        uint32_t layer = info[0].As<Napi::Number>().Uint32Value();
+        if (layer < layers.size())
+            layers[layer].session->set_bitrate(info[1].As<Napi::Number>().Uint32Value());
+        return info.Env().Undefined();
+    }
+
+    Napi::Value stop(const Napi::CallbackInfo &info)
+    {
+        stop_layers();
+        return Napi::Number::New(info.Env(), 0);
+    }
+
+    static Napi::Object Init(Napi::Env env, Napi::Object exports)
+    {
+        Napi::Function func = DefineClass(env, "SimulcastEncoder",
+                                          {
+                                              InstanceMethod<&SimulcastEncoder::feed>("feed", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::inFlight>("inFlight", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::release>("release", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::stats>("stats", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::requestKeyframe>("requestKeyframe", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::setBitrate>("setBitrate", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                              InstanceMethod<&SimulcastEncoder::stop>("stop", static_cast<napi_property_attributes>(napi_writable | napi_configurable)),
+                                          });
+        *constructor = Napi::Persistent(func);
+        exports.Set("SimulcastEncoder", func);
+        return exports;
+    }
+
+  private:
+    // The option of one layer: the shared settings with the layer's own on top.
+    static Napi::Object merge(Napi::Env env, const Napi::Object &base, const Napi::Object &layer)
+    {
+        Napi::Object merged = Napi::Object::New(env);
+        for (const Napi::Object &from : {base, layer})
+        {
+            Napi::Array keys = from.GetPropertyNames();
+            for (uint32_t i = 0; i < keys.Length(); i++)
+            {
+                std::string key = keys.Get(i).As<Napi::String>().Utf8Value();
+                if (key != "layers")
+                    merged.Set(key, from.Get(key));
+            }
+        }
+        return merged;
+    }
+
+    void feed_layers(uint8_t *data, uint32_t size, const frame_meta_t &meta, std::vector<int> &statuses)
+    {
+        uint32_t uv_stride = nv12 ? stride : stride / 2;
+        if ((uint64_t)stride * height + (uint64_t)uv_stride * height / 2 * (nv12 ? 1 : 2) > size)
+            return;
+        yuv420_image_t source;
+        source.nv12 = nv12;
+        source.y = data;
+        source.y_stride = stride;
+        source.u = data + stride * height;
+        source.uv_stride = uv_stride;
+        source.v = nv12 ? nullptr : source.u + uv_stride * height / 2;
+        for (size_t i = 0; i < layers.size(); i++)
+        {
+            EncoderSession &session = *layers[i].session;
+            statuses[i] = session.feed_into(
+                [&](struct buffer &output) -> uint32_t {
+                    if (!session.output_yuv420 || session.output_image_size() > (uint32_t)output.length)
+                        return 0;
+                    layers[i].scaler->scale(source, session.output_image(output), *pool);
+                    return session.output_image_size();
+                },
+                meta);
+        }
+    }
+
+    void stop_layers()
+    {
+        for (simulcast_layer_t &layer : layers)
+        {
+            if (layer.shared)
+                layer.shared->stop();
+            else
+                layer.session->stop();
+        }
+    }
+};
+
+Napi::FunctionReference *SimulcastEncoder::constructor = new Napi::FunctionReference();
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
+#include <cstdint>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef __x86_64__
@@ -58,4 +60,12 @@ long long millis()
     return (long long)(tv.tv_sec) * 1000 + (long long)(tv.tv_usec) / 1000;
 }
 
+// Microseconds on CLOCK_MONOTONIC: unaffected by NTP steps, for measuring intervals.
+uint64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,62 @@
+import { createRequire } from 'module';
+import type H264Encoder from './H264Encoder';
+import type SimulcastEncoder from './SimulcastEncoder';
+import type { EncodedFrame, EncoderHubOption, HubSubscribeOption, RawEncoderHub, RawEncoderHubConstructor } from './types';
+const require = createRequire(import.meta?.url ?? __filename);
+
+// eslint-disable-next-line @typescript-eslint/no-var-requires
+const { EncoderHub: _EncoderHub } = require('../build/Release/h264.node') as {
+  EncoderHub: RawEncoderHubConstructor;
+};
+
+/** Fans one encoder's output out to several consumers. Frames are shared, not copied, and every subscriber reads at
+ * its own pace: one that falls more than `maxLag` frames behind skips to a keyframe without holding back the others.
+ * Native sinks (`attachFd()`, `attachFile()`) are written from threads of their own and never touch the JS thread.
+ * An encoder has at most one hub; its own callback keeps working alongside.
+ */
+class EncoderHub {
+  hub: RawEncoderHub;
+  constructor(encoder: H264Encoder | SimulcastEncoder, option: EncoderHubOption = {}) {
+    this.hub = new _EncoderHub(encoder.encoder, option);
+  }
+
+  /** calls back with every encoded frame from the next keyframe on; returns the subscriber id */
+  subscribe(callback: (frame: EncodedFrame) => void, option?: HubSubscribeOption) {
+    return this.hub.subscribe(callback, option);
+  }
+
+  /** writes the Annex B stream to `fd` (a file, pipe or stream socket), which stays open but is made non-blocking; a
+   * reader that takes nothing for 2 s fails the subscriber (see `stats()`). Returns the subscriber id */
+  attachFd(fd: number, option?: HubSubscribeOption) {
+    return this.hub.attachFd(fd, option);
+  }
+
+  /** writes the Annex B stream to a new file; returns the subscriber id */
+  attachFile(path: string, option?: HubSubscribeOption) {
+    return this.hub.attachFile(path, option);
+  }
+
+  unsubscribe(id: number) {
+    return this.hub.unsubscribe(id);
+  }
+
+  /** hold back frames for a JS subscriber, e.g. while its socket is congested; they are delivered on `resume()` */
+  pause(id: number) {
+    return this.hub.pause(id);
+  }
+
+  resume(id: number) {
+    return this.hub.resume(id);
+  }
+
+  stats() {
+    return this.hub.stats();
+  }
+
+  /** removes every subscriber, native sinks included */
+  close() {
+    this.hub.close();
+  }
+}
+
+export default EncoderHub;
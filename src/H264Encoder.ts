@@ -1,42 +1,164 @@
 import { createRequire } from 'module';
-import type { EncoderInputType, EncoderOption, RawH264Encoder, RawH264EncoderConstructor } from './types';
+import type {
+  EncodedFrame,
+  EncoderCallback,
+  EncoderDevice,
+  EncoderOption,
+  FrameQueueOption,
+  H264EncoderOption,
+  RawH264Encoder,
+  RawH264EncoderConstructor,
+  ReconfigureOption,
+  SessionPoolStats,
+} from './types';
 const require = createRequire(import.meta?.url ?? __filename);
 
 // eslint-disable-next-line @typescript-eslint/no-var-requires
-const { H264Encoder: _H264Encoder } = require('../build/Release/h264.node') as {
+const {
+  H264Encoder: _H264Encoder,
+  listDevices: _listDevices,
+  warmSessions: _warmSessions,
+  sessionPoolStats: _sessionPoolStats,
+} = require('../build/Release/h264.node') as {
   H264Encoder: RawH264EncoderConstructor;
+  listDevices: (refresh?: boolean) => EncoderDevice[];
+  warmSessions: (option: EncoderOption, count: number) => void;
+  sessionPoolStats: () => SessionPoolStats[];
 };
+
+function nativeOption(option: H264EncoderOption) {
+  return { ...option, pixel_format: option.pixelFormat, feed_type: option.inputType } as EncoderOption;
+}
+
+/** H.264 encoder nodes on this host; new encoders go to the one with the lowest pixel rate.
+ * Nodes are probed once, pass `refresh` to probe again.
+ */
+export function listDevices(refresh = false) {
+  return _listDevices(refresh);
+}
+
+/** keep `count` encoder sessions with the device settings of `option` (size, formats, framerate, level, buffers,
+ * input conversion) opened and configured in the background. A new `H264Encoder` with the same settings starts on
+ * one of them without touching the device, whatever its bitrate, file or callback options; `stop()` hands the
+ * device back while the pool is short. 0 closes the idle sessions
+ */
+export function warmSessions(option: H264EncoderOption, count: number) {
+  _warmSessions(nativeOption(option), count);
+}
+
+/** per warmed profile: idle sessions, hits and misses, and startup times with and without the pool */
+export function sessionPoolStats() {
+  return _sessionPoolStats();
+}
+
 class H264Encoder {
   encoder: RawH264Encoder;
-  constructor(
-    option: Omit<EncoderOption, 'feed_type' | 'pixel_format'> & {
-      /** input frame data type, fd or buffer
-       * @default fd
-       */
-      inputType?: EncoderInputType;
-      /** pixel format fourcc */
-      pixelFormat?: number;
-    },
-    callback?: (
-      err: unknown,
-      ok: boolean,
-      data: {
-        nalu: number;
-        data: ArrayBuffer;
-      },
-    ) => void,
-  ) {
+  constructor(option: H264EncoderOption, callback?: EncoderCallback) {
     let _callback = callback;
     if (!_callback) {
       _callback = () => {};
     }
-    const newOption = { ...option, pixel_format: option.pixelFormat, feed_type: option.inputType } as EncoderOption;
-    this.encoder = new _H264Encoder(newOption, _callback);
+    this.encoder = new _H264Encoder(nativeOption(option), _callback);
+  }
+  /** `pts` and `tag` are handed back with the encoded frame, which also reports its feed `sequence` number */
+  feed(data: number | ArrayBuffer, size: number, pts?: number | bigint, tag?: number) {
+    return this.encoder.feed(data, size, pts, tag);
+  }
+
+  /** a native buffer (see `inputMemory`) to write the next frame into and pass to `feed()`; null while none is free.
+   * Once fed it belongs to the encoder again, so acquire a new one for the next frame; one dropped unfed gives its
+   * slot back when it is garbage collected
+   */
+  acquireInput() {
+    return this.encoder.acquireInput();
+  }
+
+  /** the latest SPS/PPS, e.g. for an SDP or an avcC box; null before the first keyframe */
+  getParameterSets() {
+    return this.encoder.getParameterSets();
+  }
+
+  /** the frames since the last IDR (see `gopCacheBytes`), to start a new consumer without waiting for a keyframe.
+   * The buffers are views of the cached frames, not copies
+   */
+  getGopSnapshot() {
+    return this.encoder.getGopSnapshot();
+  }
+
+  /** raw frames queued to the encoder and not yet encoded */
+  inFlight() {
+    return this.encoder.inFlight();
+  }
+
+  /** hand a lent capture buffer back to the encoder early; `data` (and every other NALU of that frame) must not be used afterwards */
+  release(data: Uint8Array) {
+    return this.encoder.release(data);
+  }
+
+  /** counters and latency histograms, cheap enough to poll for monitoring */
+  stats() {
+    return this.encoder.stats();
+  }
+
+  /** make the next encoded frame an IDR frame, e.g. when a viewer joins. Like the setters below, it is applied
+   * by the encoder thread before the next frame; a failure is reported through the callback
+   */
+  requestKeyframe() {
+    this.encoder.requestKeyframe();
   }
-  feed(data: number | ArrayBuffer, size: number) {
-    return this.encoder.feed(data, size);
+
+  /** new bitrate in bits/s; with `rateControl` this moves its target instead */
+  setBitrate(bps: number) {
+    this.encoder.setBitrate(bps);
+  }
+
+  /** frames between I-frames */
+  setGop(frames: number) {
+    this.encoder.setGop(frames);
+  }
+
+  setFramerate(fps: number) {
+    this.encoder.setFramerate(fps);
+  }
+
+  /** throughput the network carries right now, bits/s; with `rateControl` the bitrate comes down right away to fit */
+  reportThroughput(bps: number) {
+    this.encoder.reportThroughput(bps);
+  }
+
+  /** resolves once every frame fed so far was encoded and handed to the callback, e.g. before a `reconfigure()`
+   * or the last `stop()`; rejects if the encoder stops first. Encoding goes on meanwhile
+   */
+  flush() {
+    return this.encoder.flush();
+  }
+
+  /** switch a running encoder to a new size, pixel format or input conversion on the same device, without
+   * opening it again. Frames still queued are discarded (`flush()` first to keep them) and the stream restarts
+   * with an IDR; a bitrate or framerate change alone applies between frames. Throws if the encoder refuses,
+   * which leaves the old settings in place. Lent capture buffers must be released first
+   */
+  reconfigure(option: ReconfigureOption) {
+    const { pixelFormat, ...rest } = option;
+    this.encoder.reconfigure(pixelFormat === undefined ? rest : { ...rest, pixel_format: pixelFormat });
+  }
+
+  /** encoded frames (as `batch` callbacks deliver them) for `for await`, instead of the callback, which only
+   * gets errors, fragments and "drain" from then on. Frames are queued natively and only become JS objects when
+   * pulled; a full queue applies `overflow`, by default holding the encoder back. Ends after `stop()`
+   */
+  async *frames(option: FrameQueueOption = {}): AsyncGenerator<EncodedFrame, void, undefined> {
+    this.encoder.startPull({ capacity: 30, overflow: 'block', ...option });
+    for (;;) {
+      const frame = await this.encoder.pull();
+      if (frame === null) {
+        return;
+      }
+      yield frame;
+    }
   }
 
+  /** end the stream; with a profile warmed by `warmSessions()`, the device may go back to the pool instead of being closed */
   stop() {
     return this.encoder.stop();
   }
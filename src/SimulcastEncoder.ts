@@ -0,0 +1,69 @@
+import { createRequire } from 'module';
+import type { EncoderCallback, EncoderInputType, RawSimulcastEncoder, RawSimulcastEncoderConstructor, SimulcastOption } from './types';
+const require = createRequire(import.meta?.url ?? __filename);
+
+// eslint-disable-next-line @typescript-eslint/no-var-requires
+const { SimulcastEncoder: _SimulcastEncoder } = require('../build/Release/h264.node') as {
+  SimulcastEncoder: RawSimulcastEncoderConstructor;
+};
+
+/** Encodes one input at several resolutions: every `feed()` is downscaled natively into each layer's encoder,
+ * and every payload carries the `layer` it belongs to. The callback gets `(null, 'Ok')` once per layer.
+ */
+class SimulcastEncoder {
+  encoder: RawSimulcastEncoder;
+  constructor(
+    option: Omit<SimulcastOption, 'feed_type' | 'pixel_format'> & {
+      /** input frame data type, fd or buffer
+       * @default fd
+       */
+      inputType?: EncoderInputType;
+      /** pixel format fourcc, NV12 or YUV420 */
+      pixelFormat?: number;
+    },
+    callback?: EncoderCallback,
+  ) {
+    let _callback = callback;
+    if (!_callback) {
+      _callback = () => {};
+    }
+    const newOption = { ...option, pixel_format: option.pixelFormat, feed_type: option.inputType } as SimulcastOption;
+    this.encoder = new _SimulcastEncoder(newOption, _callback);
+  }
+
+  /** one input frame for every layer, with the `pts` and `tag` to hand back; returns each layer's status */
+  feed(data: number | ArrayBuffer, size: number, pts?: number | bigint, tag?: number) {
+    return this.encoder.feed(data, size, pts, tag);
+  }
+
+  /** per layer, raw frames queued to the encoder and not yet encoded */
+  inFlight() {
+    return this.encoder.inFlight();
+  }
+
+  /** hand a lent capture buffer back to whichever layer it came from */
+  release(data: Uint8Array) {
+    return this.encoder.release(data);
+  }
+
+  /** stats of every layer, in `layers` order */
+  stats() {
+    return this.encoder.stats();
+  }
+
+  /** make the next frame an IDR frame on one layer, or on all of them */
+  requestKeyframe(layer?: number) {
+    this.encoder.requestKeyframe(layer);
+  }
+
+  /** new bitrate of one layer, bits/s */
+  setBitrate(layer: number, bps: number) {
+    this.encoder.setBitrate(layer, bps);
+  }
+
+  stop() {
+    return this.encoder.stop();
+  }
+}
+
+export default SimulcastEncoder;
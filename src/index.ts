@@ -1,2 +1,28 @@
-export { default as H264Encoder } from './H264Encoder';
-export { EncoderInputType } from './types';
+export { default as H264Encoder, listDevices, sessionPoolStats, warmSessions } from './H264Encoder';
+export { default as SimulcastEncoder } from './SimulcastEncoder';
+export { default as EncoderHub } from './EncoderHub';
+export type {
+  EncodedFrame,
+  EncoderCallback,
+  EncoderDevice,
+  EncoderHubOption,
+  EncoderStats,
+  FrameInfo,
+  FrameQueueOption,
+  H264EncoderOption,
+  HubSubscribeOption,
+  HubSubscriberStats,
+  LatencyHistogram,
+  Mp4Fragment,
+  NaluPayload,
+  ParameterSets,
+  QueueOverflow,
+  RateControlOption,
+  ReconfigureOption,
+  RtpOption,
+  RtpPacketBatch,
+  SessionPoolStats,
+  SimulcastLayer,
+  SimulcastOption,
+} from './types';
+export { EncoderInputType, FeedStatus } from './types';
@@ -1,6 +1,55 @@
 export interface RawH264Encoder {
-  feed: (data: number | ArrayBuffer, size: number) => number;
+  feed: (data: number | ArrayBuffer, size: number, pts?: number | bigint, tag?: number) => FeedStatus;
+  acquireInput: () => ArrayBuffer | null;
+  getParameterSets: () => ParameterSets | null;
+  getGopSnapshot: () => EncodedFrame[];
+  inFlight: () => number;
+  release: (data: Uint8Array) => boolean;
+  stats: () => EncoderStats;
+  requestKeyframe: () => void;
+  setBitrate: (bps: number) => void;
+  setGop: (frames: number) => void;
+  setFramerate: (fps: number) => void;
+  reportThroughput: (bps: number) => void;
   stop: () => number;
+  flush: () => Promise<void>;
+  reconfigure: (option: Partial<EncoderOption>) => void;
+  startPull: (option?: FrameQueueOption) => void;
+  pull: () => Promise<EncodedFrame | null>;
+}
+
+export interface RawSimulcastEncoder {
+  feed: (data: number | ArrayBuffer, size: number, pts?: number | bigint, tag?: number) => FeedStatus[];
+  inFlight: () => number[];
+  release: (data: Uint8Array) => boolean;
+  stats: () => EncoderStats[];
+  requestKeyframe: (layer?: number) => void;
+  setBitrate: (layer: number, bps: number) => void;
+  stop: () => number;
+}
+
+/** an H.264 memory-to-memory encoder node and the load this process placed on it */
+export interface EncoderDevice {
+  path: string;
+  card: string;
+  driver: string;
+  busInfo: string;
+  sessions: number;
+  /** sum of width * height * framerate over the sessions on this node */
+  pixelRate: number;
+}
+
+/** result of `feed()`; non-negative values mean the frame will be encoded */
+export enum FeedStatus {
+  QUEUED = 0,
+  /** `drop-oldest`: kept until a raw frame buffer frees up, unless a newer frame replaces it first */
+  HELD = 1,
+  /** every raw frame buffer is still with the encoder */
+  BUSY = -1,
+  /** `drop-newest`: discarded */
+  DROPPED = -2,
+  /** stopped, or the driver refused the frame */
+  ERROR = -3,
 }
 
 export enum EncoderInputType {
@@ -19,20 +68,442 @@ export interface EncoderOption {
   bytesperline: number;
   invokeCallback?: boolean;
   framerate: number;
+  /** write the encoded stream to this file; writes happen on a separate thread and errors arrive through the callback's `err` */
   file?: string;
+  /** how many encoded frames the file writer may fall behind by
+   * @default 64
+   */
+  fileQueueFrames?: number;
+  /** `keyframe` syncs to storage after every batch with a keyframe, `interval` every `fileSyncInterval` ms
+   * @default 'none'
+   */
+  fileSync?: 'none' | 'keyframe' | 'interval';
+  /** @default 1000 */
+  fileSyncInterval?: number;
+  /** `drop` skips frames while the file writer's queue is full, `block` makes the encoder wait for it
+   * @default 'drop'
+   */
+  fileBackpressure?: 'drop' | 'block';
+  /** `fmp4` writes `file` as fragmented MP4 (one fragment per GOP) instead of raw Annex B
+   * @default 'annexb'
+   */
+  fileFormat?: 'annexb' | 'fmp4';
+  /** fMP4 only: start a new file at the first keyframe after this many ms; `file` may contain `%d` for the
+   * segment number, otherwise `-<n>` is inserted before the extension. 0 writes a single file
+   * @default 0
+   */
+  segmentDuration?: number;
+  /** deliver fMP4 init segments and fragments (`Mp4Fragment`) through the callback, ready for MSE or HTTP
+   * @default false
+   */
+  fragments?: boolean;
+  /** packetize encoded frames as RTP (RFC 6184, packetization-mode 1) natively. With `host` and `port` the packets
+   * are sent from the encoder thread, batched with `sendmmsg`; otherwise they come through the callback as `RtpPacketBatch`
+   */
+  rtp?: RtpOption;
   feed_type: 1 | 2;
+  /** number of raw frame (OUTPUT) buffers, i.e. how many frames can be in flight
+   * @default 4
+   */
+  outputBuffers?: number;
+  /** layout of BUFFER input when it differs from `pixelFormat`; frames are converted natively (SIMD, split across
+   * threads for large frames) while they are written into the encoder's buffer. `pixelFormat` must be NV12 or YUV420
+   */
+  inputFormat?: 'rgba' | 'bgra' | 'rgb24' | 'yuyv' | 'uyvy';
+  /** BUFFER input only: memory behind the buffers `acquireInput()` lends. `dmabuf` (memfd pages exported through
+   * /dev/udmabuf) and `userptr` are read by the encoder in place, so feeding them copies nothing; `auto` tries
+   * `dmabuf`, then `userptr`. When the kernel or driver refuses, the buffers are copied on feed instead, as `copy`
+   * does; `stats().inputMemory` tells which one is in use. With `copy`, `acquireInput()` returns null
+   * @default 'copy'
+   */
+  inputMemory?: 'copy' | 'auto' | 'userptr' | 'dmabuf';
+  /** bytes per `inputFormat` row, defaults to tightly packed rows */
+  inputStride?: number;
+  /** threads one conversion is split across
+   * @default 4 from 1280x720 up (at most one per core), otherwise 1
+   */
+  convertThreads?: number;
+  /** what `feed()` does when every raw frame buffer is still with the encoder: `reject` returns `FeedStatus.BUSY`,
+   * `block` waits up to `feedTimeout` ms for one, `drop-newest` discards the new frame and `drop-oldest` holds
+   * it for the next free buffer in place of the frame held before
+   * @default 'reject'
+   */
+  feedPolicy?: 'reject' | 'block' | 'drop-newest' | 'drop-oldest';
+  /** @default 100 */
+  feedTimeout?: number;
+  /** call back with `(null, 'drain')` once the encoder has room again after a feed found none
+   * @default false
+   */
+  drainEvent?: boolean;
+  /** number of encoded (CAPTURE) buffers
+   * @default 4
+   */
+  captureBuffers?: number;
+  /** deliver encoded data backed directly by the encoder's capture buffer instead of a copy.
+   * The buffer goes back to the encoder on `release()` or when it is garbage collected;
+   * a copy is delivered whenever every capture buffer is already lent out.
+   * @default false
+   */
+  lendBuffers?: boolean;
+  /** bytes of encoded-frame memory kept for reuse once JS lets go of a delivered frame, so steady-state streaming
+   * allocates no frame copies; 0 allocates every copy
+   * @default 8388608
+   */
+  framePoolBytes?: number;
+  /** adjust the bitrate setting at runtime so the measured output rate follows `target`, without going over
+   * a share of what `reportThroughput()` last reported
+   */
+  rateControl?: RateControlOption;
+  /** bytes of the current GOP (the frames since the last IDR) kept for `getGopSnapshot()`, so a consumer joining
+   * mid-stream can start without a new keyframe; a GOP that outgrows it is not kept. 0 keeps only the parameter sets
+   * @default 0
+   */
+  gopCacheBytes?: number;
+  /** deliver one callback per encoded frame (`EncodedFrame[]`) instead of one per NALU
+   * @default false
+   */
+  batch?: boolean;
+  /** framing of the delivered NALUs: `annexb` keeps the start codes, `avcc` replaces them with 4-byte big-endian
+   * lengths (in place whenever possible), `raw-nalu` drops them. In batch mode `raw-nalu` leaves `data` as it is
+   * and only the `nalus` table skips the start codes
+   * @default 'annexb'
+   */
+  outputFormat?: 'annexb' | 'avcc' | 'raw-nalu';
+  /** in batch mode, the most frames one callback may carry when the event loop falls behind
+   * @default 1
+   */
+  maxBatchFrames?: number;
+  /** encoded frames waiting for the JS thread at most before `queueOverflow` applies; 0 for no limit
+   * @default 0
+   */
+  queueFrames?: number;
+  /** what a full queue does with the next frame: `drop-non-reference` drops a frame no other frame refers to (and
+   * falls back to `drop-to-idr` if there is none), `drop-to-idr` drops every queued frame and skips to the next IDR,
+   * `block` leaves encoded frames with the encoder until there is room, so `feed()` stalls
+   * @default 'drop-non-reference'
+   */
+  queueOverflow?: QueueOverflow;
+  /** serve this encoder from one native thread shared by every `sharedLoop` encoder of the process, instead of
+   * a libuv threadpool thread of its own; use it when running more encoders than the threadpool has threads
+   * @default false
+   */
+  sharedLoop?: boolean;
+  /** encoder node to use, e.g. `/dev/video11`; by default the least loaded H.264 encoder found by `listDevices()` */
+  device?: string;
+  /** `emulated` replaces the hardware encoder with a software stand-in that emits synthetic
+   * (or replayed) H.264, for benchmarking and testing without a Raspberry Pi
+   * @default 'v4l2'
+   */
+  backend?: 'v4l2' | 'emulated';
+  /** emulated backend only: simulated encode time per frame in milliseconds
+   * @default 5
+   */
+  emulatedLatency?: number;
+  /** emulated backend only: Annex B file whose access units are replayed in a loop instead of synthetic ones */
+  emulatedReplay?: string;
+}
+
+/** one NALU, delivered when `batch` is off */
+/** ties encoded output back to the raw frame it came from */
+export interface FrameInfo {
+  /** counts fed frames from 0 */
+  sequence: number;
+  /** ms from `feed()` until the encoded frame was dequeued; 0 if the frame could not be matched */
+  encodeTime: number;
+  /** as passed to `feed()`, if it was: a bigint pts comes back as a bigint */
+  pts?: number | bigint;
+  tag?: number;
+}
+
+export interface NaluPayload extends FrameInfo {
+  nalu: number;
+  data: Buffer;
+  /** the access unit this NALU belongs to is a keyframe */
+  keyframe: boolean;
+  /** index into `layers`, simulcast only */
+  layer?: number;
+}
+
+/** one access unit, delivered when `batch` is on */
+export interface EncodedFrame extends FrameInfo {
+  /** the whole Annex B access unit */
+  data: Buffer;
+  /** `[offset, size, nal_type]` for every NALU in `data`; offsets and sizes include the start code or length prefix */
+  nalus: Uint32Array;
+  keyframe: boolean;
+  /** index into `layers`, simulcast only */
+  layer?: number;
+}
+
+/** log2 latency histogram; `buckets[i]` counts samples in [2^i, 2^(i+1)) microseconds */
+export interface LatencyHistogram {
+  count: number;
+  meanUs: number;
+  /** percentiles are the upper bound of the bucket they fall in */
+  p50Us: number;
+  p90Us: number;
+  p99Us: number;
+  maxUs: number;
+  buckets: number[];
+}
+
+/** the latest SPS and PPS NAL units, without start codes */
+export interface ParameterSets {
+  sps: Buffer;
+  pps: Buffer;
+}
+
+export interface RateControlOption {
+  /** output rate to aim for, bits/s; `setBitrate()` moves it
+   * @default bitrate
+   */
+  target?: number;
+  /** bounds of the bitrate setting
+   * @default target / 8
+   */
+  min?: number;
+  /** @default target * 2 */
+  max?: number;
+  /** ms of output measured per adjustment
+   * @default 1000
+   */
+  window?: number;
+}
+
+export interface RtpOption {
+  /** bytes of an RTP packet at most, header included
+   * @default 1200
+   */
+  mtu?: number;
+  /** @default 96 */
+  payloadType?: number;
+  /** random unless set; `stats().rtpSsrc` has the one in use */
+  ssrc?: number;
+  /** @default 90000 */
+  clockRate?: number;
+  /** ticks per second of the `pts` passed to `feed()`, when RTP timestamps follow it
+   * @default clockRate
+   */
+  ptsRate?: number;
+  /** where RTP timestamps come from, for the whole stream: the `pts` passed to `feed()`, or the time frames were
+   * fed. `auto` picks `pts` if the first frame has one. On the pts timeline, a frame fed without a pts (or with a
+   * negative one) advances from the frame before by the time fed in between
+   * @default 'auto'
+   */
+  timestampSource?: 'auto' | 'pts' | 'clock';
+  /** UDP destination */
+  host?: string;
+  port?: number;
+}
+
+export interface EncoderStats {
+  /** encoder node the session was placed on, empty for the emulated backend */
+  device: string;
+  /** memory behind the buffers `acquireInput()` lends, after any fallback */
+  inputMemory: 'copy' | 'userptr' | 'dmabuf';
+  framesFed: number;
+  /** `feed()` calls refused because every raw frame buffer was still with the encoder */
+  feedRejected: number;
+  /** raw frames discarded by the `drop-newest` / `drop-oldest` feed policies, or held by `drop-oldest` and then
+   * refused by the driver */
+  feedDropped: number;
+  framesEncoded: number;
+  framesDelivered: number;
+  /** encoded frames without a consumer, plus empty buffers returned by the encoder */
+  framesDropped: number;
+  /** encoded frames dropped by `queueOverflow` */
+  queueDropped: number;
+  bytesIn: number;
+  bytesOut: number;
+  /** bytes memcpy'd on the way in (BUFFER input, unless fed from `acquireInput()` in place) and out (unless a capture buffer was lent) */
+  bytesCopied: number;
+  pollWakeups: number;
+  /** wakeups that dequeued at least one buffer */
+  usefulWakeups: number;
+  /** raw frames currently queued to the encoder, out of `outputBuffers` */
+  outputsQueued: number;
+  outputBuffers: number;
+  capturesLent: number;
+  /** encoded frames waiting for the JS thread */
+  pendingFrames: number;
+  /** frame copies served from the pool, and those that had to allocate (a miss rate that stays up means `framePoolBytes` is too small) */
+  framePoolHits: number;
+  framePoolMisses: number;
+  /** bytes waiting in the pool for reuse */
+  framePoolBytes: number;
+  /** bytes of the cached GOP */
+  gopCacheBytes: number;
+  /** current bitrate setting, bits/s, and framerate */
+  bitrate: number;
+  framerate: number;
+  /** only with the `rateControl` option; `measured` is the output rate over the last window, `limit` 0 until a throughput was reported */
+  rateControl?: { target: number; measured: number; limit: number };
+  /** -1 until the first feed; a growing value next to a small `msSinceLastFeed` means the encoder stalled */
+  msSinceLastFeed: number;
+  msSinceLastFrame: number;
+  /** `feed()` until the encoded frame was dequeued */
+  encodeLatency: LatencyHistogram;
+  /** dequeue until the JS callback */
+  deliveryLatency: LatencyHistogram;
+  /** only with the `file` option */
+  fileFramesWritten?: number;
+  fileBytesWritten?: number;
+  fileFramesDropped?: number;
+  /** only with the `rtp` option; sent and dropped stay 0 without a destination */
+  rtpSsrc?: number;
+  rtpPacketsSent?: number;
+  rtpBytesSent?: number;
+  /** packets the socket refused: a full send buffer, or nobody listening */
+  rtpPacketsDropped?: number;
+}
+
+export type QueueOverflow = 'drop-non-reference' | 'drop-to-idr' | 'block';
+
+/** the queue `frames()` pulls from */
+export interface FrameQueueOption {
+  /** encoded frames waiting at most; 0 for no limit
+   * @default 30
+   */
+  capacity?: number;
+  /** @default 'block' */
+  overflow?: QueueOverflow;
+}
+
+/** one profile warmed with `warmSessions()` */
+export interface SessionPoolStats {
+  width: number;
+  height: number;
+  pixelFormat: number;
+  backend: string;
+  /** idle sessions to keep */
+  target: number;
+  idle: number;
+  /** sessions being opened in the background */
+  warming: number;
+  /** encoders that started on an idle session, and those that found none and opened the device themselves;
+   * misses under churn mean the target is too small
+   */
+  hits: number;
+  misses: number;
+  /** stopped encoders whose device went back to the pool instead of being closed */
+  recycled: number;
+  /** why the last background open failed; warming stops until `warmSessions()` is called again */
+  error?: string;
+  /** opening and configuring a session in the background */
+  prepareTime: LatencyHistogram;
+  /** encoder construction on a pooled session, and on a fresh one */
+  warmStart: LatencyHistogram;
+  coldStart: LatencyHistogram;
+}
+
+/** fragmented MP4 output, delivered when `fragments` is on */
+export interface Mp4Fragment {
+  /** `init` (ftyp + moov) precedes the first fragment and every new segment */
+  fragment: 'init' | 'media';
+  data: Buffer;
+  segment: number;
+  /** moof sequence number, 0 for init segments */
+  sequence: number;
+  /** in 90 kHz units */
+  decodeTime: number;
+  duration: number;
+  /** index into `layers`, simulcast only */
+  layer?: number;
 }
 
+/** the RTP packets of one frame, delivered when `rtp` has no destination */
+export interface RtpPacketBatch {
+  /** the packets back to back */
+  rtp: Buffer;
+  /** [offset, size] of every packet in `rtp` */
+  packets: Uint32Array;
+  /** RTP timestamp, from the `pts` passed to `feed()` or the time the frame was fed (see `timestampSource`) */
+  timestamp: number;
+  keyframe: boolean;
+  /** index into `layers`, simulcast only */
+  layer?: number;
+}
+
+export type EncoderCallback = (err: unknown, ok: boolean, data: NaluPayload | EncodedFrame[] | Mp4Fragment | RtpPacketBatch) => void;
+
+/** the options of `new H264Encoder()` */
+export type H264EncoderOption = Omit<EncoderOption, 'feed_type' | 'pixel_format'> & {
+  /** input frame data type, fd or buffer
+   * @default fd
+   */
+  inputType?: EncoderInputType;
+  /** pixel format fourcc */
+  pixelFormat?: number;
+};
+
 export interface RawH264EncoderConstructor {
-  new (
-    option: EncoderOption,
-    callback?: (
-      err: unknown,
-      ok: boolean,
-      data: {
-        nalu: number;
-        data: ArrayBuffer;
-      },
-    ) => void,
-  ): RawH264Encoder;
+  new (option: EncoderOption, callback?: EncoderCallback): RawH264Encoder;
+}
+
+/** one resolution of a simulcast encoder; any other option set here overrides the shared one for this layer */
+export type SimulcastLayer = Pick<EncoderOption, 'width' | 'height' | 'bitrate'> & Partial<Omit<EncoderOption, 'feed_type' | 'pixel_format' | 'inputFormat'>>;
+
+/** the input picture (`width`, `height`, `pixel_format` NV12 or YUV420, `bytesperline`) and the settings every layer shares.
+ * `convertThreads` splits the downscale of each layer; `file` only applies when set on a layer
+ */
+export interface SimulcastOption extends Omit<EncoderOption, 'bitrate' | 'inputFormat' | 'inputStride'> {
+  layers: SimulcastLayer[];
+}
+
+/** what `reconfigure()` can change on a running encoder; anything left out stays as it is */
+export type ReconfigureOption = Partial<Pick<EncoderOption, 'width' | 'height' | 'bitrate' | 'framerate' | 'level' | 'bytesperline' | 'inputFormat' | 'inputStride'>> & {
+  /** pixel format fourcc */
+  pixelFormat?: number;
+};
+
+export interface RawSimulcastEncoderConstructor {
+  new (option: SimulcastOption, callback?: EncoderCallback): RawSimulcastEncoder;
+}
+
+export interface EncoderHubOption {
+  /** encoded frames the hub keeps for subscribers that fall behind; every lag limit is capped by it
+   * @default 256
+   */
+  capacity?: number;
+  /** simulcast only: the layer to fan out
+   * @default 0
+   */
+  layer?: number;
+  /** framing of the frames handed to JS subscribers, as for the encoder */
+  outputFormat?: EncoderOption['outputFormat'];
+}
+
+export interface HubSubscribeOption {
+  /** unread frames allowed before the subscriber skips to a keyframe; defaults to the hub's capacity */
+  maxLag?: number;
+}
+
+export interface HubSubscriberStats {
+  id: number;
+  /** written by a native thread (`attachFd()`/`attachFile()`) */
+  native: boolean;
+  paused: boolean;
+  /** frames not read yet */
+  lag: number;
+  delivered: number;
+  /** frames skipped after falling behind */
+  dropped: number;
+  bytes: number;
+  /** a native sink stops on its first write error, or when its reader stalls */
+  error?: string;
+}
+
+export interface RawEncoderHub {
+  subscribe: (callback: (frame: EncodedFrame) => void, option?: HubSubscribeOption) => number;
+  attachFd: (fd: number, option?: HubSubscribeOption) => number;
+  attachFile: (path: string, option?: HubSubscribeOption) => number;
+  unsubscribe: (id: number) => boolean;
+  pause: (id: number) => boolean;
+  resume: (id: number) => boolean;
+  stats: () => HubSubscriberStats[];
+  close: () => void;
+}
+
+export interface RawEncoderHubConstructor {
+  new (encoder: RawH264Encoder | RawSimulcastEncoder, option?: EncoderHubOption): RawEncoderHub;
 }